@@ -27,6 +27,7 @@
 
 #include "log.h"
 #include "network.h"
+#include "trace.h"
 #include "transfer.h"
 #include "usb.h"
 #include "utils.h"
@@ -36,23 +37,85 @@
 #define MAX_READ_TRANSFERS 5
 #define MAX_WRITE_TRANSFERS 5
 #define MAX_QUEUED_WRITES 256
+#define MAX_SENT_REQUESTS 32
+
+// remembers when a request that expects a response was submitted. if the
+// response gets lost the entry is dropped once newer requests push it out
+static void brick_add_sent_request(Brick *brick, Packet *request) {
+	SentRequest *sent_request;
+
+	if (!request->header.response_expected) {
+		return;
+	}
+
+	if (brick->sent_requests.count >= MAX_SENT_REQUESTS) {
+		array_remove(&brick->sent_requests, 0, NULL);
+	}
+
+	sent_request = array_append(&brick->sent_requests);
+
+	if (sent_request == NULL) {
+		log_error("Could not append to sent request array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return;
+	}
+
+	sent_request->uid = request->header.uid;
+	sent_request->function_id = request->header.function_id;
+	sent_request->sequence_number = request->header.sequence_number;
+	sent_request->timestamp = microseconds();
+}
+
+// returns the time the matching request was submitted, or 0 if it is unknown
+static uint64_t brick_remove_sent_request(Brick *brick, Packet *response) {
+	int i;
+	SentRequest *sent_request;
+	uint64_t timestamp;
+
+	for (i = 0; i < brick->sent_requests.count; ++i) {
+		sent_request = array_get(&brick->sent_requests, i);
+
+		if (sent_request->uid == response->header.uid &&
+		    sent_request->function_id == response->header.function_id &&
+		    sent_request->sequence_number == response->header.sequence_number) {
+			timestamp = sent_request->timestamp;
+
+			array_remove(&brick->sent_requests, i, NULL);
+
+			return timestamp;
+		}
+	}
+
+	return 0;
+}
 
 static void read_transfer_callback(Transfer *transfer) {
 	const char *message = NULL;
+	uint64_t submitted;
 
 	if (transfer->handle->actual_length < (int)sizeof(PacketHeader)) {
 		log_error("Read transfer %p returned response with incomplete header (actual: %u < minimum: %d) from %s [%s]",
 		          transfer, transfer->handle->actual_length, (int)sizeof(PacketHeader),
 		          transfer->brick->product, transfer->brick->serial_number);
 
+		++transfer->brick->metrics.invalid_packets;
+
 		return;
 	}
 
+	trace_packet(TRACE_DIRECTION_BRICK_IN,
+	             TRACE_BRICK_ENDPOINT(transfer->brick->bus_number,
+	                                  transfer->brick->device_address),
+	             &transfer->packet, transfer->handle->actual_length);
+
 	if (transfer->handle->actual_length != transfer->packet.header.length) {
 		log_error("Read transfer %p returned response with length mismatch (actual: %u != expected: %u) from %s [%s]",
 		          transfer, transfer->handle->actual_length, transfer->packet.header.length,
 		          transfer->brick->product, transfer->brick->serial_number);
 
+		++transfer->brick->metrics.invalid_packets;
+
 		return;
 	}
 
@@ -66,9 +129,14 @@ static void read_transfer_callback(Transfer *transfer) {
 		          transfer->brick->product, transfer->brick->serial_number,
 		          message);
 
+		++transfer->brick->metrics.invalid_packets;
+
 		return;
 	}
 
+	++transfer->brick->metrics.packets_received;
+	transfer->brick->metrics.bytes_received += transfer->packet.header.length;
+
 	if (transfer->packet.header.sequence_number == 0) {
 		log_debug("Got %scallback (U: %u, L: %u, F: %u) from %s [%s]",
 		          packet_get_callback_type(&transfer->packet),
@@ -90,15 +158,32 @@ static void read_transfer_callback(Transfer *transfer) {
 		return;
 	}
 
+	if (transfer->packet.header.sequence_number == 0 &&
+	    transfer->packet.header.function_id == CALLBACK_ENUMERATE &&
+	    transfer->packet.header.length == sizeof(EnumerateCallback)) {
+		brick_learn_enumerate_callback(transfer->brick,
+		                               (EnumerateCallback *)&transfer->packet);
+	}
+
+	if (transfer->packet.header.sequence_number == 0) {
+		network_dispatch_packet(&transfer->packet);
+
+		return;
+	}
+
+	submitted = brick_remove_sent_request(transfer->brick, &transfer->packet);
+
+	metrics_begin_response(&transfer->brick->metrics, submitted, microseconds());
 	network_dispatch_packet(&transfer->packet);
+	metrics_end_response();
 }
 
 static void write_transfer_callback(Transfer *transfer) {
 	Packet *packet;
 
-	if (transfer->brick->write_queue.count > 0) {
-		packet = array_get(&transfer->brick->write_queue, 0);
+	packet = write_queue_peek(&transfer->brick->write_queue);
 
+	if (packet != NULL) {
 		memcpy(&transfer->packet, packet, packet->header.length);
 
 		if (transfer_submit(transfer) < 0) {
@@ -112,27 +197,30 @@ static void write_transfer_callback(Transfer *transfer) {
 			return;
 		}
 
-		array_remove(&transfer->brick->write_queue, 0, NULL);
+		brick_add_sent_request(transfer->brick, packet);
 
 		log_debug("Sent queued request (U: %u, L: %u, F: %u, S: %u, R: %u) to %s [%s], %d requests left in queue",
 		          packet->header.uid, packet->header.length,
 		          packet->header.function_id, packet->header.sequence_number,
 		          packet->header.response_expected,
 		          transfer->brick->product, transfer->brick->serial_number,
-		          transfer->brick->write_queue.count);
+		          transfer->brick->write_queue.count - 1);
+
+		write_queue_pop(&transfer->brick->write_queue);
 	}
 }
 
-int brick_create(Brick *brick, uint8_t bus_number, uint8_t device_address) {
+int brick_create(Brick *brick, BrickBackend *backend, uint8_t bus_number,
+                 uint8_t device_address) {
 	int phase = 0;
-	int rc;
-	libusb_device **devices;
-	libusb_device *device;
-	int i = 0;
+	int i;
 	Transfer *transfer;
 
-	log_debug("Creating Brick from USB device (bus: %u, device: %u)",
-	          bus_number, device_address);
+	log_debug("Creating Brick from %s device (bus: %u, device: %u)",
+	          backend->name, bus_number, device_address);
+
+	brick->backend = backend;
+	brick->opaque = NULL;
 
 	brick->bus_number = bus_number;
 	brick->device_address = device_address;
@@ -141,128 +229,14 @@ int brick_create(Brick *brick, uint8_t bus_number, uint8_t device_address) {
 	brick->device = NULL;
 	brick->device_handle = NULL;
 
-	// initialize per-device libusb context
-	if (usb_create_context(&brick->context) < 0) {
-		goto cleanup;
-	}
-
-	phase = 1;
-
-	// find device
-	rc = libusb_get_device_list(brick->context, &devices);
-
-	if (rc < 0) {
-		log_error("Could not get USB device list: %s (%d)",
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
-
-	for (device = devices[0]; device != NULL; device = devices[i++]) {
-		if (brick->bus_number == libusb_get_bus_number(device) &&
-			brick->device_address == libusb_get_device_address(device)) {
-			brick->device = libusb_ref_device(device);
-			break;
-		}
-	}
-
-	libusb_free_device_list(devices, 1);
-
-	if (brick->device == NULL) {
-		log_error("Could not find USB device (bus: %u, device: %u)",
-		          brick->bus_number, brick->device_address);
-
-		goto cleanup;
-	}
-
-	phase = 2;
-
-	// get device descriptor
-	rc = libusb_get_device_descriptor(brick->device, &brick->device_descriptor);
-
-	if (rc < 0) {
-		log_error("Could not get device descriptor for USB device (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
+	memset(&brick->metrics, 0, sizeof(brick->metrics));
 
 	// open device
-	rc = libusb_open(brick->device, &brick->device_handle);
-
-	if (rc < 0) {
-		log_error("Could not open USB device (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
-
-	phase = 3;
-
-	// reset device
-	rc = libusb_reset_device(brick->device_handle);
-
-	if (rc < 0) {
-		log_error("Could not reset USB device (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
-
-	// set device configuration
-	rc = libusb_set_configuration(brick->device_handle, USB_CONFIGURATION);
-
-	if (rc < 0) {
-		log_error("Could set USB device configuration (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
-
-	// claim device interface
-	rc = libusb_claim_interface(brick->device_handle, USB_INTERFACE);
-
-	if (rc < 0) {
-		log_error("Could not claim USB device interface (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
+	if (brick->backend->open(brick) < 0) {
 		goto cleanup;
 	}
 
-	phase = 4;
-
-	// get product string descriptor
-	rc = libusb_get_string_descriptor_ascii(brick->device_handle,
-	                                        brick->device_descriptor.iProduct,
-	                                        (unsigned char *)brick->product,
-	                                        sizeof(brick->product));
-
-	if (rc < 0) {
-		log_error("Could not get product string descriptor for USB device (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
-
-	// get serial number string descriptor
-	rc = libusb_get_string_descriptor_ascii(brick->device_handle,
-	                                        brick->device_descriptor.iSerialNumber,
-	                                        (unsigned char *)brick->serial_number,
-	                                        sizeof(brick->serial_number));
-
-	if (rc < 0) {
-		log_error("Could not get serial number string descriptor for USB device (bus: %u, device: %u): %s (%d)",
-		          brick->bus_number, brick->device_address,
-		          get_libusb_error_name(rc), rc);
-
-		goto cleanup;
-	}
+	phase = 1;
 
 	// allocate and submit read transfers
 	if (array_create(&brick->read_transfers, MAX_READ_TRANSFERS,
@@ -296,7 +270,7 @@ int brick_create(Brick *brick, uint8_t bus_number, uint8_t device_address) {
 		}
 	}
 
-	phase = 5;
+	phase = 2;
 
 	// allocate write transfers
 	if (array_create(&brick->write_transfers, MAX_WRITE_TRANSFERS,
@@ -326,7 +300,7 @@ int brick_create(Brick *brick, uint8_t bus_number, uint8_t device_address) {
 		}
 	}
 
-	phase = 6;
+	phase = 3;
 
 	if (array_create(&brick->uids, 32, sizeof(uint32_t), 1) < 0) {
 		log_error("Could not create UID array: %s (%d)",
@@ -335,65 +309,79 @@ int brick_create(Brick *brick, uint8_t bus_number, uint8_t device_address) {
 		goto cleanup;
 	}
 
-	phase = 7;
+	phase = 4;
 
-	if (array_create(&brick->write_queue, 32, sizeof(Packet), 1) < 0) {
-		log_error("Could not create write queue array: %s (%d)",
+	if (write_queue_create(&brick->write_queue) < 0) {
+		goto cleanup;
+	}
+
+	phase = 5;
+
+	if (array_create(&brick->enumerate_callbacks, 16,
+	                 sizeof(EnumerateCallback), 1) < 0) {
+		log_error("Could not create enumerate callback array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	brick->enumerate_requested = 0;
+
+	phase = 6;
+
+	if (array_create(&brick->sent_requests, MAX_SENT_REQUESTS,
+	                 sizeof(SentRequest), 1) < 0) {
+		log_error("Could not create sent request array: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	phase = 8;
+	phase = 7;
 
 cleanup:
 	switch (phase) { // no breaks, all cases fall through intentionally
-	case 7:
-		array_destroy(&brick->uids, NULL);
-
 	case 6:
-		array_destroy(&brick->write_transfers, (FreeFunction)transfer_destroy);
+		array_destroy(&brick->enumerate_callbacks, NULL);
 
 	case 5:
-		array_destroy(&brick->read_transfers, (FreeFunction)transfer_destroy);
+		write_queue_destroy(&brick->write_queue);
 
 	case 4:
-		libusb_release_interface(brick->device_handle, USB_INTERFACE);
+		array_destroy(&brick->uids, NULL);
 
 	case 3:
-		libusb_close(brick->device_handle);
+		array_destroy(&brick->write_transfers, (FreeFunction)transfer_destroy);
 
 	case 2:
-		libusb_unref_device(brick->device);
+		array_destroy(&brick->read_transfers, (FreeFunction)transfer_destroy);
 
 	case 1:
-		usb_destroy_context(brick->context);
+		brick->backend->close(brick);
 
 	default:
 		break;
 	}
 
-	return phase == 8 ? 0 : -1;
+	return phase == 7 ? 0 : -1;
 }
 
 void brick_destroy(Brick *brick) {
-	array_destroy(&brick->write_queue, NULL);
+	array_destroy(&brick->sent_requests, NULL);
+
+	array_destroy(&brick->enumerate_callbacks, NULL);
+
+	write_queue_destroy(&brick->write_queue);
 
 	array_destroy(&brick->uids, NULL);
 
 	array_destroy(&brick->read_transfers, (FreeFunction)transfer_destroy);
 	array_destroy(&brick->write_transfers, (FreeFunction)transfer_destroy);
 
-	libusb_release_interface(brick->device_handle, USB_INTERFACE);
-
-	libusb_close(brick->device_handle);
-
-	libusb_unref_device(brick->device);
-
-	usb_destroy_context(brick->context);
+	brick->backend->close(brick);
 
-	log_debug("Destroyed %s [%s] of USB device (bus: %u, device: %u)",
-	          brick->product, brick->serial_number,
+	log_debug("Destroyed %s [%s] of %s device (bus: %u, device: %u)",
+	          brick->product, brick->serial_number, brick->backend->name,
 	          brick->bus_number, brick->device_address);
 }
 
@@ -439,11 +427,60 @@ int brick_knows_uid(Brick *brick, uint32_t uid) {
 	return 0;
 }
 
-int brick_dispatch_packet(Brick *brick, Packet *packet, int force) {
+// remembers the latest enumerate callback per UID, so enumerate requests can
+// be answered without asking the Brick. a disconnected callback removes the UID
+void brick_learn_enumerate_callback(Brick *brick,
+                                    EnumerateCallback *enumerate_callback) {
+	int i;
+	EnumerateCallback *cached_callback;
+
+	for (i = 0; i < brick->enumerate_callbacks.count; ++i) {
+		cached_callback = array_get(&brick->enumerate_callbacks, i);
+
+		if (cached_callback->header.uid == enumerate_callback->header.uid) {
+			break;
+		}
+	}
+
+	if (i >= brick->enumerate_callbacks.count) {
+		if (enumerate_callback->enumeration_type == ENUMERATION_TYPE_DISCONNECTED) {
+			return;
+		}
+
+		cached_callback = array_append(&brick->enumerate_callbacks);
+
+		if (cached_callback == NULL) {
+			log_error("Could not append to enumerate callback array of %s [%s]: %s (%d)",
+			          brick->product, brick->serial_number,
+			          get_errno_name(errno), errno);
+
+			// without this UID the cache is incomplete
+			brick_invalidate_enumerate_cache(brick);
+
+			return;
+		}
+	} else if (enumerate_callback->enumeration_type == ENUMERATION_TYPE_DISCONNECTED) {
+		array_remove(&brick->enumerate_callbacks, i, NULL);
+
+		return;
+	}
+
+	memcpy(cached_callback, enumerate_callback, sizeof(EnumerateCallback));
+}
+
+void brick_invalidate_enumerate_cache(Brick *brick) {
+	brick->enumerate_requested = 0;
+
+	array_resize(&brick->enumerate_callbacks, 0, NULL);
+}
+
+// the owner is the client that sent the request. if the request has to be
+// queued then the owner gets its own sub-queue for fair queuing
+int brick_dispatch_packet(Brick *brick, Packet *packet, void *owner, int force) {
 	int i;
 	Transfer *transfer;
 	int submitted = 0;
-	Packet *queued_packet;
+	int coalesced;
 	int rc = -1;
 
 	if (force || brick_knows_uid(brick, packet->header.uid)) {
@@ -462,37 +499,45 @@ int brick_dispatch_packet(Brick *brick, Packet *packet, int force) {
 				continue;
 			}
 
+			brick_add_sent_request(brick, packet);
+
 			submitted = 1;
 
 			break;
 		}
 
 		if (!submitted) {
-			if (brick->write_queue.count >= MAX_QUEUED_WRITES) {
-				log_warn("Dropping %d items from write queue array of %s [%s]",
-				         brick->write_queue.count - MAX_QUEUED_WRITES + 1,
-				         brick->product, brick->serial_number);
+			coalesced = write_queue_push(&brick->write_queue, packet, owner);
 
-				while (brick->write_queue.count >= MAX_QUEUED_WRITES) {
-					array_remove(&brick->write_queue, 0, NULL);
-				}
+			if (coalesced < 0) {
+				goto cleanup;
 			}
 
-			queued_packet = array_append(&brick->write_queue);
+			if (coalesced) {
+				++brick->metrics.coalesced_setters;
 
-			if (queued_packet == NULL) {
-				log_error("Could not append to write queue array of %s [%s]: %s (%d)",
+				log_debug("Replaced queued request (U: %u, F: %u) for %s [%s] with a newer one (count: %d)",
+				          packet->header.uid, packet->header.function_id,
 				          brick->product, brick->serial_number,
-				          get_errno_name(errno), errno);
+				          brick->write_queue.count);
+			} else {
+				++brick->metrics.queued_requests;
 
-				goto cleanup;
+				log_info("Could not find a free write transfer for %s [%s], put request into write queue (count: %d)",
+				         brick->product, brick->serial_number,
+				         brick->write_queue.count);
 			}
 
-			log_info("Could not find a free write transfer for %s [%s], put request into write queue (count: %d)",
-			         brick->product, brick->serial_number,
-			         brick->write_queue.count);
+			if (brick->write_queue.count > MAX_QUEUED_WRITES) {
+				log_warn("Dropping %d items from write queue array of %s [%s]",
+				         brick->write_queue.count - MAX_QUEUED_WRITES,
+				         brick->product, brick->serial_number);
 
-			memcpy(queued_packet, packet, packet->header.length);
+				brick->metrics.queue_drops += brick->write_queue.count - MAX_QUEUED_WRITES;
+
+				write_queue_drop(&brick->write_queue,
+				                 brick->write_queue.count - MAX_QUEUED_WRITES);
+			}
 
 			submitted = 1;
 		} else {
@@ -24,8 +24,10 @@
 
 #include <libusb.h>
 
+#include "metrics.h"
 #include "packet.h"
 #include "utils.h"
+#include "writequeue.h"
 
 #define USB_VENDOR_ID 0x16D0
 #define USB_PRODUCT_ID 0x063D
@@ -38,6 +40,33 @@
 #define USB_ENDPOINT_OUT 5
 
 typedef struct {
+	uint32_t uid;
+	uint8_t function_id;
+	uint8_t sequence_number;
+	uint64_t timestamp; // of submitting the request, in microseconds
+} SentRequest;
+
+typedef struct _Brick Brick;
+
+struct _Transfer;
+
+// a Brick talks to its device through a backend. the USB backend uses libusb,
+// see usb.c. the simulator backend emulates a stack in-process without any
+// hardware, see simulator.c. a backend completes submitted transfers by
+// calling the callback of their libusb transfer handle from the event loop
+typedef struct {
+	const char *name;
+	int (*open)(Brick *brick);
+	void (*close)(Brick *brick);
+	int (*submit_transfer)(struct _Transfer *transfer);
+	int (*cancel_transfer)(struct _Transfer *transfer);
+} BrickBackend;
+
+struct _Brick {
+	// backend
+	BrickBackend *backend;
+	void *opaque; // backend specific data
+
 	// USB device
 	uint8_t bus_number;
 	uint8_t device_address;
@@ -52,18 +81,32 @@ typedef struct {
 
 	// Brick
 	Array uids;
-	Array write_queue;
+	WriteQueue write_queue;
+
+	// enumerate cache, learned from enumerate callbacks
+	Array enumerate_callbacks;
+	uint64_t enumerate_requested; // in microseconds, 0 means invalid
+
+	// requests that wait for a response, used for latency metrics
+	Array sent_requests;
 
 	// used by usb_update
 	int connected;
-} Brick;
 
-int brick_create(Brick *brick, uint8_t bus_number, uint8_t device_address);
+	BrickMetrics metrics;
+};
+
+int brick_create(Brick *brick, BrickBackend *backend, uint8_t bus_number,
+                 uint8_t device_address);
 void brick_destroy(Brick *brick);
 
 int brick_add_uid(Brick *brick, uint32_t uid);
 int brick_knows_uid(Brick *brick, uint32_t uid);
 
-int brick_dispatch_packet(Brick *brick, Packet *packet, int force);
+void brick_learn_enumerate_callback(Brick *brick,
+                                    EnumerateCallback *enumerate_callback);
+void brick_invalidate_enumerate_cache(Brick *brick);
+
+int brick_dispatch_packet(Brick *brick, Packet *packet, void *owner, int force);
 
 #endif // BRICKD_BRICK_H
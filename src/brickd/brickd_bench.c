@@ -0,0 +1,697 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * brickd_bench.c: Network load generator and benchmark for brickd
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * standalone tool that opens a number of TCP clients to a running brickd and
+ * runs load scenarios against it. there is no Brick hardware required if
+ * brickd simulates the stacks, see simulator.c. the defaults match the default
+ * simulator configuration with one stack.
+ *
+ * scenarios:
+ *  ping-pong  each client sends a getter and waits for its response
+ *  setters    each client keeps a window of setters with response expected
+ *             in flight
+ *  enumerate  each client sends an enumerate request and waits for the
+ *             enumerate callbacks of all UIDs, then sends the next one
+ *  callbacks  the clients only receive the callbacks of the stacks
+ *
+ * for each scenario one line with throughput, latency percentiles and the CPU
+ * usage of brickd is printed. the CPU usage is read from /proc and requires
+ * the PID of brickd, either from the -P option or from the PID file. requests
+ * that are not answered within one second are counted as timeouts. the exit
+ * status is 1 if any timeouts, error responses or lost connections occurred,
+ * so the tool can run unattended as a regression check.
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "packet.h"
+
+#define MAX_CLIENTS 1024
+#define MAX_WINDOW 15 // sequence numbers 1 to 15
+#define REQUEST_TIMEOUT 1000000 // in microseconds
+#define GETTER_FUNCTION_ID 1
+#define SETTER_FUNCTION_ID 2
+
+typedef enum {
+	SCENARIO_PING_PONG = 0,
+	SCENARIO_SETTERS,
+	SCENARIO_ENUMERATE,
+	SCENARIO_CALLBACKS,
+	SCENARIO_COUNT
+} Scenario;
+
+static const char *_scenario_names[SCENARIO_COUNT] = {
+	"ping-pong",
+	"setters",
+	"enumerate",
+	"callbacks"
+};
+
+typedef struct {
+	int socket;
+	uint8_t buffer[4096];
+	int buffer_used;
+	int next_sequence_number;
+	uint64_t sent[MAX_WINDOW + 1]; // in microseconds, 0 means free
+	int in_flight;
+	int next_uid;
+	int enumerate_callbacks;
+	uint64_t operations;
+} BenchClient;
+
+typedef struct {
+	uint32_t *values; // in microseconds
+	int count;
+	int allocated;
+} LatencyArray;
+
+typedef struct {
+	uint64_t operations;
+	uint64_t timeouts;
+	uint64_t errors;
+	LatencyArray latencies;
+} BenchResult;
+
+static const char *_host = "127.0.0.1";
+static const char *_port = "4223";
+static int _client_count = 1;
+static int _duration = 5; // in seconds
+static uint32_t _first_uid = 1000;
+static int _uid_count = 3;
+static int _window = 8;
+static int _pid = 0;
+static const char *_pid_filename = "/var/run/brickd.pid";
+static BenchClient _clients[MAX_CLIENTS];
+
+static uint64_t now_microseconds(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void latency_append(LatencyArray *latencies, uint64_t value) {
+	uint32_t *values;
+
+	if (latencies->count >= latencies->allocated) {
+		latencies->allocated = latencies->allocated > 0 ? latencies->allocated * 2 : 4096;
+		values = realloc(latencies->values, latencies->allocated * sizeof(uint32_t));
+
+		if (values == NULL) {
+			fprintf(stderr, "Could not grow latency array\n");
+
+			exit(1);
+		}
+
+		latencies->values = values;
+	}
+
+	latencies->values[latencies->count++] = value > 0xFFFFFFFF ? 0xFFFFFFFF : (uint32_t)value;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// expects the values to be sorted
+static void format_percentile(char *buffer, int length, LatencyArray *latencies,
+                              double quantile) {
+	int index;
+
+	if (latencies->count == 0) {
+		snprintf(buffer, length, "-");
+
+		return;
+	}
+
+	index = (int)(quantile * latencies->count);
+
+	if (index >= latencies->count) {
+		index = latencies->count - 1;
+	}
+
+	snprintf(buffer, length, "%u", latencies->values[index]);
+}
+
+// returns user plus system time of brickd in clock ticks, or -1 if unknown
+static long read_cpu_ticks(void) {
+	char filename[64];
+	char buffer[1024];
+	FILE *fp;
+	size_t length;
+	char *p;
+	unsigned long utime;
+	unsigned long stime;
+
+	if (_pid <= 0) {
+		return -1;
+	}
+
+	snprintf(filename, sizeof(filename), "/proc/%d/stat", _pid);
+
+	fp = fopen(filename, "rb");
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	length = fread(buffer, 1, sizeof(buffer) - 1, fp);
+
+	fclose(fp);
+
+	buffer[length] = '\0';
+
+	// the process name in parenthesis can contain spaces, skip it
+	p = strrchr(buffer, ')');
+
+	if (p == NULL ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+	           &utime, &stime) != 2) {
+		return -1;
+	}
+
+	return (long)(utime + stime);
+}
+
+static void read_pid_file(void) {
+	FILE *fp;
+
+	if (_pid > 0) {
+		return;
+	}
+
+	fp = fopen(_pid_filename, "rb");
+
+	if (fp == NULL) {
+		return;
+	}
+
+	if (fscanf(fp, "%d", &_pid) != 1) {
+		_pid = 0;
+	}
+
+	fclose(fp);
+}
+
+static int connect_client(BenchClient *client) {
+	struct addrinfo hints;
+	struct addrinfo *resolved;
+	int rc;
+	int flag = 1;
+
+	memset(client, 0, sizeof(BenchClient));
+
+	client->next_sequence_number = 1;
+
+	memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	rc = getaddrinfo(_host, _port, &hints, &resolved);
+
+	if (rc != 0) {
+		fprintf(stderr, "Could not resolve %s:%s: %s\n",
+		        _host, _port, gai_strerror(rc));
+
+		return -1;
+	}
+
+	client->socket = socket(resolved->ai_family, resolved->ai_socktype,
+	                        resolved->ai_protocol);
+
+	if (client->socket < 0) {
+		fprintf(stderr, "Could not create socket: %s (%d)\n",
+		        strerror(errno), errno);
+
+		freeaddrinfo(resolved);
+
+		return -1;
+	}
+
+	if (connect(client->socket, resolved->ai_addr, resolved->ai_addrlen) < 0) {
+		fprintf(stderr, "Could not connect to %s:%s: %s (%d)\n",
+		        _host, _port, strerror(errno), errno);
+
+		close(client->socket);
+		freeaddrinfo(resolved);
+
+		return -1;
+	}
+
+	freeaddrinfo(resolved);
+
+	setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+	return 0;
+}
+
+static int send_packet(BenchClient *client, Packet *packet) {
+	int offset = 0;
+	ssize_t rc;
+
+	while (offset < packet->header.length) {
+		rc = send(client->socket, (uint8_t *)packet + offset,
+		          packet->header.length - offset, 0);
+
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		offset += rc;
+	}
+
+	return 0;
+}
+
+static int send_request(BenchClient *client, Scenario scenario, uint64_t now) {
+	Packet request;
+	int sequence_number;
+	int i;
+
+	memset(&request, 0, sizeof(request));
+
+	if (scenario == SCENARIO_ENUMERATE) {
+		request.header.uid = 0;
+		request.header.length = sizeof(PacketHeader);
+		request.header.function_id = FUNCTION_ENUMERATE;
+		request.header.sequence_number = 1;
+
+		client->enumerate_callbacks = 0;
+		client->sent[1] = now;
+		client->in_flight = 1;
+
+		return send_packet(client, &request);
+	}
+
+	// find a free sequence number
+	for (i = 0; i < MAX_WINDOW; ++i) {
+		sequence_number = client->next_sequence_number;
+		client->next_sequence_number = client->next_sequence_number % MAX_WINDOW + 1;
+
+		if (client->sent[sequence_number] == 0) {
+			break;
+		}
+	}
+
+	request.header.uid = _first_uid + client->next_uid;
+	request.header.sequence_number = sequence_number;
+	request.header.response_expected = 1;
+
+	if (scenario == SCENARIO_SETTERS) {
+		request.header.length = sizeof(PacketHeader) + sizeof(uint32_t);
+		request.header.function_id = SETTER_FUNCTION_ID;
+
+		memcpy(request.payload, &client->operations, sizeof(uint32_t));
+	} else {
+		request.header.length = sizeof(PacketHeader);
+		request.header.function_id = GETTER_FUNCTION_ID;
+	}
+
+	client->next_uid = (client->next_uid + 1) % _uid_count;
+	client->sent[sequence_number] = now;
+	++client->in_flight;
+
+	return send_packet(client, &request);
+}
+
+static int fill_window(BenchClient *client, Scenario scenario, int window,
+                       uint64_t now) {
+	while (client->in_flight < window) {
+		if (send_request(client, scenario, now) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void handle_packet(BenchClient *client, Scenario scenario, Packet *packet,
+                          uint64_t now, BenchResult *result) {
+	int sequence_number = packet->header.sequence_number;
+
+	switch (scenario) {
+	case SCENARIO_PING_PONG:
+	case SCENARIO_SETTERS:
+		if (sequence_number == 0 || client->sent[sequence_number] == 0) {
+			return; // callback or response to a timed out request
+		}
+
+		latency_append(&result->latencies, now - client->sent[sequence_number]);
+
+		client->sent[sequence_number] = 0;
+		--client->in_flight;
+		++client->operations;
+
+		if (packet->header.error_code != 0) {
+			++result->errors;
+		}
+
+		break;
+
+	case SCENARIO_ENUMERATE:
+		if (sequence_number != 0 || packet->header.function_id != CALLBACK_ENUMERATE ||
+		    client->in_flight == 0) {
+			return;
+		}
+
+		if (++client->enumerate_callbacks < _uid_count) {
+			return;
+		}
+
+		latency_append(&result->latencies, now - client->sent[1]);
+
+		client->sent[1] = 0;
+		client->in_flight = 0;
+		++client->operations;
+
+		break;
+
+	case SCENARIO_CALLBACKS:
+		if (sequence_number == 0) {
+			++client->operations;
+		}
+
+		break;
+
+	default:
+		break;
+	}
+}
+
+// returns -1 if the connection got lost
+static int receive_packets(BenchClient *client, Scenario scenario,
+                           BenchResult *result) {
+	ssize_t length;
+	int offset = 0;
+	uint64_t now;
+	Packet *packet;
+
+	length = recv(client->socket, client->buffer + client->buffer_used,
+	              sizeof(client->buffer) - client->buffer_used, 0);
+
+	if (length <= 0) {
+		if (length < 0 && errno == EINTR) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	client->buffer_used += length;
+	now = now_microseconds();
+
+	while (client->buffer_used - offset >= (int)sizeof(PacketHeader)) {
+		packet = (Packet *)(client->buffer + offset);
+
+		if (packet->header.length < sizeof(PacketHeader) ||
+		    packet->header.length > sizeof(Packet)) {
+			fprintf(stderr, "Received packet with invalid length %u\n",
+			        packet->header.length);
+
+			return -1;
+		}
+
+		if (client->buffer_used - offset < packet->header.length) {
+			break;
+		}
+
+		handle_packet(client, scenario, packet, now, result);
+
+		offset += packet->header.length;
+	}
+
+	memmove(client->buffer, client->buffer + offset, client->buffer_used - offset);
+
+	client->buffer_used -= offset;
+
+	return 0;
+}
+
+static void expire_requests(BenchClient *client, uint64_t now,
+                            BenchResult *result) {
+	int i;
+
+	for (i = 1; i <= MAX_WINDOW; ++i) {
+		if (client->sent[i] != 0 && client->sent[i] + REQUEST_TIMEOUT < now) {
+			client->sent[i] = 0;
+			--client->in_flight;
+			++result->timeouts;
+		}
+	}
+}
+
+static int run_scenario(Scenario scenario) {
+	BenchResult result;
+	struct pollfd pollfds[MAX_CLIENTS];
+	int window;
+	int i;
+	int rc;
+	uint64_t start;
+	uint64_t now;
+	uint64_t end;
+	long cpu_start;
+	long cpu_end;
+	double elapsed;
+	char p50[16];
+	char p99[16];
+	char p999[16];
+	char cpu[16] = "-";
+	int lost_connections = 0;
+
+	memset(&result, 0, sizeof(result));
+
+	switch (scenario) {
+	case SCENARIO_PING_PONG: window = 1;       break;
+	case SCENARIO_SETTERS:   window = _window; break;
+	case SCENARIO_ENUMERATE: window = 1;       break;
+	default:                 window = 0;       break;
+	}
+
+	for (i = 0; i < _client_count; ++i) {
+		if (connect_client(&_clients[i]) < 0) {
+			while (--i >= 0) {
+				close(_clients[i].socket);
+			}
+
+			return -1;
+		}
+
+		pollfds[i].fd = _clients[i].socket;
+		pollfds[i].events = POLLIN;
+	}
+
+	cpu_start = read_cpu_ticks();
+	start = now_microseconds();
+	end = start + (uint64_t)_duration * 1000000;
+
+	for (i = 0; i < _client_count; ++i) {
+		if (fill_window(&_clients[i], scenario, window, start) < 0) {
+			pollfds[i].fd = -1;
+			++lost_connections;
+		}
+	}
+
+	for (now = start; now < end; now = now_microseconds()) {
+		rc = poll(pollfds, _client_count, 10);
+
+		if (rc < 0 && errno != EINTR) {
+			fprintf(stderr, "Could not poll sockets: %s (%d)\n",
+			        strerror(errno), errno);
+
+			break;
+		}
+
+		now = now_microseconds();
+
+		for (i = 0; i < _client_count; ++i) {
+			if (pollfds[i].fd < 0) {
+				continue;
+			}
+
+			if (pollfds[i].revents != 0 &&
+			    receive_packets(&_clients[i], scenario, &result) < 0) {
+				pollfds[i].fd = -1;
+				++lost_connections;
+
+				continue;
+			}
+
+			expire_requests(&_clients[i], now, &result);
+
+			if (fill_window(&_clients[i], scenario, window, now) < 0) {
+				pollfds[i].fd = -1;
+				++lost_connections;
+			}
+		}
+	}
+
+	elapsed = (now_microseconds() - start) / 1000000.0;
+	cpu_end = read_cpu_ticks();
+
+	for (i = 0; i < _client_count; ++i) {
+		result.operations += _clients[i].operations;
+
+		close(_clients[i].socket);
+	}
+
+	qsort(result.latencies.values, result.latencies.count, sizeof(uint32_t),
+	      compare_latencies);
+
+	format_percentile(p50, sizeof(p50), &result.latencies, 0.5);
+	format_percentile(p99, sizeof(p99), &result.latencies, 0.99);
+	format_percentile(p999, sizeof(p999), &result.latencies, 0.999);
+
+	if (cpu_start >= 0 && cpu_end >= 0) {
+		snprintf(cpu, sizeof(cpu), "%.1f",
+		         (cpu_end - cpu_start) * 100.0 / sysconf(_SC_CLK_TCK) / elapsed);
+	}
+
+	printf("%-10s %7d %10llu %10.1f %8s %8s %8s %8llu %6llu %5d %6s\n",
+	       _scenario_names[scenario], _client_count,
+	       (unsigned long long)result.operations, result.operations / elapsed,
+	       p50, p99, p999, (unsigned long long)result.timeouts,
+	       (unsigned long long)result.errors, lost_connections, cpu);
+
+	fflush(stdout);
+
+	free(result.latencies.values);
+
+	return result.timeouts > 0 || result.errors > 0 || lost_connections > 0 ? 1 : 0;
+}
+
+static void print_usage(const char *program) {
+	printf("Usage: %s [options] [scenario...]\n"
+	       "\n"
+	       "Scenarios: ping-pong, setters, enumerate, callbacks (default: all)\n"
+	       "\n"
+	       "Options:\n"
+	       "  -h <host>      brickd host (default: %s)\n"
+	       "  -p <port>      brickd port (default: %s)\n"
+	       "  -c <clients>   number of TCP clients (default: %d)\n"
+	       "  -d <seconds>   duration per scenario (default: %d)\n"
+	       "  -u <uid>       first UID (default: %u)\n"
+	       "  -n <count>     number of UIDs (default: %d)\n"
+	       "  -w <requests>  setters in flight per client, 1 to %d (default: %d)\n"
+	       "  -P <pid>       PID of brickd for CPU usage\n"
+	       "  -f <file>      PID file of brickd (default: %s)\n",
+	       program, _host, _port, _client_count, _duration, _first_uid,
+	       _uid_count, MAX_WINDOW, _window, _pid_filename);
+}
+
+int main(int argc, char **argv) {
+	int option;
+	int selected[SCENARIO_COUNT];
+	int any_selected = 0;
+	int i;
+	int k;
+	int rc;
+	int exit_code = 0;
+
+	while ((option = getopt(argc, argv, "h:p:c:d:u:n:w:P:f:")) != -1) {
+		switch (option) {
+		case 'h': _host = optarg;                         break;
+		case 'p': _port = optarg;                         break;
+		case 'c': _client_count = atoi(optarg);           break;
+		case 'd': _duration = atoi(optarg);               break;
+		case 'u': _first_uid = strtoul(optarg, NULL, 10); break;
+		case 'n': _uid_count = atoi(optarg);              break;
+		case 'w': _window = atoi(optarg);                 break;
+		case 'P': _pid = atoi(optarg);                    break;
+		case 'f': _pid_filename = optarg;                 break;
+
+		default:
+			print_usage(argv[0]);
+
+			return 1;
+		}
+	}
+
+	if (_client_count < 1 || _client_count > MAX_CLIENTS || _duration < 1 ||
+	    _uid_count < 1 || _window < 1 || _window > MAX_WINDOW) {
+		print_usage(argv[0]);
+
+		return 1;
+	}
+
+	memset(selected, 0, sizeof(selected));
+
+	for (i = optind; i < argc; ++i) {
+		for (k = 0; k < SCENARIO_COUNT; ++k) {
+			if (strcmp(argv[i], _scenario_names[k]) == 0) {
+				selected[k] = 1;
+				any_selected = 1;
+
+				break;
+			}
+		}
+
+		if (k == SCENARIO_COUNT) {
+			fprintf(stderr, "Unknown scenario '%s'\n\n", argv[i]);
+			print_usage(argv[0]);
+
+			return 1;
+		}
+	}
+
+	read_pid_file();
+
+	printf("%-10s %7s %10s %10s %8s %8s %8s %8s %6s %5s %6s\n",
+	       "scenario", "clients", "operations", "ops/s", "p50(us)", "p99(us)",
+	       "p999(us)", "timeouts", "errors", "lost", "cpu(%)");
+
+	for (k = 0; k < SCENARIO_COUNT; ++k) {
+		if (any_selected && !selected[k]) {
+			continue;
+		}
+
+		rc = run_scenario(k);
+
+		if (rc < 0) {
+			return 1;
+		}
+
+		if (rc > 0) {
+			exit_code = 1;
+		}
+	}
+
+	return exit_code;
+}
@@ -36,22 +36,30 @@
 
 %CC%^
  brick.c^
+ cache.c^
  client.c^
  config.c^
  event.c^
  event_winapi.c^
+ inflight.c^
  log.c^
  log_winapi.c^
  main_windows.c^
+ metrics.c^
  msvcfixes.c^
  network.c^
  packet.c^
  pipe_winapi.c^
+ replay.c^
+ simulator.c^
  socket_winapi.c^
  threads_winapi.c^
+ throttle.c^
+ trace.c^
  transfer.c^
  usb.c^
- utils.c
+ utils.c^
+ writequeue.c
 
 %RC% /folog_messages.res log_messages.rc
 %RC% /fobrickd.res brickd.rc
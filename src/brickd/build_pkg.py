@@ -137,6 +137,7 @@ def build_linux_pkg():
 
     os.system('chown -R root:root dist/usr')
     os.system('chown -R root:root dist/etc')
+    os.system('chown -R root:root dist/lib')
 
     os.system('chmod 0644 dist/DEBIAN/md5sums')
     os.system('chmod 0755 dist/DEBIAN/preinst')
@@ -0,0 +1,284 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * cache.c: Response cache for getter functions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * the response cache is opt-in per function ID, because brickd cannot tell
+ * getters from setters. a cached response is keyed by UID, function ID and
+ * request payload. the request payload for a response is provided by the
+ * in-flight request tracking, see inflight.c.
+ *
+ * the cache can hold up to 65536 entries and is used for every cacheable
+ * request and response on the event loop thread. therefore, the entries are
+ * indexed by a hash of their key, with one chain of entries per bucket. if
+ * the cache is full then the entries are replaced in the order they were
+ * added. expired entries are not removed, they are replaced like this as well.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+#include "utils.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_NETWORK
+
+typedef struct {
+	Packet request;
+	Packet response;
+	uint64_t expiry;
+	uint32_t hash;
+	int next; // index of the next entry in the same bucket, -1 for none
+} CacheEntry;
+
+static Array _entries = ARRAY_INITIALIZER;
+static int *_buckets = NULL; // index of the first entry per bucket, -1 for none
+static uint32_t _bucket_mask = 0;
+static int _capacity = 0;
+static int _next_replaced = 0;
+
+static int cache_is_enabled(uint8_t function_id) {
+	return config_get_response_cache_ttl(function_id) > 0;
+}
+
+static int cache_matches_request(CacheEntry *entry, Packet *request) {
+	return entry->request.header.uid == request->header.uid &&
+	       entry->request.header.function_id == request->header.function_id &&
+	       entry->request.header.length == request->header.length &&
+	       memcmp(entry->request.payload, request->payload,
+	              request->header.length - sizeof(PacketHeader)) == 0;
+}
+
+// FNV-1a over UID, function ID and payload
+static uint32_t cache_hash_request(Packet *request) {
+	uint32_t hash = 2166136261u;
+	uint8_t *payload = request->payload;
+	int length = request->header.length - (int)sizeof(PacketHeader);
+	int i;
+
+	hash = (hash ^ (request->header.uid & 0xFF)) * 16777619u;
+	hash = (hash ^ ((request->header.uid >> 8) & 0xFF)) * 16777619u;
+	hash = (hash ^ ((request->header.uid >> 16) & 0xFF)) * 16777619u;
+	hash = (hash ^ (request->header.uid >> 24)) * 16777619u;
+	hash = (hash ^ request->header.function_id) * 16777619u;
+
+	for (i = 0; i < length; ++i) {
+		hash = (hash ^ payload[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+// drops all entries and prepares the index for the given number of entries
+static int cache_reset(int capacity) {
+	uint32_t bucket_count = 1;
+	uint32_t i;
+
+	array_resize(&_entries, 0, NULL);
+
+	free(_buckets);
+
+	_buckets = NULL;
+	_bucket_mask = 0;
+	_capacity = 0;
+	_next_replaced = 0;
+
+	while (bucket_count < (uint32_t)capacity) {
+		bucket_count <<= 1;
+	}
+
+	_buckets = malloc(bucket_count * sizeof(int));
+
+	if (_buckets == NULL) {
+		errno = ENOMEM;
+
+		log_error("Could not allocate response cache index: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	for (i = 0; i < bucket_count; ++i) {
+		_buckets[i] = -1;
+	}
+
+	_bucket_mask = bucket_count - 1;
+	_capacity = capacity;
+
+	return 0;
+}
+
+static CacheEntry *cache_find_entry(Packet *request, uint32_t hash) {
+	int index = _buckets[hash & _bucket_mask];
+	CacheEntry *entry;
+
+	while (index >= 0) {
+		entry = array_get(&_entries, index);
+
+		if (entry->hash == hash && cache_matches_request(entry, request)) {
+			return entry;
+		}
+
+		index = entry->next;
+	}
+
+	return NULL;
+}
+
+static void cache_unlink_entry(int index) {
+	CacheEntry *entry = array_get(&_entries, index);
+	int *link = &_buckets[entry->hash & _bucket_mask];
+
+	while (*link != index) {
+		link = &((CacheEntry *)array_get(&_entries, *link))->next;
+	}
+
+	*link = entry->next;
+}
+
+int cache_init(void) {
+	log_debug("Initializing response cache");
+
+	if (array_create(&_entries, 32, sizeof(CacheEntry), 1) < 0) {
+		log_error("Could not create cache entry array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	if (cache_reset(config_get_response_cache_size()) < 0) {
+		array_destroy(&_entries, NULL);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void cache_exit(void) {
+	log_debug("Shutting down response cache");
+
+	array_destroy(&_entries, NULL);
+
+	free(_buckets);
+
+	_buckets = NULL;
+}
+
+// returns 1 and fills the response if there is a valid cache entry for the
+// request, the sequence number of the response is set to the one of the request
+int cache_lookup(Packet *request, Packet *response) {
+	CacheEntry *entry;
+
+	if (request->header.uid == 0 || !request->header.response_expected ||
+	    !cache_is_enabled(request->header.function_id) || _buckets == NULL) {
+		return 0;
+	}
+
+	entry = cache_find_entry(request, cache_hash_request(request));
+
+	if (entry == NULL || entry->expiry <= microseconds()) {
+		return 0;
+	}
+
+	memcpy(response, &entry->response, entry->response.header.length);
+
+	response->header.sequence_number = request->header.sequence_number;
+
+	metrics_increment(METRIC_CACHE_HITS);
+
+	log_debug("Answering request (U: %u, L: %u, F: %u, S: %u) from response cache",
+	          request->header.uid, request->header.length,
+	          request->header.function_id, request->header.sequence_number);
+
+	return 1;
+}
+
+// adds the response to the cache, the request is the in-flight request the
+// response belongs to
+void cache_add_response(Packet *request, Packet *response) {
+	int index;
+	CacheEntry *entry;
+	uint32_t hash;
+	uint32_t ttl;
+
+	if (response->header.error_code != 0 ||
+	    !cache_is_enabled(response->header.function_id)) {
+		return;
+	}
+
+	// the size can change on a config reload
+	if (_capacity != config_get_response_cache_size()) {
+		log_debug("Resizing response cache from %d to %d entries, dropping %d entries",
+		          _capacity, config_get_response_cache_size(), _entries.count);
+
+		if (cache_reset(config_get_response_cache_size()) < 0) {
+			return;
+		}
+	}
+
+	// replace an existing entry for the same request, or the entry that was
+	// added first if the cache is full
+	hash = cache_hash_request(request);
+	entry = cache_find_entry(request, hash);
+
+	if (entry == NULL) {
+		if (_entries.count < _capacity) {
+			entry = array_append(&_entries);
+
+			if (entry == NULL) {
+				log_error("Could not append to cache entry array: %s (%d)",
+				          get_errno_name(errno), errno);
+
+				return;
+			}
+
+			index = _entries.count - 1;
+		} else {
+			index = _next_replaced;
+			_next_replaced = (_next_replaced + 1) % _capacity;
+
+			cache_unlink_entry(index);
+
+			entry = array_get(&_entries, index);
+		}
+
+		entry->hash = hash;
+		entry->next = _buckets[hash & _bucket_mask];
+		_buckets[hash & _bucket_mask] = index;
+	}
+
+	ttl = config_get_response_cache_ttl(response->header.function_id);
+
+	memcpy(&entry->request, request, request->header.length);
+	memcpy(&entry->response, response, response->header.length);
+
+	entry->expiry = microseconds() + (uint64_t)ttl * 1000;
+
+	log_debug("Added response (U: %u, L: %u, F: %u, S: %u) to response cache for %u msec",
+	          response->header.uid, response->header.length,
+	          response->header.function_id, response->header.sequence_number,
+	          ttl);
+}
@@ -0,0 +1,34 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * cache.h: Response cache for getter functions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_CACHE_H
+#define BRICKD_CACHE_H
+
+#include "packet.h"
+
+int cache_init(void);
+void cache_exit(void);
+
+int cache_lookup(Packet *request, Packet *response);
+
+void cache_add_response(Packet *request, Packet *response);
+
+#endif // BRICKD_CACHE_H
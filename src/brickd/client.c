@@ -25,183 +25,539 @@
 
 #include "client.h"
 
+#include "cache.h"
+#include "config.h"
+#include "inflight.h"
 #include "log.h"
 #include "network.h"
 #include "socket.h"
+#include "trace.h"
 #include "usb.h"
 
 #define LOG_CATEGORY LOG_CATEGORY_NETWORK
 
 #define MAX_PENDING_REQUESTS 256
+#define MAX_LOGGED_INVALID_REQUESTS 5 // per client
+#define MAX_UID_BUCKETS 256
+
+// one token in the millionths of a token used by TokenBucket
+#define TOKEN 1000000
 
 static const char *_unknown_peer_name = "<unknown>";
 
-static void client_handle_receive(void *opaque) {
-	Client *client = opaque;
-	const char *message = NULL;
-	int length;
-	PacketHeader *pending_request;
+// enumerate requests are answered from the enumerate caches of the Bricks for
+// this client only, instead of letting every Brick send all its enumerate
+// callbacks to all clients
+static void client_handle_enumerate_request(Client *client, Packet *request) {
+	Array callbacks;
+	int i;
 
-	length = socket_receive(client->socket,
-	                        (uint8_t *)&client->packet + client->packet_used,
-	                        sizeof(Packet) - client->packet_used);
+	if (array_create(&callbacks, 32, sizeof(EnumerateCallback), 1) < 0) {
+		log_error("Could not create enumerate callback array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	if (length < 0) {
-		if (errno_interrupted()) {
-			log_debug("Receiving from client (socket: %d, peer: %s), got interrupted",
-			          client->socket, client->peer);
-		} else {
-			log_error("Could not receive from client (socket: %d, peer: %s), disconnecting it: %s (%d)",
-			          client->socket, client->peer, get_errno_name(errno), errno);
+		usb_dispatch_packet(request, client);
 
-			network_client_disconnected(client);
+		return;
+	}
+
+	usb_dispatch_enumerate_request(request, client, &callbacks);
+
+	if (callbacks.count > 0) {
+		log_debug("Sending %d cached enumerate callback(s) to client (socket: %d, peer: %s)",
+		          callbacks.count, client->socket, client_get_peer_name(client));
+	}
+
+	for (i = 0; i < callbacks.count; ++i) {
+		if (client_dispatch_packet(client, array_get(&callbacks, i), 1) < 0) {
+			break;
 		}
+	}
 
-		return;
+	array_destroy(&callbacks, NULL);
+}
+
+static void token_bucket_init(TokenBucket *bucket, uint64_t now) {
+	bucket->tokens = (uint64_t)config_get_rate_limit_burst() * TOKEN;
+	bucket->timestamp = now;
+}
+
+// returns 0 if a token is available, otherwise returns the time in
+// microseconds until a token will be available
+static uint64_t token_bucket_wait(TokenBucket *bucket, uint32_t rate,
+                                  uint64_t now) {
+	uint64_t elapsed = now - bucket->timestamp;
+	uint64_t capacity = (uint64_t)config_get_rate_limit_burst() * TOKEN;
+
+	// limit the elapsed time to avoid an overflow, the bucket is full anyway
+	if (elapsed > 1000000000) {
+		elapsed = 1000000000;
 	}
 
-	if (length == 0) {
-		log_info("Client (socket: %d, peer: %s) disconnected by peer",
-		         client->socket, client->peer);
+	// microseconds times tokens per second gives millionths of a token
+	bucket->tokens += elapsed * rate;
+	bucket->timestamp = now;
 
-		network_client_disconnected(client);
+	if (bucket->tokens > capacity) {
+		bucket->tokens = capacity;
+	}
 
-		return;
+	if (bucket->tokens >= TOKEN) {
+		return 0;
 	}
 
-	client->packet_used += length;
+	return (TOKEN - bucket->tokens + rate - 1) / rate;
+}
+
+static TokenBucket *client_get_uid_bucket(Client *client, uint32_t uid,
+                                          uint64_t now) {
+	int i;
+	UIDTokenBucket *uid_bucket;
+
+	for (i = 0; i < client->uid_buckets.count; ++i) {
+		uid_bucket = array_get(&client->uid_buckets, i);
+
+		if (uid_bucket->uid == uid) {
+			return &uid_bucket->bucket;
+		}
+	}
+
+	if (client->uid_buckets.count >= MAX_UID_BUCKETS) {
+		array_remove(&client->uid_buckets, 0, NULL);
+	}
+
+	uid_bucket = array_append(&client->uid_buckets);
+
+	if (uid_bucket == NULL) {
+		log_error("Could not append to UID token bucket array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return NULL;
+	}
 
-	while (client->packet_used > 0) {
-		if (client->packet_used < (int)sizeof(PacketHeader)) {
+	uid_bucket->uid = uid;
+
+	token_bucket_init(&uid_bucket->bucket, now);
+
+	return &uid_bucket->bucket;
+}
+
+// takes a token from the client bucket and from the UID bucket of the
+// request, if rate limiting is enabled. returns 0 if the tokens were taken,
+// otherwise returns the time in microseconds until they will be available
+static uint64_t client_take_tokens(Client *client, PacketHeader *header) {
+	uint32_t rate = config_get_rate_limit_requests_per_second();
+	uint32_t uid_rate = config_get_rate_limit_uid_requests_per_second();
+	TokenBucket *uid_bucket = NULL;
+	uint64_t now;
+	uint64_t delay = 0;
+	uint64_t uid_delay;
+
+	if (rate == 0 && uid_rate == 0) {
+		return 0;
+	}
+
+	now = microseconds();
+
+	if (rate > 0) {
+		delay = token_bucket_wait(&client->bucket, rate, now);
+	}
+
+	if (uid_rate > 0 && header->uid != 0) {
+		uid_bucket = client_get_uid_bucket(client, header->uid, now);
+
+		if (uid_bucket != NULL) {
+			uid_delay = token_bucket_wait(uid_bucket, uid_rate, now);
+
+			if (uid_delay > delay) {
+				delay = uid_delay;
+			}
+		}
+	}
+
+	if (delay > 0) {
+		return delay;
+	}
+
+	if (rate > 0) {
+		client->bucket.tokens -= TOKEN;
+	}
+
+	if (uid_bucket != NULL) {
+		uid_bucket->tokens -= TOKEN;
+	}
+
+	return 0;
+}
+
+// stop reading from the socket, so TCP backpressure reaches the client
+static void client_throttle(Client *client, uint64_t delay) {
+	if (!client->throttled) {
+		log_debug("Throttling client (socket: %d, peer: %s) for %u usec",
+		          client->socket, client_get_peer_name(client),
+		          (uint32_t)delay);
+
+		event_remove_source(client->socket, EVENT_SOURCE_TYPE_GENERIC);
+
+		client->throttled = 1;
+		++client->metrics.throttled;
+	}
+
+	event_start_timer(&client->throttle_timer, delay, 0);
+}
+
+// handles the complete requests in the receive buffer. returns early if the
+// client got throttled, the current request stays in the buffer then
+static void client_handle_packets(Client *client) {
+	const char *message = NULL;
+	int offset = 0; // of the current request in the receive buffer
+	Packet *request;
+	int length;
+	PendingRequest *pending_request;
+	Packet cached_response;
+	uint64_t delay;
+
+	while (client->packet_used - offset > 0) {
+		if (client->packet_used - offset < (int)sizeof(PacketHeader)) {
 			// wait for complete header
 			break;
 		}
 
-		length = client->packet.header.length;
+		request = (Packet *)((uint8_t *)&client->packet + offset);
+		length = request->header.length;
 
-		if (client->packet_used < length) {
+		// don't wait for a request that is longer than the receive buffer,
+		// it could never be completed
+		if (client->packet_used - offset < length && length <= (int)sizeof(Packet)) {
 			// wait for complete packet
 			break;
 		}
 
-		if (!packet_header_is_valid_request(&client->packet.header, &message)) {
-			log_warn("Got invalid request (U: %u, L: %u, F: %u, S: %u, R: %u) from client (socket: %d, peer: %s): %s",
-			         client->packet.header.uid,
-			         client->packet.header.length,
-			         client->packet.header.function_id,
-			         client->packet.header.sequence_number,
-			         client->packet.header.response_expected,
-			         client->socket, client->peer,
-			         message);
-
-			if (length < (int)sizeof(PacketHeader)) {
-				// skip the complete header if length was too small
+		if (!packet_header_is_valid_request(&request->header, &message)) {
+			// the length of an invalid request can exceed the receive buffer
+			trace_packet(TRACE_DIRECTION_CLIENT_IN, (uint32_t)client->socket,
+			             request, client->packet_used - offset);
+
+			++client->metrics.invalid_requests;
+
+			// a broken client can send a stream of invalid requests, only
+			// log the first ones. the metrics count all of them
+			if (client->metrics.invalid_requests <= MAX_LOGGED_INVALID_REQUESTS) {
+				log_warn("Got invalid request (U: %u, L: %u, F: %u, S: %u, R: %u) from client (socket: %d, peer: %s): %s",
+				         request->header.uid,
+				         request->header.length,
+				         request->header.function_id,
+				         request->header.sequence_number,
+				         request->header.response_expected,
+				         client->socket, client_get_peer_name(client),
+				         message);
+
+				if (client->metrics.invalid_requests == MAX_LOGGED_INVALID_REQUESTS) {
+					log_warn("Not logging further invalid requests from client (socket: %d, peer: %s)",
+					         client->socket, client_get_peer_name(client));
+				}
+			}
+
+			if (length < (int)sizeof(PacketHeader) || length > (int)sizeof(Packet)) {
+				// skip the complete header if length was too small or too big
 				length = sizeof(PacketHeader);
 			}
 		} else {
+			delay = client_take_tokens(client, &request->header);
+
+			if (delay > 0) {
+				client_throttle(client, delay);
+
+				break;
+			}
+
+			// traced only once, a throttled request is processed again later
+			trace_packet(TRACE_DIRECTION_CLIENT_IN, (uint32_t)client->socket,
+			             request, length);
+
+			++client->metrics.requests_received;
+
 			log_debug("Got request (U: %u, L: %u, F: %u, S: %u, R: %u) from client (socket: %d, peer: %s)",
-			          client->packet.header.uid,
-			          client->packet.header.length,
-			          client->packet.header.function_id,
-			          client->packet.header.sequence_number,
-			          client->packet.header.response_expected,
-			          client->socket, client->peer);
-
-			if (client->packet.header.response_expected) {
-				if (client->pending_requests.count >= MAX_PENDING_REQUESTS) {
-					log_warn("Dropping %d items from pending request array of client (socket: %d, peer: %s)",
-					         client->pending_requests.count - MAX_PENDING_REQUESTS + 1,
-					         client->socket, client->peer);
-
-					while (client->pending_requests.count >= MAX_PENDING_REQUESTS) {
-						array_remove(&client->pending_requests, 0, NULL);
+			          request->header.uid,
+			          request->header.length,
+			          request->header.function_id,
+			          request->header.sequence_number,
+			          request->header.response_expected,
+			          client->socket, client_get_peer_name(client));
+
+			if (cache_lookup(request, &cached_response)) {
+				// answer from the response cache, without a USB round-trip
+				client_dispatch_packet(client, &cached_response, 1);
+			} else if (request->header.uid == 0 &&
+			           request->header.function_id == FUNCTION_ENUMERATE &&
+			           !request->header.response_expected) {
+				client_handle_enumerate_request(client, request);
+			} else {
+				if (request->header.response_expected) {
+					if (client->pending_requests.count >= MAX_PENDING_REQUESTS) {
+						// only log the first overflow, a client that keeps
+						// sending to an unresponsive device would log every
+						// request otherwise
+						if (client->metrics.pending_requests_dropped == 0) {
+							log_warn("Dropping %d items from pending request array of client (socket: %d, peer: %s)",
+							         client->pending_requests.count - MAX_PENDING_REQUESTS + 1,
+							         client->socket, client_get_peer_name(client));
+						} else {
+							log_debug("Dropping %d items from pending request array of client (socket: %d, peer: %s)",
+							          client->pending_requests.count - MAX_PENDING_REQUESTS + 1,
+							          client->socket, client_get_peer_name(client));
+						}
+
+						while (client->pending_requests.count >= MAX_PENDING_REQUESTS) {
+							array_remove(&client->pending_requests, 0, NULL);
+
+							++client->metrics.pending_requests_dropped;
+
+							metrics_increment(METRIC_PENDING_REQUESTS_DROPPED);
+						}
 					}
-				}
 
-				pending_request = array_append(&client->pending_requests);
+					pending_request = array_append(&client->pending_requests);
 
-				if (pending_request == NULL) {
-					log_error("Could not append to pending request array: %s (%d)",
-					          get_errno_name(errno), errno);
+					if (pending_request == NULL) {
+						log_error("Could not append to pending request array: %s (%d)",
+						          get_errno_name(errno), errno);
 
-					return;
-				}
+						break;
+					}
+
+					memcpy(&pending_request->header, &request->header, sizeof(PacketHeader));
+
+					// throttled requests are processed later, their time in
+					// the receive buffer counts as queue wait
+					pending_request->timestamp = client->timestamp;
 
-				memcpy(pending_request, &client->packet.header, sizeof(PacketHeader));
+					log_debug("Added pending request (U: %u, L: %u, F: %u, S: %u) for client (socket: %d, peer: %s)",
+					          pending_request->header.uid,
+					          pending_request->header.length,
+					          pending_request->header.function_id,
+					          pending_request->header.sequence_number,
+					          client->socket, client_get_peer_name(client));
+				}
 
-				log_debug("Added pending request (U: %u, L: %u, F: %u, S: %u) for client (socket: %d, peer: %s)",
-				          pending_request->uid,
-				          pending_request->length,
-				          pending_request->function_id,
-				          pending_request->sequence_number,
-				          client->socket, client->peer);
+				// only forward the request if no identical request is
+				// already in-flight for this function ID
+				if (!inflight_add_request(client, request)) {
+					usb_dispatch_packet(request, client);
+				}
 			}
+		}
 
-			usb_dispatch_packet(&client->packet);
+		offset += length;
+	}
+
+	// remove all handled requests at once, instead of moving the rest of the
+	// receive buffer after each request
+	if (offset > 0) {
+		memmove(&client->packet, (uint8_t *)&client->packet + offset,
+		        client->packet_used - offset);
+
+		client->packet_used -= offset;
+	}
+}
+
+void client_handle_receive(void *opaque) {
+	Client *client = opaque;
+	int length;
+
+	length = socket_receive(client->socket,
+	                        (uint8_t *)&client->packet + client->packet_used,
+	                        sizeof(Packet) - client->packet_used);
+
+	if (length < 0) {
+		if (errno_interrupted()) {
+			log_debug("Receiving from client (socket: %d, peer: %s), got interrupted",
+			          client->socket, client_get_peer_name(client));
+		} else {
+			log_error("Could not receive from client (socket: %d, peer: %s), disconnecting it: %s (%d)",
+			          client->socket, client_get_peer_name(client),
+			          get_errno_name(errno), errno);
+
+			network_client_disconnected(client);
 		}
 
-		memmove(&client->packet, (uint8_t *)&client->packet + length,
-		        client->packet_used - length);
+		return;
+	}
 
-		client->packet_used -= length;
+	if (length == 0) {
+		log_info("Client (socket: %d, peer: %s) disconnected by peer",
+		         client->socket, client_get_peer_name(client));
+
+		network_client_disconnected(client);
+
+		return;
+	}
+
+	client->packet_used += length;
+	client->timestamp = microseconds();
+	client->metrics.bytes_received += length;
+
+	client_handle_packets(client);
+}
+
+static void client_handle_throttle_timer(void *opaque) {
+	Client *client = opaque;
+
+	client->throttled = 0;
+
+	// handle the request that was held back first, this might throttle the
+	// client again
+	client_handle_packets(client);
+
+	if (client->throttled) {
+		return;
+	}
+
+	log_debug("Resuming throttled client (socket: %d, peer: %s)",
+	          client->socket, client_get_peer_name(client));
+
+	if (event_add_source(client->socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
+	                     client_handle_receive, client) < 0) {
+		// the socket is not an event source anymore
+		client->throttled = 1;
+
+		network_client_disconnected(client);
 	}
 }
 
 int client_create(Client *client, EventHandle socket,
-                  struct sockaddr_in *address, socklen_t length) {
+                  struct sockaddr *address, socklen_t length) {
+	int phase = 0;
+
 	log_debug("Creating client from socket (handle: %d)", socket);
 
 	client->socket = socket;
+	client->peer = NULL;
 	client->packet_used = 0;
+	client->timestamp = 0;
+
+	memset(&client->metrics, 0, sizeof(client->metrics));
+
+	// keep the address, the peer name is only formatted if it is needed
+	if (length > (socklen_t)sizeof(client->address)) {
+		length = sizeof(client->address);
+	}
+
+	memcpy(&client->address, address, length);
+	client->address_length = length;
 
 	// create pending request array
 	if (array_create(&client->pending_requests, 32,
-	                 sizeof(PacketHeader), 1) < 0) {
+	                 sizeof(PendingRequest), 1) < 0) {
 		log_error("Could not create pending request array: %s (%d)",
 		          get_errno_name(errno), errno);
 
-		return -1;
+		goto cleanup;
 	}
 
-	// get peer name
-	client->peer = resolve_address(address, length);
+	phase = 1;
 
-	if (client->peer == NULL) {
-		log_warn("Could not get peer name of client (socket: %d): %s (%d)",
-		         socket, get_errno_name(errno), errno);
+	// create rate limiting state
+	token_bucket_init(&client->bucket, microseconds());
 
-		client->peer = (char *)_unknown_peer_name;
+	if (array_create(&client->uid_buckets, 16,
+	                 sizeof(UIDTokenBucket), 1) < 0) {
+		log_error("Could not create UID token bucket array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	client->throttled = 0;
+
+	if (event_add_timer(&client->throttle_timer,
+	                    client_handle_throttle_timer, client) < 0) {
+		goto cleanup;
 	}
 
+	phase = 3;
+
 	// add socket as event source
 	if (event_add_source(client->socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
 	                     client_handle_receive, client) < 0) {
-		if (client->peer != _unknown_peer_name) {
-			free(client->peer);
-		}
+		goto cleanup;
+	}
+
+	phase = 4;
 
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 3:
+		event_remove_timer(&client->throttle_timer);
+
+	case 2:
+		array_destroy(&client->uid_buckets, NULL);
+
+	case 1:
 		array_destroy(&client->pending_requests, NULL);
 
-		return -1;
+	default:
+		break;
 	}
 
-	return 0;
+	return phase == 4 ? 0 : -1;
 }
 
-void client_destroy(Client *client) {
-	event_remove_source(client->socket, EVENT_SOURCE_TYPE_GENERIC);
-	socket_destroy(client->socket);
+static void client_release(Client *client, int shutdown_socket) {
+	event_remove_timer(&client->throttle_timer);
+
+	// a throttled socket is already removed as event source
+	if (!client->throttled) {
+		event_remove_source(client->socket, EVENT_SOURCE_TYPE_GENERIC);
+	}
+
+	if (shutdown_socket) {
+		socket_destroy(client->socket);
+	} else {
+		socket_close(client->socket);
+	}
 
 	if (client->peer != _unknown_peer_name) {
 		free(client->peer);
 	}
 
+	array_destroy(&client->uid_buckets, NULL);
 	array_destroy(&client->pending_requests, NULL);
 }
 
+void client_destroy(Client *client) {
+	client_release(client, 1);
+}
+
+// releases the client without shutting down its connection, because it was
+// handed off to another brickd process
+void client_detach(Client *client) {
+	client_release(client, 0);
+}
+
+const char *client_get_peer_name(Client *client) {
+	if (client->peer != NULL) {
+		return client->peer;
+	}
+
+	client->peer = resolve_address((struct sockaddr *)&client->address,
+	                               client->address_length);
+
+	if (client->peer == NULL) {
+		log_warn("Could not get peer name of client (socket: %d): %s (%d)",
+		         client->socket, get_errno_name(errno), errno);
+
+		client->peer = (char *)_unknown_peer_name;
+	}
+
+	return client->peer;
+}
+
 int client_dispatch_packet(Client *client, Packet *packet, int force) {
 	int i;
-	Packet *pending_request;
+	PendingRequest *pending_request;
 	int found = -1;
 	int rc = -1;
 
@@ -221,18 +577,31 @@ int client_dispatch_packet(Client *client, Packet *packet, int force) {
 
 	if (force || found >= 0) {
 		if (socket_send(client->socket, packet, packet->header.length) < 0) {
+			++client->metrics.send_errors;
+
 			log_error("Could not send response to client (socket: %d, peer: %s): %s (%d)",
-			          client->socket, client->peer, get_errno_name(errno), errno);
+			          client->socket, client_get_peer_name(client),
+			          get_errno_name(errno), errno);
 
 			goto cleanup;
 		}
 
+		trace_packet(TRACE_DIRECTION_CLIENT_OUT, (uint32_t)client->socket, packet,
+		             packet->header.length);
+
+		++client->metrics.packets_sent;
+		client->metrics.bytes_sent += packet->header.length;
+
+		if (found >= 0) {
+			metrics_record_response(pending_request->timestamp);
+		}
+
 		if (force) {
 			log_debug("Forced to sent response to client (socket: %d, peer: %s)",
-			          client->socket, client->peer);
+			          client->socket, client_get_peer_name(client));
 		} else {
 			log_debug("Sent response to client (socket: %d, peer: %s)",
-			          client->socket, client->peer);
+			          client->socket, client_get_peer_name(client));
 		}
 	}
 
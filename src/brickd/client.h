@@ -29,20 +29,50 @@
 #endif
 
 #include "event.h"
+#include "metrics.h"
 #include "packet.h"
 #include "utils.h"
 
+typedef struct {
+	uint64_t tokens; // in millionths of a token
+	uint64_t timestamp; // in microseconds
+} TokenBucket;
+
+typedef struct {
+	uint32_t uid;
+	TokenBucket bucket;
+} UIDTokenBucket;
+
+typedef struct {
+	PacketHeader header;
+	uint64_t timestamp; // of receiving the request, in microseconds
+} PendingRequest;
+
 typedef struct {
 	EventHandle socket;
-	char *peer;
+	struct sockaddr_storage address;
+	socklen_t address_length;
+	char *peer; // formatted on first use, see client_get_peer_name
 	Packet packet;
 	int packet_used;
+	uint64_t timestamp; // of the last receive, in microseconds
 	Array pending_requests;
+	TokenBucket bucket;
+	Array uid_buckets;
+	int throttled; // socket is not read while the buckets refill
+	EventTimer throttle_timer;
+	ClientMetrics metrics;
 } Client;
 
 int client_create(Client *client, EventHandle socket,
-                  struct sockaddr_in *address, socklen_t length);
+                  struct sockaddr *address, socklen_t length);
 void client_destroy(Client *client);
+void client_detach(Client *client);
+
+const char *client_get_peer_name(Client *client);
+
+// event handler of the client socket, the fuzz harness calls it directly
+void client_handle_receive(void *opaque);
 
 int client_dispatch_packet(Client *client, Packet *packet, int force);
 
@@ -20,6 +20,7 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,19 +28,79 @@
 
 #include "config.h"
 
+#include "log.h"
 #include "utils.h"
 
+#define LOG_CATEGORY LOG_CATEGORY_OTHER
+
+#define CONFIG_MAX_INCLUDE_DEPTH 8
+#define CONFIG_MAX_SECTION_LENGTH 63
+
+// options that are only used during startup, changing them on reload logs a
+// warning and keeps the running value until brickd is restarted
+#define CONFIG_KEEP_RUNNING_VALUE(option, member) \
+	do { \
+		if (_values.member != running.member) { \
+			log_warn("Changing the " option " option requires a restart, keeping the running value"); \
+			_values.member = running.member; \
+		} \
+	} while (0)
+
+#define CONFIG_KEEP_RUNNING_STRING(option, member) \
+	do { \
+		if (strcmp(_values.member, running.member) != 0) { \
+			log_warn("Changing the " option " option requires a restart, keeping the running value"); \
+			strcpy(_values.member, running.member); \
+		} \
+	} while (0)
+
 static int _check_only = 0;
 static int _has_error = 0;
 static int _using_default_values = 1;
 static const char *_default_listen_address = "0.0.0.0";
-static char *_listen_address = NULL;
-static uint16_t _listen_port = 4223;
-static LogLevel _log_levels[5] = { LOG_LEVEL_INFO,
-                                   LOG_LEVEL_INFO,
-                                   LOG_LEVEL_INFO,
-                                   LOG_LEVEL_INFO,
-                                   LOG_LEVEL_INFO };
+static const char *_filename = NULL;
+static const char *_location_filename = NULL; // file and line being parsed,
+static int _location_line = 0;                // used to prefix error messages
+
+// all option values are kept together, so that a reload can be rolled back
+// if the config file turns out to contain errors
+typedef struct {
+	Array listen_addresses;
+	uint16_t listen_port;
+	int listen_backlog;
+	int listen_dual_stack;
+	int listen_max_clients;
+	int usb_always_reset;
+	uint32_t response_cache_ttls[256]; // in milliseconds, 0 means disabled
+	int response_cache_size;
+	uint8_t request_coalescing[256]; // 1 means enabled
+	int enumerate_cache_max_age; // in milliseconds, 0 means disabled
+	uint32_t callback_throttle_intervals[256]; // in milliseconds, 0 means disabled
+	int rate_limit_requests_per_second; // 0 means disabled
+	int rate_limit_uid_requests_per_second; // 0 means disabled
+	int rate_limit_burst;
+	uint8_t write_coalescing[256]; // 1 means enabled
+	char metrics_address[64];
+	uint16_t metrics_port; // 0 means disabled
+	int event_loop_instrumentation;
+	int event_loop_slow_handler_threshold; // in milliseconds, 0 means disabled
+	char trace_file[128]; // empty means disabled
+	int trace_records;
+	int trace_payload;
+	int simulator_stacks; // 0 means disabled
+	int simulator_devices; // per stack
+	int simulator_first_uid;
+	int simulator_response_latency; // in microseconds
+	int simulator_callback_rate; // per device and second, 0 means disabled
+	int simulator_error_rate; // in percent
+	int simulator_drop_rate; // in percent
+	int simulator_transfer_error_rate; // in percent
+	char replay_file[128]; // empty means disabled
+	int replay_speed; // in percent, 0 means as fast as possible
+	LogLevel log_levels[5];
+} ConfigValues;
+
+static ConfigValues _values;
 
 static void config_error(const char *format, ...) ATTRIBUTE_FMT_PRINTF(1, 2);
 
@@ -54,6 +115,10 @@ static void config_error(const char *format, ...) {
 
 	va_start(arguments, format);
 
+	if (_location_filename != NULL) {
+		fprintf(stderr, "%s:%d: ", _location_filename, _location_line);
+	}
+
 	vfprintf(stderr, format, arguments);
 	fprintf(stderr, "\n");
 	fflush(stderr);
@@ -110,6 +175,138 @@ static int config_parse_int(char *string, int *value) {
 	return 0;
 }
 
+static int config_parse_bool(char *string, int *value) {
+	config_lower_string(string);
+
+	if (strcmp(string, "on") == 0 || strcmp(string, "yes") == 0 ||
+	    strcmp(string, "true") == 0) {
+		*value = 1;
+	} else if (strcmp(string, "off") == 0 || strcmp(string, "no") == 0 ||
+	           strcmp(string, "false") == 0) {
+		*value = 0;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+static void config_free_string(void *item) {
+	free(*(char **)item);
+}
+
+// sets errno on error
+static int config_append_string(Array *array, const char *string) {
+	char **item = array_append(array);
+
+	if (item == NULL) {
+		return -1;
+	}
+
+	*item = strdup(string);
+
+	if (*item == NULL) {
+		array_remove(array, array->count - 1, NULL);
+
+		errno = ENOMEM;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static int config_equal_string_lists(Array *a, Array *b) {
+	int i;
+
+	if (a->count != b->count) {
+		return 0;
+	}
+
+	for (i = 0; i < a->count; ++i) {
+		if (strcmp(*(char **)array_get(a, i), *(char **)array_get(b, i)) != 0) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// splits a comma and/or whitespace separated list into an array of strings
+static int config_parse_string_list(char *string, Array *array) {
+	char *token;
+
+	array_resize(array, 0, config_free_string);
+
+	for (token = strtok(string, ", \t"); token != NULL;
+	     token = strtok(NULL, ", \t")) {
+		if (config_append_string(array, token) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// parses a comma and/or whitespace separated list of <function-id>:<value>
+// pairs into a table indexed by function ID. the table is cleared first
+static int config_parse_function_table(char *string, uint32_t table[256]) {
+	char *token;
+	char *p;
+	int function_id;
+	int value;
+
+	memset(table, 0, sizeof(uint32_t) * 256);
+
+	for (token = strtok(string, ", \t"); token != NULL;
+	     token = strtok(NULL, ", \t")) {
+		p = strchr(token, ':');
+
+		if (p == NULL) {
+			return -1;
+		}
+
+		*p = '\0';
+
+		if (config_parse_int(token, &function_id) < 0 ||
+		    config_parse_int(p + 1, &value) < 0) {
+			return -1;
+		}
+
+		if (function_id < 1 || function_id > 255 || value < 0) {
+			return -1;
+		}
+
+		table[function_id] = (uint32_t)value;
+	}
+
+	return 0;
+}
+
+// parses a comma and/or whitespace separated list of function IDs into a
+// table indexed by function ID. the table is cleared first
+static int config_parse_function_set(char *string, uint8_t set[256]) {
+	char *token;
+	int function_id;
+
+	memset(set, 0, 256);
+
+	for (token = strtok(string, ", \t"); token != NULL;
+	     token = strtok(NULL, ", \t")) {
+		if (config_parse_int(token, &function_id) < 0) {
+			return -1;
+		}
+
+		if (function_id < 1 || function_id > 255) {
+			return -1;
+		}
+
+		set[function_id] = 1;
+	}
+
+	return 0;
+}
+
 static int config_parse_log_level(char *string, LogLevel *value) {
 	LogLevel tmp;
 
@@ -132,92 +329,418 @@ static int config_parse_log_level(char *string, LogLevel *value) {
 	return 0;
 }
 
-static void config_parse(char *string) {
-	char *p;
-	char *option;
-	char *value;
+static void config_parse(char *option, char *value) {
 	int port;
+	int backlog;
+	int max_clients;
+	int size;
+	int max_age;
+	int rate;
+	int burst;
+	int threshold;
+	int records;
+	int count;
+	int uid;
+	int latency;
+	int percent;
+	int speed;
 
-	// remove comment
-	p = strchr(string, '#');
+	// check option
+	if (strcmp(option, "listen.address") == 0) {
+		if (config_parse_string_list(value, &_values.listen_addresses) < 0) {
+			config_error("Could not parse listen.address value '%s': %s (%d)",
+			             value, get_errno_name(errno), errno);
+		}
 
-	if (p != NULL) {
-		*p = '\0';
-	}
+		if (_values.listen_addresses.count == 0) {
+			config_error("Empty value is not allowed for listen.address option");
 
-	// split option and value
-	p = strchr(string, '=');
+			config_append_string(&_values.listen_addresses, _default_listen_address);
+		}
+	} else if (strcmp(option, "listen.port") == 0) {
+		if (config_parse_int(value, &port) < 0) {
+			config_error("Value '%s' for listen.port option is not an integer", value);
 
-	if (p == NULL) {
-		return;
-	}
+			return;
+		}
 
-	*p = '\0';
+		if (port < 1 || port > UINT16_MAX) {
+			config_error("Value %d for listen.port option is out-of-range", port);
 
-	option = config_trim_string(string);
-	value = config_trim_string(p + 1);
+			return;
+		}
 
-	config_lower_string(option);
+		_values.listen_port = (uint16_t)port;
+	} else if (strcmp(option, "listen.backlog") == 0) {
+		if (config_parse_int(value, &backlog) < 0) {
+			config_error("Value '%s' for listen.backlog option is not an integer", value);
 
-	// check option
-	if (strcmp(option, "listen.address") == 0) {
-		if (strlen(value) < 1) {
-			config_error("Empty value is not allowed for listen.address option");
+			return;
+		}
+
+		if (backlog < 1 || backlog > UINT16_MAX) {
+			config_error("Value %d for listen.backlog option is out-of-range", backlog);
+
+			return;
 		}
 
-		if (_listen_address != _default_listen_address) {
-			free(_listen_address);
+		_values.listen_backlog = backlog;
+	} else if (strcmp(option, "listen.max_clients") == 0) {
+		if (config_parse_int(value, &max_clients) < 0) {
+			config_error("Value '%s' for listen.max_clients option is not an integer", value);
+
+			return;
 		}
 
-		_listen_address = strdup(value);
+		if (max_clients < 0) {
+			config_error("Value %d for listen.max_clients option is out-of-range", max_clients);
+
+			return;
+		}
 
-		if (_listen_address == NULL) {
-			_listen_address = (char *)_default_listen_address;
+		_values.listen_max_clients = max_clients;
+	} else if (strcmp(option, "listen.dual_stack") == 0) {
+		if (config_parse_bool(value, &_values.listen_dual_stack) < 0) {
+			config_error("Value '%s' for listen.dual_stack option is invalid", value);
 
-			config_error("Could not duplicate listen.address value '%s'", value);
+			return;
+		}
+	} else if (strcmp(option, "usb.always_reset") == 0) {
+		if (config_parse_bool(value, &_values.usb_always_reset) < 0) {
+			config_error("Value '%s' for usb.always_reset option is invalid", value);
 
 			return;
 		}
-	} else if (strcmp(option, "listen.port") == 0) {
+	} else if (strcmp(option, "response_cache.ttl") == 0) {
+		if (config_parse_function_table(value, _values.response_cache_ttls) < 0) {
+			config_error("Value '%s' for response_cache.ttl option is invalid", value);
+
+			return;
+		}
+	} else if (strcmp(option, "response_cache.size") == 0) {
+		if (config_parse_int(value, &size) < 0) {
+			config_error("Value '%s' for response_cache.size option is not an integer", value);
+
+			return;
+		}
+
+		if (size < 1 || size > 65536) {
+			config_error("Value %d for response_cache.size option is out-of-range", size);
+
+			return;
+		}
+
+		_values.response_cache_size = size;
+	} else if (strcmp(option, "rate_limit.requests_per_second") == 0) {
+		if (config_parse_int(value, &rate) < 0) {
+			config_error("Value '%s' for rate_limit.requests_per_second option is not an integer", value);
+
+			return;
+		}
+
+		if (rate < 0 || rate > 1000000) {
+			config_error("Value %d for rate_limit.requests_per_second option is out-of-range", rate);
+
+			return;
+		}
+
+		_values.rate_limit_requests_per_second = rate;
+	} else if (strcmp(option, "rate_limit.uid_requests_per_second") == 0) {
+		if (config_parse_int(value, &rate) < 0) {
+			config_error("Value '%s' for rate_limit.uid_requests_per_second option is not an integer", value);
+
+			return;
+		}
+
+		if (rate < 0 || rate > 1000000) {
+			config_error("Value %d for rate_limit.uid_requests_per_second option is out-of-range", rate);
+
+			return;
+		}
+
+		_values.rate_limit_uid_requests_per_second = rate;
+	} else if (strcmp(option, "rate_limit.burst") == 0) {
+		if (config_parse_int(value, &burst) < 0) {
+			config_error("Value '%s' for rate_limit.burst option is not an integer", value);
+
+			return;
+		}
+
+		if (burst < 1 || burst > 65536) {
+			config_error("Value %d for rate_limit.burst option is out-of-range", burst);
+
+			return;
+		}
+
+		_values.rate_limit_burst = burst;
+	} else if (strcmp(option, "write_coalescing.functions") == 0) {
+		if (config_parse_function_set(value, _values.write_coalescing) < 0) {
+			config_error("Value '%s' for write_coalescing.functions option is invalid", value);
+
+			return;
+		}
+	} else if (strcmp(option, "callback_throttle.interval") == 0) {
+		if (config_parse_function_table(value, _values.callback_throttle_intervals) < 0) {
+			config_error("Value '%s' for callback_throttle.interval option is invalid", value);
+
+			return;
+		}
+	} else if (strcmp(option, "enumerate_cache.max_age") == 0) {
+		if (config_parse_int(value, &max_age) < 0) {
+			config_error("Value '%s' for enumerate_cache.max_age option is not an integer", value);
+
+			return;
+		}
+
+		if (max_age < 0) {
+			config_error("Value %d for enumerate_cache.max_age option is out-of-range", max_age);
+
+			return;
+		}
+
+		_values.enumerate_cache_max_age = max_age;
+	} else if (strcmp(option, "request_coalescing.functions") == 0) {
+		if (config_parse_function_set(value, _values.request_coalescing) < 0) {
+			config_error("Value '%s' for request_coalescing.functions option is invalid", value);
+
+			return;
+		}
+	} else if (strcmp(option, "metrics.address") == 0) {
+		if (strlen(value) == 0) {
+			config_error("Empty value is not allowed for metrics.address option");
+
+			return;
+		}
+
+		if (strlen(value) >= sizeof(_values.metrics_address)) {
+			config_error("Value '%s' for metrics.address option is too long", value);
+
+			return;
+		}
+
+		strcpy(_values.metrics_address, value);
+	} else if (strcmp(option, "metrics.port") == 0) {
 		if (config_parse_int(value, &port) < 0) {
-			config_error("Value '%s' for listen.port option is not an integer", value);
+			config_error("Value '%s' for metrics.port option is not an integer", value);
 
 			return;
 		}
 
-		if (port < 1 || port > UINT16_MAX) {
-			config_error("Value %d for listen.port option is out-of-range", port);
+		if (port < 0 || port > UINT16_MAX) {
+			config_error("Value %d for metrics.port option is out-of-range", port);
 
 			return;
 		}
 
-		_listen_port = (uint16_t)port;
+		_values.metrics_port = (uint16_t)port;
+	} else if (strcmp(option, "event_loop.instrumentation") == 0) {
+		if (config_parse_bool(value, &_values.event_loop_instrumentation) < 0) {
+			config_error("Value '%s' for event_loop.instrumentation option is invalid", value);
+
+			return;
+		}
+	} else if (strcmp(option, "event_loop.slow_handler_threshold") == 0) {
+		if (config_parse_int(value, &threshold) < 0) {
+			config_error("Value '%s' for event_loop.slow_handler_threshold option is not an integer", value);
+
+			return;
+		}
+
+		if (threshold < 0) {
+			config_error("Value %d for event_loop.slow_handler_threshold option is out-of-range", threshold);
+
+			return;
+		}
+
+		_values.event_loop_slow_handler_threshold = threshold;
+	} else if (strcmp(option, "trace.file") == 0) {
+		if (strlen(value) >= sizeof(_values.trace_file)) {
+			config_error("Value '%s' for trace.file option is too long", value);
+
+			return;
+		}
+
+		strcpy(_values.trace_file, value);
+	} else if (strcmp(option, "trace.records") == 0) {
+		if (config_parse_int(value, &records) < 0) {
+			config_error("Value '%s' for trace.records option is not an integer", value);
+
+			return;
+		}
+
+		if (records < 1 || records > 16777216) {
+			config_error("Value %d for trace.records option is out-of-range", records);
+
+			return;
+		}
+
+		_values.trace_records = records;
+	} else if (strcmp(option, "trace.payload") == 0) {
+		if (config_parse_bool(value, &_values.trace_payload) < 0) {
+			config_error("Value '%s' for trace.payload option is invalid", value);
+
+			return;
+		}
+	} else if (strcmp(option, "simulator.stacks") == 0) {
+		if (config_parse_int(value, &count) < 0) {
+			config_error("Value '%s' for simulator.stacks option is not an integer", value);
+
+			return;
+		}
+
+		if (count < 0 || count > 127) {
+			config_error("Value %d for simulator.stacks option is out-of-range", count);
+
+			return;
+		}
+
+		_values.simulator_stacks = count;
+	} else if (strcmp(option, "simulator.devices") == 0) {
+		if (config_parse_int(value, &count) < 0) {
+			config_error("Value '%s' for simulator.devices option is not an integer", value);
+
+			return;
+		}
+
+		if (count < 1 || count > 255) {
+			config_error("Value %d for simulator.devices option is out-of-range", count);
+
+			return;
+		}
+
+		_values.simulator_devices = count;
+	} else if (strcmp(option, "simulator.first_uid") == 0) {
+		if (config_parse_int(value, &uid) < 0) {
+			config_error("Value '%s' for simulator.first_uid option is not an integer", value);
+
+			return;
+		}
+
+		if (uid < 1) {
+			config_error("Value %d for simulator.first_uid option is out-of-range", uid);
+
+			return;
+		}
+
+		_values.simulator_first_uid = uid;
+	} else if (strcmp(option, "simulator.response_latency") == 0) {
+		if (config_parse_int(value, &latency) < 0) {
+			config_error("Value '%s' for simulator.response_latency option is not an integer", value);
+
+			return;
+		}
+
+		if (latency < 0 || latency > 10000000) {
+			config_error("Value %d for simulator.response_latency option is out-of-range", latency);
+
+			return;
+		}
+
+		_values.simulator_response_latency = latency;
+	} else if (strcmp(option, "simulator.callback_rate") == 0) {
+		if (config_parse_int(value, &rate) < 0) {
+			config_error("Value '%s' for simulator.callback_rate option is not an integer", value);
+
+			return;
+		}
+
+		if (rate < 0 || rate > 100000) {
+			config_error("Value %d for simulator.callback_rate option is out-of-range", rate);
+
+			return;
+		}
+
+		_values.simulator_callback_rate = rate;
+	} else if (strcmp(option, "simulator.error_rate") == 0) {
+		if (config_parse_int(value, &percent) < 0) {
+			config_error("Value '%s' for simulator.error_rate option is not an integer", value);
+
+			return;
+		}
+
+		if (percent < 0 || percent > 100) {
+			config_error("Value %d for simulator.error_rate option is out-of-range", percent);
+
+			return;
+		}
+
+		_values.simulator_error_rate = percent;
+	} else if (strcmp(option, "simulator.drop_rate") == 0) {
+		if (config_parse_int(value, &percent) < 0) {
+			config_error("Value '%s' for simulator.drop_rate option is not an integer", value);
+
+			return;
+		}
+
+		if (percent < 0 || percent > 100) {
+			config_error("Value %d for simulator.drop_rate option is out-of-range", percent);
+
+			return;
+		}
+
+		_values.simulator_drop_rate = percent;
+	} else if (strcmp(option, "simulator.transfer_error_rate") == 0) {
+		if (config_parse_int(value, &percent) < 0) {
+			config_error("Value '%s' for simulator.transfer_error_rate option is not an integer", value);
+
+			return;
+		}
+
+		if (percent < 0 || percent > 100) {
+			config_error("Value %d for simulator.transfer_error_rate option is out-of-range", percent);
+
+			return;
+		}
+
+		_values.simulator_transfer_error_rate = percent;
+	} else if (strcmp(option, "replay.file") == 0) {
+		if (strlen(value) >= sizeof(_values.replay_file)) {
+			config_error("Value '%s' for replay.file option is too long", value);
+
+			return;
+		}
+
+		strcpy(_values.replay_file, value);
+	} else if (strcmp(option, "replay.speed") == 0) {
+		if (config_parse_int(value, &speed) < 0) {
+			config_error("Value '%s' for replay.speed option is not an integer", value);
+
+			return;
+		}
+
+		if (speed < 0 || speed > 100000) {
+			config_error("Value %d for replay.speed option is out-of-range", speed);
+
+			return;
+		}
+
+		_values.replay_speed = speed;
 	} else if (strcmp(option, "log_level.event") == 0) {
-		if (config_parse_log_level(value, &_log_levels[LOG_CATEGORY_EVENT]) < 0) {
+		if (config_parse_log_level(value, &_values.log_levels[LOG_CATEGORY_EVENT]) < 0) {
 			config_error("Value '%s' for log_level.event option is invalid", value);
 
 			return;
 		}
 	} else if (strcmp(option, "log_level.usb") == 0) {
-		if (config_parse_log_level(value, &_log_levels[LOG_CATEGORY_USB]) < 0) {
+		if (config_parse_log_level(value, &_values.log_levels[LOG_CATEGORY_USB]) < 0) {
 			config_error("Value '%s' for log_level.event option is invalid", value);
 
 			return;
 		}
 	} else if (strcmp(option, "log_level.network") == 0) {
-		if (config_parse_log_level(value, &_log_levels[LOG_CATEGORY_NETWORK]) < 0) {
+		if (config_parse_log_level(value, &_values.log_levels[LOG_CATEGORY_NETWORK]) < 0) {
 			config_error("Value '%s' for log_level.event option is invalid", value);
 
 			return;
 		}
 	} else if (strcmp(option, "log_level.hotplug") == 0) {
-		if (config_parse_log_level(value, &_log_levels[LOG_CATEGORY_HOTPLUG]) < 0) {
+		if (config_parse_log_level(value, &_values.log_levels[LOG_CATEGORY_HOTPLUG]) < 0) {
 			config_error("Value '%s' for log_level.event option is invalid", value);
 
 			return;
 		}
 	} else if (strcmp(option, "log_level.other") == 0) {
-		if (config_parse_log_level(value, &_log_levels[LOG_CATEGORY_OTHER]) < 0) {
+		if (config_parse_log_level(value, &_values.log_levels[LOG_CATEGORY_OTHER]) < 0) {
 			config_error("Value '%s' for log_level.event option is invalid", value);
 
 			return;
@@ -246,18 +769,279 @@ int config_check(const char *filename) {
 	return 0;
 }
 
-void config_init(const char *filename) {
+static void config_reset_values(void) {
+	int i;
+
+	memset(&_values, 0, sizeof(_values));
+
+	_values.listen_port = 4223;
+	_values.listen_backlog = 128;
+	_values.response_cache_size = 256;
+	_values.enumerate_cache_max_age = 10000;
+	_values.rate_limit_burst = 32;
+	strcpy(_values.metrics_address, "127.0.0.1");
+	_values.event_loop_slow_handler_threshold = 100;
+	_values.trace_records = 65536;
+	_values.simulator_devices = 3;
+	_values.simulator_first_uid = 1000;
+	_values.simulator_response_latency = 1000;
+	_values.replay_speed = 100;
+
+	for (i = 0; i < (int)(sizeof(_values.log_levels) / sizeof(_values.log_levels[0])); ++i) {
+		_values.log_levels[i] = LOG_LEVEL_INFO;
+	}
+}
+
+// reads the whole file into a NUL-terminated buffer, that has to be freed by
+// the caller. returns NULL if the file cannot be opened
+static char *config_read_file(const char *filename, int *length) {
 	FILE *file;
-	char c;
-	char line[128] = "";
-	int length = 0;
-	int skip = 0;
+	char *buffer = NULL;
+	char *resized;
+	int allocated = 0;
+	size_t count;
 
-	_listen_address = (char *)_default_listen_address;
+	*length = 0;
 
 	file = fopen(filename, "rb");
 
 	if (file == NULL) {
+		return NULL;
+	}
+
+	for (;;) {
+		if (allocated - *length < 4096) {
+			allocated = allocated < 4096 ? 8192 : allocated * 2;
+			resized = realloc(buffer, allocated);
+
+			if (resized == NULL) {
+				free(buffer);
+				fclose(file);
+
+				errno = ENOMEM;
+
+				return NULL;
+			}
+
+			buffer = resized;
+		}
+
+		// leave room for the terminating NUL
+		count = fread(buffer + *length, 1, allocated - *length - 1, file);
+		*length += (int)count;
+
+		if (count == 0) {
+			break;
+		}
+	}
+
+	fclose(file);
+
+	buffer[*length] = '\0';
+
+	return buffer;
+}
+
+static void config_read_buffer(const char *filename, char *buffer, int length,
+                               int depth);
+
+// relative include paths are resolved against the directory of the including
+// file, so that an include works independent of the current directory
+static void config_include(const char *filename, char *value, int depth) {
+	const char *separator = NULL;
+	const char *p;
+	char *include_filename;
+	char *buffer;
+	int directory_length = 0;
+	int length;
+	const char *location_filename = _location_filename;
+	int location_line = _location_line;
+
+	if (*value == '\0') {
+		config_error("Empty value is not allowed for include directive");
+
+		return;
+	}
+
+	if (depth >= CONFIG_MAX_INCLUDE_DEPTH) {
+		config_error("Could not include '%s', includes are nested deeper than %d levels",
+		             value, CONFIG_MAX_INCLUDE_DEPTH);
+
+		return;
+	}
+
+	for (p = filename; *p != '\0'; ++p) {
+		if (*p == '/' || *p == '\\') {
+			separator = p;
+		}
+	}
+
+	if (separator != NULL && *value != '/' && *value != '\\' &&
+	    (!isalpha((unsigned char)value[0]) || value[1] != ':')) {
+		directory_length = separator - filename + 1;
+	}
+
+	include_filename = malloc(directory_length + strlen(value) + 1);
+
+	if (include_filename == NULL) {
+		config_error("Could not include '%s': %s (%d)",
+		             value, get_errno_name(ENOMEM), ENOMEM);
+
+		return;
+	}
+
+	memcpy(include_filename, filename, directory_length);
+	strcpy(include_filename + directory_length, value);
+
+	buffer = config_read_file(include_filename, &length);
+
+	if (buffer == NULL) {
+		config_error("Could not read included config file '%s': %s (%d)",
+		             include_filename, get_errno_name(errno), errno);
+	} else {
+		config_read_buffer(include_filename, buffer, length, depth + 1);
+
+		free(buffer);
+	}
+
+	free(include_filename);
+
+	_location_filename = location_filename;
+	_location_line = location_line;
+}
+
+// a [name] line starts a section, options in it are prefixed with name and a
+// dot, so [log_level] followed by usb = debug sets log_level.usb. an empty []
+// ends the section. the include directive is handled in every section and an
+// included file starts outside of any section
+static void config_parse_line(const char *filename, char *line, char *section,
+                              int depth) {
+	char *p;
+	char *option;
+	char *value;
+	char prefixed[CONFIG_MAX_SECTION_LENGTH + 128];
+
+	// remove comment
+	p = strchr(line, '#');
+
+	if (p != NULL) {
+		*p = '\0';
+	}
+
+	line = config_trim_string(line);
+
+	// check for section
+	if (*line == '[') {
+		p = strchr(line, ']');
+
+		if (p == NULL || *config_trim_string(p + 1) != '\0') {
+			config_error("Malformed section header '%s'", line);
+
+			return;
+		}
+
+		*p = '\0';
+		value = config_trim_string(line + 1);
+
+		if (strlen(value) > CONFIG_MAX_SECTION_LENGTH) {
+			config_error("Section name '%s' is longer than %d characters",
+			             value, CONFIG_MAX_SECTION_LENGTH);
+
+			return;
+		}
+
+		config_lower_string(value);
+		strcpy(section, value);
+
+		return;
+	}
+
+	// split option and value
+	p = strchr(line, '=');
+
+	if (p == NULL) {
+		return;
+	}
+
+	*p = '\0';
+
+	option = config_trim_string(line);
+	value = config_trim_string(p + 1);
+
+	config_lower_string(option);
+
+	if (strcmp(option, "include") == 0) {
+		config_include(filename, value, depth);
+
+		return;
+	}
+
+	if (*section != '\0') {
+		if (snprintf(prefixed, sizeof(prefixed), "%s.%s", section, option) >= (int)sizeof(prefixed)) {
+			config_error("Unknown option '%s' in section '%s'", option, section);
+
+			return;
+		}
+
+		option = prefixed;
+	}
+
+	config_parse(option, value);
+}
+
+// splits the buffer into lines in-place, so lines have no length limit
+static void config_read_buffer(const char *filename, char *buffer, int length,
+                               int depth) {
+	char *line = buffer;
+	char *end = buffer + length;
+	char *p;
+	char section[CONFIG_MAX_SECTION_LENGTH + 1] = "";
+
+	_location_filename = filename;
+	_location_line = 0;
+
+	while (line < end) {
+		p = line;
+
+		while (p < end && *p != '\r' && *p != '\n') {
+			++p;
+		}
+
+		++_location_line;
+
+		// \r\n counts as a single line break
+		if (p < end && *p == '\r' && p + 1 < end && p[1] == '\n') {
+			*p++ = '\0';
+		}
+
+		*p = '\0';
+
+		if (p > line) {
+			config_parse_line(filename, line, section, depth);
+		}
+
+		line = p + 1;
+	}
+}
+
+// resets all options to their default values and then reads the config file
+static void config_read(const char *filename) {
+	char *buffer;
+	int length;
+
+	config_reset_values();
+
+	if (array_create(&_values.listen_addresses, 4, sizeof(char *), 1) < 0 ||
+	    config_append_string(&_values.listen_addresses, _default_listen_address) < 0) {
+		config_error("Could not create listen address array: %s (%d)",
+		             get_errno_name(errno), errno);
+
+		return;
+	}
+
+	buffer = config_read_file(filename, &length);
+
+	if (buffer == NULL) {
 		if (_check_only) {
 			printf("Config file '%s' not found, using default values\n", filename);
 		}
@@ -267,46 +1051,217 @@ void config_init(const char *filename) {
 
 	_using_default_values = 0;
 
-	while (!feof(file)) {
-		fread(&c, 1, 1, file);
+	config_read_buffer(filename, buffer, length, 0);
 
-		if (feof(file) || c == '\r' || c == '\n') {
-			if (length > 0) {
-				config_parse(line);
-			}
+	free(buffer);
+
+	_location_filename = NULL;
+	_location_line = 0;
+}
+
+void config_init(const char *filename) {
+	_filename = filename;
 
-			length = 0;
-			skip = 0;
-		} else if (!skip && length < (int)sizeof(line) - 1) {
-			line[length++] = c;
-			line[length] = '\0';
+	config_read(filename);
+}
+
+// re-reads the config file given to config_init. if the config file is gone
+// or has errors then the running configuration is kept as a whole. otherwise
+// all options are applied, except for the ones that are only used during
+// startup. those keep their running value until brickd is restarted
+int config_reload(void) {
+	ConfigValues running;
+
+	memcpy(&running, &_values, sizeof(running));
+
+	_has_error = 0;
+	_using_default_values = 1;
+
+	config_read(_filename);
+
+	if (_has_error || _using_default_values) {
+		if (_using_default_values) {
+			log_error("Config file '%s' not found, keeping the running configuration",
+			          _filename);
 		} else {
-			length = 0;
-			skip = 1;
+			log_error("Errors found in config file '%s', keeping the running configuration, run with --check-config option for details",
+			          _filename);
 		}
+
+		array_destroy(&_values.listen_addresses, config_free_string);
+		memcpy(&_values, &running, sizeof(_values));
+
+		return -1;
 	}
 
-	fclose(file);
+	// the listen addresses are always kept, because the network and replay
+	// subsystems refer to the running strings
+	if (!config_equal_string_lists(&_values.listen_addresses,
+	                               &running.listen_addresses)) {
+		log_warn("Changing the listen.address option requires a restart, keeping the running value");
+	}
+
+	array_destroy(&_values.listen_addresses, config_free_string);
+	memcpy(&_values.listen_addresses, &running.listen_addresses, sizeof(Array));
+
+	CONFIG_KEEP_RUNNING_VALUE("listen.port", listen_port);
+	CONFIG_KEEP_RUNNING_VALUE("listen.backlog", listen_backlog);
+	CONFIG_KEEP_RUNNING_VALUE("listen.dual_stack", listen_dual_stack);
+	CONFIG_KEEP_RUNNING_STRING("metrics.address", metrics_address);
+	CONFIG_KEEP_RUNNING_VALUE("metrics.port", metrics_port);
+	CONFIG_KEEP_RUNNING_STRING("trace.file", trace_file);
+	CONFIG_KEEP_RUNNING_VALUE("trace.records", trace_records);
+	CONFIG_KEEP_RUNNING_VALUE("trace.payload", trace_payload);
+	CONFIG_KEEP_RUNNING_VALUE("simulator.stacks", simulator_stacks);
+	CONFIG_KEEP_RUNNING_VALUE("simulator.devices", simulator_devices);
+	CONFIG_KEEP_RUNNING_VALUE("simulator.first_uid", simulator_first_uid);
+	CONFIG_KEEP_RUNNING_VALUE("simulator.callback_rate", simulator_callback_rate);
+	CONFIG_KEEP_RUNNING_STRING("replay.file", replay_file);
+
+	log_info("Reloaded config file '%s'", _filename);
+
+	return 0;
 }
 
 void config_exit(void) {
-	if (_listen_address != _default_listen_address) {
-		free(_listen_address);
-	}
+	array_destroy(&_values.listen_addresses, config_free_string);
 }
 
 int config_has_error(void) {
 	return _has_error;
 }
 
-const char *config_get_listen_address(void) {
-	return _listen_address;
+// returns an array of strings
+Array *config_get_listen_addresses(void) {
+	return &_values.listen_addresses;
 }
 
 uint16_t config_get_listen_port(void) {
-	return _listen_port;
+	return _values.listen_port;
+}
+
+int config_get_listen_backlog(void) {
+	return _values.listen_backlog;
+}
+
+int config_get_listen_dual_stack(void) {
+	return _values.listen_dual_stack;
+}
+
+int config_get_listen_max_clients(void) {
+	return _values.listen_max_clients;
+}
+
+int config_get_usb_always_reset(void) {
+	return _values.usb_always_reset;
+}
+
+// returns the TTL in milliseconds, 0 means that the response cache is
+// disabled for this function ID
+uint32_t config_get_response_cache_ttl(uint8_t function_id) {
+	return _values.response_cache_ttls[function_id];
+}
+
+int config_get_response_cache_size(void) {
+	return _values.response_cache_size;
+}
+
+int config_get_request_coalescing(uint8_t function_id) {
+	return _values.request_coalescing[function_id];
+}
+
+int config_get_enumerate_cache_max_age(void) {
+	return _values.enumerate_cache_max_age;
+}
+
+uint32_t config_get_callback_throttle_interval(uint8_t function_id) {
+	return _values.callback_throttle_intervals[function_id];
+}
+
+uint32_t config_get_rate_limit_requests_per_second(void) {
+	return (uint32_t)_values.rate_limit_requests_per_second;
+}
+
+uint32_t config_get_rate_limit_uid_requests_per_second(void) {
+	return (uint32_t)_values.rate_limit_uid_requests_per_second;
+}
+
+int config_get_rate_limit_burst(void) {
+	return _values.rate_limit_burst;
+}
+
+int config_get_write_coalescing(uint8_t function_id) {
+	return _values.write_coalescing[function_id];
+}
+
+const char *config_get_metrics_address(void) {
+	return _values.metrics_address;
+}
+
+uint16_t config_get_metrics_port(void) {
+	return _values.metrics_port;
+}
+
+int config_get_event_loop_instrumentation(void) {
+	return _values.event_loop_instrumentation;
+}
+
+int config_get_event_loop_slow_handler_threshold(void) {
+	return _values.event_loop_slow_handler_threshold;
+}
+
+const char *config_get_trace_file(void) {
+	return _values.trace_file;
+}
+
+int config_get_trace_records(void) {
+	return _values.trace_records;
+}
+
+int config_get_trace_payload(void) {
+	return _values.trace_payload;
+}
+
+int config_get_simulator_stacks(void) {
+	return _values.simulator_stacks;
+}
+
+int config_get_simulator_devices(void) {
+	return _values.simulator_devices;
+}
+
+int config_get_simulator_first_uid(void) {
+	return _values.simulator_first_uid;
+}
+
+int config_get_simulator_response_latency(void) {
+	return _values.simulator_response_latency;
+}
+
+int config_get_simulator_callback_rate(void) {
+	return _values.simulator_callback_rate;
+}
+
+int config_get_simulator_error_rate(void) {
+	return _values.simulator_error_rate;
+}
+
+int config_get_simulator_drop_rate(void) {
+	return _values.simulator_drop_rate;
+}
+
+int config_get_simulator_transfer_error_rate(void) {
+	return _values.simulator_transfer_error_rate;
+}
+
+const char *config_get_replay_file(void) {
+	return _values.replay_file;
+}
+
+int config_get_replay_speed(void) {
+	return _values.replay_speed;
 }
 
 LogLevel config_get_log_level(LogCategory category) {
-	return _log_levels[category];
+	return _values.log_levels[category];
 }
@@ -25,16 +25,48 @@
 #include <stdint.h>
 
 #include "log.h"
+#include "utils.h"
 
 int config_check(const char *filename);
 
 void config_init(const char *filename);
+int config_reload(void);
 void config_exit(void);
 
 int config_has_error(void);
 
-const char *config_get_listen_address(void);
+Array *config_get_listen_addresses(void);
 uint16_t config_get_listen_port(void);
+int config_get_listen_backlog(void);
+int config_get_listen_dual_stack(void);
+int config_get_listen_max_clients(void);
+int config_get_usb_always_reset(void);
+uint32_t config_get_response_cache_ttl(uint8_t function_id);
+int config_get_response_cache_size(void);
+int config_get_request_coalescing(uint8_t function_id);
+int config_get_enumerate_cache_max_age(void);
+uint32_t config_get_callback_throttle_interval(uint8_t function_id);
+uint32_t config_get_rate_limit_requests_per_second(void);
+uint32_t config_get_rate_limit_uid_requests_per_second(void);
+int config_get_rate_limit_burst(void);
+int config_get_write_coalescing(uint8_t function_id);
+const char *config_get_metrics_address(void);
+uint16_t config_get_metrics_port(void);
+int config_get_event_loop_instrumentation(void);
+int config_get_event_loop_slow_handler_threshold(void);
+const char *config_get_trace_file(void);
+int config_get_trace_records(void);
+int config_get_trace_payload(void);
+int config_get_simulator_stacks(void);
+int config_get_simulator_devices(void);
+int config_get_simulator_first_uid(void);
+int config_get_simulator_response_latency(void);
+int config_get_simulator_callback_rate(void);
+int config_get_simulator_error_rate(void);
+int config_get_simulator_drop_rate(void);
+int config_get_simulator_transfer_error_rate(void);
+const char *config_get_replay_file(void);
+int config_get_replay_speed(void);
 LogLevel config_get_log_level(LogCategory category);
 
 #endif // BRICKD_CONFIG_H
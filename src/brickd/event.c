@@ -23,16 +23,34 @@
 
 #include "event.h"
 
+#include "config.h"
 #include "log.h"
 #include "pipe.h"
 #include "utils.h"
 
 #define LOG_CATEGORY LOG_CATEGORY_EVENT
 
+#define SLOW_HANDLER_WARNING_INTERVAL 10000000 // in microseconds
+
 static Array _event_sources = ARRAY_INITIALIZER;
+static Array _timers = ARRAY_INITIALIZER;
 static int _running = 0;
 static int _stop_requested = 0;
 
+// instrumentation of the event loop, only active if enabled in the config
+static int _instrumentation = 0;
+static uint64_t _slow_handler_threshold = 0; // in microseconds
+static uint64_t _wait_started = 0;
+static uint64_t _work_started = 0;
+static uint64_t _last_slow_handler_warning = 0;
+static uint64_t _suppressed_slow_handlers = 0;
+static EventMetrics _metrics;
+
+static EventFunction _reload_function = NULL;
+static void *_reload_opaque = NULL;
+static EventFunction _handoff_function = NULL;
+static void *_handoff_opaque = NULL;
+
 extern int event_init_platform(void);
 extern void event_exit_platform(void);
 extern int event_run_platform(Array *sources, int *running);
@@ -51,9 +69,24 @@ const char *event_get_source_type_name(EventSourceType type, int upper) {
 	}
 }
 
+static void event_apply_config(void) {
+	int instrumentation = config_get_event_loop_instrumentation();
+
+	// don't record a wait or work phase that started before the change
+	if (instrumentation != _instrumentation) {
+		_wait_started = 0;
+		_work_started = 0;
+	}
+
+	_instrumentation = instrumentation;
+	_slow_handler_threshold = (uint64_t)config_get_event_loop_slow_handler_threshold() * 1000;
+}
+
 int event_init(void) {
 	log_debug("Initializing event subsystem");
 
+	event_apply_config();
+
 	if (array_create(&_event_sources, 32, sizeof(EventSource), 1) < 0) {
 		log_error("Could not create event source array: %s (%d)",
 		          get_errno_name(errno), errno);
@@ -61,7 +94,19 @@ int event_init(void) {
 		return -1;
 	}
 
+	// the timer array stores pointers, the EventTimer structs are owned by
+	// the code that added them
+	if (array_create(&_timers, 16, sizeof(EventTimer *), 1) < 0) {
+		log_error("Could not create timer array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		array_destroy(&_event_sources, NULL);
+
+		return -1;
+	}
+
 	if (event_init_platform() < 0) {
+		array_destroy(&_timers, NULL);
 		array_destroy(&_event_sources, NULL);
 
 		return -1;
@@ -82,6 +127,12 @@ void event_exit(void) {
 	}
 
 	array_destroy(&_event_sources, NULL);
+
+	if (_timers.count > 0) {
+		log_warn("Leaking %d timers", _timers.count);
+	}
+
+	array_destroy(&_timers, NULL);
 }
 
 int event_add_source(EventHandle handle, EventSourceType type, int events,
@@ -195,6 +246,277 @@ void event_cleanup_sources(void) {
 	}
 }
 
+// records the time a handler took and warns about handlers that block the
+// event loop for too long. warnings are sampled, at most one is logged per
+// interval and the others are only counted
+static void event_record_handler(LatencyHistogram *histogram, uint64_t started,
+                                 const char *type, EventHandle handle,
+                                 void *timer) {
+	uint64_t now = microseconds();
+	uint64_t duration = now >= started ? now - started : 0;
+
+	metrics_record_latency(histogram, duration);
+
+	if (_slow_handler_threshold == 0 || duration < _slow_handler_threshold) {
+		return;
+	}
+
+	++_metrics.slow_handlers;
+
+	if (_last_slow_handler_warning != 0 &&
+	    now < _last_slow_handler_warning + SLOW_HANDLER_WARNING_INTERVAL) {
+		++_suppressed_slow_handlers;
+
+		return;
+	}
+
+	if (timer != NULL) {
+		log_warn("Handling timer %p blocked the event loop for %u msec (suppressed warnings: %u)",
+		         timer, (uint32_t)(duration / 1000),
+		         (uint32_t)_suppressed_slow_handlers);
+	} else {
+		log_warn("Handling %s event source (handle: %d) blocked the event loop for %u msec (suppressed warnings: %u)",
+		         type, handle, (uint32_t)(duration / 1000),
+		         (uint32_t)_suppressed_slow_handlers);
+	}
+
+	_last_slow_handler_warning = now;
+	_suppressed_slow_handlers = 0;
+}
+
+// called by the platform specific part to handle a ready event source. the
+// event source array is relocatable and the handler might add new event
+// sources, therefore the event source is not accessed after the call
+void event_handle_source(EventSource *event_source) {
+	EventSourceType type = event_source->type;
+	EventHandle handle = event_source->handle;
+	uint64_t started;
+
+	if (event_source->function == NULL) {
+		return;
+	}
+
+	if (!_instrumentation) {
+		event_source->function(event_source->opaque);
+
+		return;
+	}
+
+	started = microseconds();
+
+	event_source->function(event_source->opaque);
+
+	event_record_handler(type == EVENT_SOURCE_TYPE_USB
+	                     ? &_metrics.usb_handlers : &_metrics.generic_handlers,
+	                     started, event_get_source_type_name(type, 0),
+	                     handle, NULL);
+}
+
+// called by the platform specific part right before and after it waits for
+// events. the time between two waits is the work done in one iteration
+void event_begin_wait(void) {
+	if (!_instrumentation) {
+		return;
+	}
+
+	_wait_started = microseconds();
+
+	if (_work_started != 0 && _wait_started >= _work_started) {
+		metrics_record_latency(&_metrics.work, _wait_started - _work_started);
+	}
+}
+
+void event_end_wait(void) {
+	if (!_instrumentation) {
+		return;
+	}
+
+	_work_started = microseconds();
+
+	if (_wait_started != 0 && _work_started >= _wait_started) {
+		metrics_record_latency(&_metrics.wait, _work_started - _wait_started);
+	}
+}
+
+// returns NULL if the instrumentation is disabled
+EventMetrics *event_get_metrics(void) {
+	return _instrumentation ? &_metrics : NULL;
+}
+
+// timers are handled by the event loop itself. the platform specific part
+// limits its wait time with event_get_timer_timeout and calls
+// event_handle_timers after each iteration
+int event_add_timer(EventTimer *timer, EventFunction function, void *opaque) {
+	EventTimer **timer_pointer = array_append(&_timers);
+
+	if (timer_pointer == NULL) {
+		log_error("Could not append to timer array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	timer->deadline = 0;
+	timer->interval = 0;
+	timer->function = function;
+	timer->opaque = opaque;
+
+	*timer_pointer = timer;
+
+	return 0;
+}
+
+void event_remove_timer(EventTimer *timer) {
+	int i;
+
+	for (i = 0; i < _timers.count; ++i) {
+		if (*(EventTimer **)array_get(&_timers, i) == timer) {
+			array_remove(&_timers, i, NULL);
+
+			return;
+		}
+	}
+
+	log_warn("Could not remove unknown timer %p", timer);
+}
+
+// delay and interval are in microseconds. the timer fires once after delay
+// and then every interval, if interval is not 0
+void event_start_timer(EventTimer *timer, uint64_t delay, uint64_t interval) {
+	timer->deadline = microseconds() + delay;
+	timer->interval = interval;
+
+	if (timer->deadline == 0) {
+		timer->deadline = 1;
+	}
+}
+
+void event_stop_timer(EventTimer *timer) {
+	timer->deadline = 0;
+}
+
+// returns the time in milliseconds until the next timer expires or -1 if no
+// timer is running
+int event_get_timer_timeout(void) {
+	int i;
+	EventTimer *timer;
+	uint64_t deadline = 0;
+	uint64_t now;
+
+	for (i = 0; i < _timers.count; ++i) {
+		timer = *(EventTimer **)array_get(&_timers, i);
+
+		if (timer->deadline != 0 &&
+		    (deadline == 0 || timer->deadline < deadline)) {
+			deadline = timer->deadline;
+		}
+	}
+
+	if (deadline == 0) {
+		return -1;
+	}
+
+	now = microseconds();
+
+	if (deadline <= now) {
+		return 0;
+	}
+
+	// round up to avoid waking up shortly before the deadline
+	if ((deadline - now + 999) / 1000 > 0x7FFFFFFF) {
+		return 0x7FFFFFFF;
+	}
+
+	return (int)((deadline - now + 999) / 1000);
+}
+
+void event_handle_timers(void) {
+	int i;
+	EventTimer *timer;
+	EventTimer *expired;
+	uint64_t now = microseconds();
+	uint64_t started;
+
+	// the timer array can change while a timer function is called, therefore
+	// search for the next expired timer again after each call
+	for (;;) {
+		expired = NULL;
+
+		for (i = 0; i < _timers.count; ++i) {
+			timer = *(EventTimer **)array_get(&_timers, i);
+
+			if (timer->deadline != 0 && timer->deadline <= now &&
+			    (expired == NULL || timer->deadline < expired->deadline)) {
+				expired = timer;
+			}
+		}
+
+		if (expired == NULL) {
+			break;
+		}
+
+		if (expired->interval == 0) {
+			expired->deadline = 0;
+		} else {
+			expired->deadline += expired->interval;
+
+			// skip missed intervals instead of firing repeatedly
+			if (expired->deadline <= now) {
+				expired->deadline = now + expired->interval;
+			}
+		}
+
+		if (!_instrumentation) {
+			expired->function(expired->opaque);
+		} else {
+			started = microseconds();
+
+			expired->function(expired->opaque);
+
+			event_record_handler(&_metrics.timer_handlers, started, "timer",
+			                     INVALID_EVENT_HANDLE, expired);
+		}
+	}
+}
+
+// the reload function is called if a config reload was requested, e.g. by
+// SIGHUP. afterwards the event loop applies its own options again
+void event_set_reload_function(EventFunction function, void *opaque) {
+	_reload_function = function;
+	_reload_opaque = opaque;
+}
+
+// called by the platform specific part
+void event_reload(void) {
+	if (_reload_function == NULL) {
+		log_warn("Ignoring config reload request, no reload function is set");
+
+		return;
+	}
+
+	_reload_function(_reload_opaque);
+
+	event_apply_config();
+}
+
+// the handoff function is called if a handoff to a new brickd process was
+// requested, e.g. by SIGUSR2
+void event_set_handoff_function(EventFunction function, void *opaque) {
+	_handoff_function = function;
+	_handoff_opaque = opaque;
+}
+
+// called by the platform specific part
+void event_handoff(void) {
+	if (_handoff_function == NULL) {
+		log_warn("Ignoring handoff request, no handoff function is set");
+
+		return;
+	}
+
+	_handoff_function(_handoff_opaque);
+}
+
 int event_run(void) {
 	int rc;
 
@@ -22,12 +22,16 @@
 #ifndef BRICKD_EVENT_H
 #define BRICKD_EVENT_H
 
+#include <stdint.h>
+
 #ifdef _WIN32
 	#include <winsock2.h>
 #else
 	#include <poll.h>
 #endif
 
+#include "metrics.h"
+
 #ifdef _WIN32
 typedef SOCKET EventHandle;
 #else
@@ -73,6 +77,22 @@ typedef struct {
 	void *opaque;
 } EventSource;
 
+typedef struct {
+	LatencyHistogram wait; // waiting for events per iteration
+	LatencyHistogram work; // handling events and timers per iteration
+	LatencyHistogram generic_handlers;
+	LatencyHistogram usb_handlers;
+	LatencyHistogram timer_handlers;
+	uint64_t slow_handlers;
+} EventMetrics;
+
+typedef struct {
+	uint64_t deadline; // in microseconds, 0 means stopped
+	uint64_t interval; // in microseconds, 0 means one-shot
+	EventFunction function;
+	void *opaque;
+} EventTimer;
+
 const char *event_get_source_type_name(EventSourceType type, int upper);
 
 int event_init(void);
@@ -82,6 +102,24 @@ int event_add_source(EventHandle handle, EventSourceType type,
                      int events, EventFunction function, void *opaque);
 int event_remove_source(EventHandle handle, EventSourceType type);
 void event_cleanup_sources(void);
+void event_handle_source(EventSource *event_source);
+
+int event_add_timer(EventTimer *timer, EventFunction function, void *opaque);
+void event_remove_timer(EventTimer *timer);
+void event_start_timer(EventTimer *timer, uint64_t delay, uint64_t interval);
+void event_stop_timer(EventTimer *timer);
+int event_get_timer_timeout(void);
+void event_handle_timers(void);
+
+void event_begin_wait(void);
+void event_end_wait(void);
+EventMetrics *event_get_metrics(void);
+
+void event_set_reload_function(EventFunction function, void *opaque);
+void event_reload(void);
+
+void event_set_handoff_function(EventFunction function, void *opaque);
+void event_handoff(void);
 
 int event_run(void);
 void event_stop(void);
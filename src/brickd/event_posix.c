@@ -51,6 +51,18 @@ static void event_handle_signal(void *opaque) {
 		log_info("Received SIGINT");
 	} else if (signal_number == SIGTERM) {
 		log_info("Received SIGTERM");
+	} else if (signal_number == SIGHUP) {
+		log_info("Received SIGHUP, reloading config");
+
+		event_reload();
+
+		return;
+	} else if (signal_number == SIGUSR2) {
+		log_info("Received SIGUSR2, handing off to a new brickd process");
+
+		event_handoff();
+
+		return;
 	} else {
 		log_warn("Received unexpected signal %d", signal_number);
 
@@ -113,8 +125,46 @@ int event_init_platform(void) {
 
 	phase = 5;
 
+	if (signal(SIGHUP, event_forward_signal) == SIG_ERR) {
+		log_error("Could install signal handler for SIGHUP: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 6;
+
+	if (signal(SIGUSR2, event_forward_signal) == SIG_ERR) {
+		log_error("Could install signal handler for SIGUSR2: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 7;
+
+	// a client that disconnects with responses in flight makes send fail with
+	// EPIPE, this is handled as an error instead of terminating brickd
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		log_error("Could not ignore SIGPIPE signal: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 8;
+
 cleanup:
 	switch (phase) { // no breaks, all cases fall through intentionally
+	case 7:
+		signal(SIGUSR2, SIG_DFL);
+
+	case 6:
+		signal(SIGHUP, SIG_DFL);
+
+	case 5:
+		signal(SIGTERM, SIG_DFL);
+
 	case 4:
 		signal(SIGINT, SIG_DFL);
 
@@ -131,12 +181,15 @@ cleanup:
 		break;
 	}
 
-	return phase == 5 ? 0 : -1;
+	return phase == 8 ? 0 : -1;
 }
 
 void event_exit_platform(void) {
 	signal(SIGINT, SIG_DFL);
 	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGUSR2, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
 
 	event_remove_source(_signal_pipe[0], EVENT_SOURCE_TYPE_GENERIC);
 	pipe_destroy(_signal_pipe);
@@ -176,7 +229,12 @@ int event_run_platform(Array *event_sources, int *running) {
 		// start to poll
 		log_debug("Starting to poll on %d event source(s)", _pollfds.count);
 
-		ready = poll((struct pollfd *)_pollfds.bytes, _pollfds.count, -1);
+		event_begin_wait();
+
+		ready = poll((struct pollfd *)_pollfds.bytes, _pollfds.count,
+		             event_get_timer_timeout());
+
+		event_end_wait();
 
 		if (ready < 0) {
 			if (errno_interrupted()) {
@@ -222,9 +280,7 @@ int event_run_platform(Array *event_sources, int *running) {
 				          event_get_source_type_name(event_source->type, 0),
 				          event_source->handle, pollfd->revents, i);
 
-				if (event_source->function != NULL) {
-					event_source->function(event_source->opaque);
-				}
+				event_handle_source(event_source);
 			}
 
 			++handled;
@@ -244,6 +300,10 @@ int event_run_platform(Array *event_sources, int *running) {
 		// now remove event sources that got marked as removed during the
 		// event handling
 		event_cleanup_sources();
+
+		if (*running) {
+			event_handle_timers();
+		}
 	}
 
 	return 0;
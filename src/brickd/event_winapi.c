@@ -281,7 +281,7 @@ static void event_forward_usb_events(void *opaque) {
 			          event_get_source_type_name(event_source->type, 0),
 			          event_source->handle, pollfd->revents, i);
 
-			event_source->function(event_source->opaque);
+			event_handle_source(event_source);
 		}
 
 		++handled;
@@ -452,6 +452,8 @@ int event_run_platform(Array *event_sources, int *running) {
 	int rc;
 	int event_source_count;
 	int received_events;
+	int timeout;
+	struct timeval tv;
 
 	if (event_add_source(_usb_poller.ready_pipe[0], EVENT_SOURCE_TYPE_GENERIC,
 	                     EVENT_READ, event_forward_usb_events,
@@ -514,7 +516,19 @@ int event_run_platform(Array *event_sources, int *running) {
 		fd_read_set = event_get_socket_set_as_fd_set(_socket_read_set);
 		fd_write_set = event_get_socket_set_as_fd_set(_socket_write_set);
 
-		ready = select(0, fd_read_set, fd_write_set, NULL, NULL);
+		timeout = event_get_timer_timeout();
+
+		if (timeout >= 0) {
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = (timeout % 1000) * 1000;
+		}
+
+		event_begin_wait();
+
+		ready = select(0, fd_read_set, fd_write_set, NULL,
+		               timeout >= 0 ? &tv : NULL);
+
+		event_end_wait();
 
 		if (_usb_poller.running) {
 			log_debug("Sending suspend signal to USB poll thread");
@@ -596,9 +610,7 @@ int event_run_platform(Array *event_sources, int *running) {
 				          event_get_source_type_name(event_source->type, 0),
 				          event_source->handle, received_events, i);
 
-				if (event_source->function != NULL) {
-					event_source->function(event_source->opaque);
-				}
+				event_handle_source(event_source);
 			}
 
 			++handled;
@@ -620,6 +632,10 @@ int event_run_platform(Array *event_sources, int *running) {
 		// now remove event sources that got marked as removed during the
 		// event handling
 		event_cleanup_sources();
+
+		if (*running) {
+			event_handle_timers();
+		}
 	}
 
 	result = 0;
@@ -0,0 +1,401 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * fuzz_client.c: Fuzz harness for the client receive and parse loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * feeds untrusted bytes through a socket pair into client_handle_receive, the
+ * same path a request from the network takes. the first input byte selects
+ * the chunk size the rest of the input is sent in, to cover requests that
+ * arrive in pieces. the USB and network side are replaced by stubs that only
+ * count the dispatched requests.
+ *
+ * besides crashes (build with sanitizers) the harness aborts if the client
+ * stops making progress, if closing the peer is not detected as disconnect,
+ * if the header validation accepts an impossible length or if an input causes
+ * more log output than a fixed budget. inputs that are slow because of
+ * superlinear work are reported by the timeout of the fuzzing engine.
+ *
+ * libFuzzer:  make fuzz-client FUZZ_CC=clang FUZZ_ENGINE=libfuzzer
+ *             ./fuzz-client -timeout=1 corpus/
+ * AFL:        make fuzz-client FUZZ_CC=afl-clang-fast
+ *             afl-fuzz -i corpus -o findings -- ./fuzz-client
+ * standalone: ./fuzz-client [-r <count>] [<file>...]
+ *
+ * without libFuzzer the harness reads one input from stdin, runs the given
+ * input files or generates <count> random inputs. a generated input is written
+ * to fuzz-client-input.bin before it is run, so a failing one can be rerun.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "client.h"
+#include "event.h"
+#include "inflight.h"
+#include "log.h"
+#include "network.h"
+#include "packet.h"
+#include "socket.h"
+#include "usb.h"
+#include "utils.h"
+
+#define MAX_CHUNK_SIZE 64
+#define MAX_INPUT_SIZE 65536
+#define MAX_LOG_OUTPUT 4096 // in bytes per input
+
+static Client _client;
+static int _disconnected = 0;
+static int _dispatched = 0;
+static Array _no_items = ARRAY_INITIALIZER;
+static FILE *_log_file = NULL;
+
+// stubs for the network and USB subsystems
+
+void network_client_disconnected(Client *client) {
+	inflight_remove_client(client);
+	client_destroy(client);
+
+	_disconnected = 1;
+}
+
+Array *network_get_clients(void) {
+	return &_no_items;
+}
+
+void usb_dispatch_packet(Packet *packet, void *owner) {
+	(void)packet;
+	(void)owner;
+
+	++_dispatched;
+}
+
+void usb_dispatch_enumerate_request(Packet *request, void *owner,
+                                    Array *callbacks) {
+	(void)request;
+	(void)owner;
+	(void)callbacks;
+
+	++_dispatched;
+}
+
+Array *usb_get_bricks(void) {
+	return &_no_items;
+}
+
+static void fuzz_fail(const char *format, ...) ATTRIBUTE_FMT_PRINTF(1, 2);
+
+static void fuzz_fail(const char *format, ...) {
+	va_list arguments;
+
+	va_start(arguments, format);
+	fprintf(stderr, "fuzz-client: ");
+	vfprintf(stderr, format, arguments);
+	fprintf(stderr, "\n");
+	va_end(arguments);
+
+	abort();
+}
+
+static void fuzz_init(void) {
+	log_init();
+
+	// measure the log output of each input, without printing it
+	_log_file = tmpfile();
+
+	if (_log_file == NULL) {
+		fuzz_fail("could not create log file: %s (%d)", get_errno_name(errno), errno);
+	}
+
+	log_set_file(_log_file);
+
+	if (event_init() < 0 || cache_init() < 0 || inflight_init() < 0) {
+		fuzz_fail("could not initialize subsystems");
+	}
+}
+
+static void fuzz_check_header(const uint8_t *data, size_t size) {
+	PacketHeader header;
+	const char *message;
+
+	if (size < sizeof(header)) {
+		return;
+	}
+
+	memcpy(&header, data, sizeof(header));
+
+	if (packet_header_is_valid_request(&header, &message) &&
+	    (header.length < sizeof(PacketHeader) || header.length > sizeof(Packet) ||
+	     header.function_id == 0 || header.sequence_number == 0)) {
+		fuzz_fail("invalid request header accepted (L: %u, F: %u, S: %u)",
+		          header.length, header.function_id, header.sequence_number);
+	}
+}
+
+static void fuzz_client(const uint8_t *data, size_t size) {
+	int sockets[2];
+	struct sockaddr_in address;
+	size_t chunk_size;
+	size_t offset;
+	size_t length;
+	uint64_t sent = 0;
+	long log_output;
+
+	if (size < 1) {
+		return;
+	}
+
+	chunk_size = data[0] % MAX_CHUNK_SIZE + 1;
+
+	++data;
+	--size;
+
+	if (size > MAX_INPUT_SIZE) {
+		size = MAX_INPUT_SIZE;
+	}
+
+	fuzz_check_header(data, size);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0) {
+		fuzz_fail("could not create socket pair: %s (%d)", get_errno_name(errno), errno);
+	}
+
+	// client sockets are non-blocking in brickd
+	if (socket_set_non_blocking(sockets[1], 1) < 0) {
+		fuzz_fail("could not enable non-blocking mode: %s (%d)", get_errno_name(errno), errno);
+	}
+
+	memset(&address, 0, sizeof(address));
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (client_create(&_client, sockets[1], (struct sockaddr *)&address,
+	                  sizeof(address)) < 0) {
+		fuzz_fail("could not create client");
+	}
+
+	rewind(_log_file);
+
+	_disconnected = 0;
+	_dispatched = 0;
+
+	for (offset = 0; offset < size && !_disconnected; offset += length) {
+		length = size - offset;
+
+		if (length > chunk_size) {
+			length = chunk_size;
+		}
+
+		if (send(sockets[0], data + offset, length, 0) != (ssize_t)length) {
+			fuzz_fail("could not send chunk: %s (%d)", get_errno_name(errno), errno);
+		}
+
+		sent += length;
+
+		// each call receives at least one byte, unless the receive buffer is
+		// full. a full buffer makes the receive return 0, which looks like a
+		// disconnect by the peer
+		while (!_disconnected && !_client.throttled &&
+		       _client.metrics.bytes_received < sent) {
+			if (_client.packet_used >= (int)sizeof(Packet)) {
+				fuzz_fail("receive buffer is full, but no request got handled (L: %u)",
+				          _client.packet.header.length);
+			}
+
+			client_handle_receive(&_client);
+		}
+	}
+
+	close(sockets[0]);
+
+	if (!_disconnected) {
+		if (_client.throttled) {
+			client_destroy(&_client);
+		} else {
+			client_handle_receive(&_client);
+
+			if (!_disconnected) {
+				fuzz_fail("closing the peer was not detected as disconnect");
+			}
+		}
+	}
+
+	fflush(_log_file);
+
+	log_output = ftell(_log_file);
+
+	if (log_output > MAX_LOG_OUTPUT) {
+		fuzz_fail("%ld bytes of log output for %u input bytes (%d requests dispatched)",
+		          log_output, (uint32_t)size, _dispatched);
+	}
+}
+
+#ifdef BRICKD_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	static int initialized = 0;
+
+	if (!initialized) {
+		fuzz_init();
+
+		initialized = 1;
+	}
+
+	fuzz_client(data, size);
+
+	return 0;
+}
+
+#else
+
+static uint8_t _input[MAX_INPUT_SIZE + 1];
+
+static uint32_t _random_state = 2463534242U;
+
+static uint32_t fuzz_random(void) {
+	_random_state ^= _random_state << 13;
+	_random_state ^= _random_state >> 17;
+	_random_state ^= _random_state << 5;
+
+	return _random_state;
+}
+
+// a mix of valid requests, requests with invalid fields or lengths and junk
+static size_t fuzz_generate(void) {
+	size_t size = 1;
+	size_t limit = fuzz_random() % 4096 + 1;
+	PacketHeader header;
+	int payload_length;
+	int i;
+
+	_input[0] = (uint8_t)fuzz_random();
+
+	while (size + sizeof(Packet) < limit) {
+		memset(&header, 0, sizeof(header));
+
+		header.uid = fuzz_random() % 4;
+		header.function_id = (uint8_t)(fuzz_random() % 4);
+		header.sequence_number = fuzz_random() % 16;
+		header.response_expected = fuzz_random() % 2;
+		payload_length = fuzz_random() % (sizeof(Packet) - sizeof(PacketHeader) + 1);
+
+		switch (fuzz_random() % 8) {
+		case 0: // too small
+			header.length = fuzz_random() % sizeof(PacketHeader);
+			break;
+
+		case 1: // too big
+			header.length = sizeof(Packet) + 1 + fuzz_random() % (255 - sizeof(Packet));
+			break;
+
+		case 2: // junk
+			for (i = 0; i < payload_length; ++i) {
+				_input[size++] = (uint8_t)fuzz_random();
+			}
+
+			continue;
+
+		default:
+			header.length = sizeof(PacketHeader) + payload_length;
+			break;
+		}
+
+		memcpy(_input + size, &header, sizeof(header));
+		size += sizeof(header);
+
+		for (i = 0; i < payload_length; ++i) {
+			_input[size++] = (uint8_t)fuzz_random();
+		}
+	}
+
+	return size;
+}
+
+static size_t fuzz_read(FILE *file) {
+	return fread(_input, 1, sizeof(_input), file);
+}
+
+int main(int argc, char **argv) {
+	int count = 0;
+	int first = 1;
+	int i;
+	size_t size;
+	FILE *file;
+
+	if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
+		count = atoi(argv[2]);
+		first = 3;
+	}
+
+	fuzz_init();
+
+	for (i = 0; i < count; ++i) {
+		size = fuzz_generate();
+
+		file = fopen("fuzz-client-input.bin", "wb");
+
+		if (file != NULL) {
+			fwrite(_input, 1, size, file);
+			fclose(file);
+		}
+
+		fuzz_client(_input, size);
+	}
+
+	if (count > 0) {
+		printf("%d random inputs passed\n", count);
+	}
+
+	for (i = first; i < argc; ++i) {
+		file = fopen(argv[i], "rb");
+
+		if (file == NULL) {
+			fprintf(stderr, "Could not open '%s': %s (%d)\n",
+			        argv[i], get_errno_name(errno), errno);
+
+			return 1;
+		}
+
+		size = fuzz_read(file);
+
+		fclose(file);
+
+		fuzz_client(_input, size);
+
+		printf("%s passed\n", argv[i]);
+	}
+
+	if (count == 0 && first >= argc) {
+		size = fuzz_read(stdin);
+
+		fuzz_client(_input, size);
+	}
+
+	return 0;
+}
+
+#endif
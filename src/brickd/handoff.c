@@ -0,0 +1,935 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * handoff.c: Handoff of sockets to a new brickd process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * a handoff replaces a running brickd process by a new one, e.g. after an
+ * upgrade, without disconnecting its clients. the old process starts the new
+ * executable with the --handoff option and passes its server sockets and
+ * client sockets over a Unix socket pair using SCM_RIGHTS. the pending
+ * requests and the partially received request of each client are passed
+ * along, so responses from the Bricks still reach the right client. requests
+ * that are still queued for a Brick are passed along as well and removed from
+ * the write queues of the old process. the new process queues them again
+ * before it reads new requests from the client.
+ *
+ * the new process acknowledges the handoff after it received everything. the
+ * old process then releases the sockets without shutting them down and exits.
+ * its end of the socket pair is only closed on exit, so the new process waits
+ * for the end-of-file before it claims the USB devices and the PID file. the
+ * Bricks are not reset, because they are in a known state. meanwhile the
+ * kernel buffers incoming requests and connections, so clients only see a
+ * brief pause. responses that arrive at the old process after the handoff
+ * are lost.
+ *
+ * the wire format is only meant for the same brickd version or the next one
+ * on the same machine, the hello record guards against mismatches.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "handoff.h"
+
+#include "client.h"
+#include "log.h"
+#include "network.h"
+#include "socket.h"
+#include "usb.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_OTHER
+
+#define HANDOFF_MAGIC 0x4248444F // "BHDO"
+#define HANDOFF_VERSION 2
+#define MAX_OPTIONS 8
+#define MAX_INHERITED_HANDLE 65536 // handles above are not closed before exec
+#define ACKNOWLEDGE_TIMEOUT 5000 // in milliseconds
+#define EXIT_TIMEOUT 30000 // in milliseconds
+
+typedef enum {
+	HANDOFF_RECORD_HELLO = 0,
+	HANDOFF_RECORD_SERVER_SOCKET,
+	HANDOFF_RECORD_CLIENT,
+	HANDOFF_RECORD_END
+} HandoffRecordType;
+
+typedef struct {
+	uint32_t type;
+	uint32_t length; // of the data following the record
+} HandoffRecord;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t packet_size;
+	uint32_t pending_request_size;
+} HandoffHello;
+
+// followed by the partially received request, the pending requests and the
+// requests that are still queued for a Brick
+typedef struct {
+	struct sockaddr_storage address;
+	uint32_t address_length;
+	uint32_t packet_used;
+	uint32_t pending_request_count;
+	uint32_t queued_request_count;
+} HandoffClientState;
+
+typedef struct {
+	EventHandle socket;
+	HandoffClientState state;
+	Packet packet;
+	Array pending_requests;
+	Array queued_requests;
+} HandoffClient;
+
+static int _received = 0;
+static Array _server_sockets = ARRAY_INITIALIZER;
+static Array _clients = ARRAY_INITIALIZER;
+
+static void handoff_close_server_socket(EventHandle *server_socket) {
+	socket_close(*server_socket);
+}
+
+static void handoff_destroy_client(HandoffClient *client) {
+	if (client->socket != INVALID_EVENT_HANDLE) {
+		socket_close(client->socket);
+	}
+
+	array_destroy(&client->pending_requests, NULL);
+	array_destroy(&client->queued_requests, NULL);
+}
+
+// returns 1 on success, 0 on end-of-file and -1 on error
+static int handoff_read(int channel, void *buffer, int length) {
+	int offset = 0;
+	int rc;
+
+	while (offset < length) {
+		rc = read(channel, (uint8_t *)buffer + offset, length - offset);
+
+		if (rc < 0) {
+			if (errno_interrupted()) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		if (rc == 0) {
+			return 0;
+		}
+
+		offset += rc;
+	}
+
+	return 1;
+}
+
+static int handoff_write(int channel, const void *buffer, int length) {
+	int offset = 0;
+	int rc;
+
+	while (offset < length) {
+		rc = write(channel, (const uint8_t *)buffer + offset, length - offset);
+
+		if (rc < 0) {
+			if (errno_interrupted()) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		offset += rc;
+	}
+
+	return 0;
+}
+
+// the handle is attached to the record, if it is valid
+static int handoff_send_record(int channel, HandoffRecordType type,
+                               EventHandle handle, const void *data,
+                               int length) {
+	HandoffRecord record;
+	struct msghdr message;
+	struct iovec iov;
+	union {
+		struct cmsghdr header;
+		uint8_t buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	int rc;
+
+	record.type = type;
+	record.length = length;
+
+	memset(&message, 0, sizeof(message));
+
+	iov.iov_base = &record;
+	iov.iov_len = sizeof(record);
+
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+
+	if (handle != INVALID_EVENT_HANDLE) {
+		memset(&control, 0, sizeof(control));
+
+		message.msg_control = control.buffer;
+		message.msg_controllen = sizeof(control.buffer);
+
+		cmsg = CMSG_FIRSTHDR(&message);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+
+		memcpy(CMSG_DATA(cmsg), &handle, sizeof(int));
+	}
+
+	do {
+		rc = sendmsg(channel, &message, 0);
+	} while (rc < 0 && errno_interrupted());
+
+	if (rc < 0) {
+		return -1;
+	}
+
+	// the handle is attached to the first byte, the rest is sent as usual
+	if (handoff_write(channel, (uint8_t *)&record + rc, sizeof(record) - rc) < 0) {
+		return -1;
+	}
+
+	if (length > 0 && handoff_write(channel, data, length) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// returns 1 on success, 0 on end-of-file and -1 on error. the handle is set
+// to INVALID_EVENT_HANDLE if none is attached to the record
+static int handoff_receive_record(int channel, HandoffRecord *record,
+                                  EventHandle *handle) {
+	struct msghdr message;
+	struct iovec iov;
+	union {
+		struct cmsghdr header;
+		uint8_t buffer[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	int rc;
+
+	*handle = INVALID_EVENT_HANDLE;
+
+	memset(&message, 0, sizeof(message));
+
+	iov.iov_base = record;
+	iov.iov_len = sizeof(*record);
+
+	message.msg_iov = &iov;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	do {
+		rc = recvmsg(channel, &message, 0);
+	} while (rc < 0 && errno_interrupted());
+
+	if (rc <= 0) {
+		return rc;
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&message, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int))) {
+			memcpy(handle, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+
+	if ((message.msg_flags & MSG_CTRUNC) != 0) {
+		errno = EMSGSIZE;
+
+		goto error;
+	}
+
+	rc = handoff_read(channel, (uint8_t *)record + rc, sizeof(*record) - rc);
+
+	if (rc <= 0) {
+		goto error;
+	}
+
+	return 1;
+
+error:
+	if (*handle != INVALID_EVENT_HANDLE) {
+		close(*handle);
+
+		*handle = INVALID_EVENT_HANDLE;
+	}
+
+	return rc <= 0 ? rc : -1;
+}
+
+static int handoff_send_client(int channel, Client *client) {
+	HandoffClientState *state;
+	Array queued_requests;
+	int length;
+	int rc;
+
+	if (array_create(&queued_requests, 32, sizeof(Packet), 1) < 0) {
+		return -1;
+	}
+
+	if (usb_copy_queued_requests(client, &queued_requests) < 0) {
+		array_destroy(&queued_requests, NULL);
+
+		return -1;
+	}
+
+	length = sizeof(HandoffClientState) + client->packet_used +
+	         client->pending_requests.count * sizeof(PendingRequest) +
+	         queued_requests.count * sizeof(Packet);
+	state = calloc(1, length);
+
+	if (state == NULL) {
+		array_destroy(&queued_requests, NULL);
+
+		errno = ENOMEM;
+
+		return -1;
+	}
+
+	memcpy(&state->address, &client->address, client->address_length);
+
+	state->address_length = client->address_length;
+	state->packet_used = client->packet_used;
+	state->pending_request_count = client->pending_requests.count;
+	state->queued_request_count = queued_requests.count;
+
+	memcpy((uint8_t *)state + sizeof(HandoffClientState), &client->packet,
+	       client->packet_used);
+
+	if (client->pending_requests.count > 0) {
+		memcpy((uint8_t *)state + sizeof(HandoffClientState) + client->packet_used,
+		       array_get(&client->pending_requests, 0),
+		       client->pending_requests.count * sizeof(PendingRequest));
+	}
+
+	if (queued_requests.count > 0) {
+		memcpy((uint8_t *)state + sizeof(HandoffClientState) + client->packet_used +
+		       client->pending_requests.count * sizeof(PendingRequest),
+		       array_get(&queued_requests, 0),
+		       queued_requests.count * sizeof(Packet));
+	}
+
+	rc = handoff_send_record(channel, HANDOFF_RECORD_CLIENT, client->socket,
+	                         state, length);
+
+	free(state);
+	array_destroy(&queued_requests, NULL);
+
+	return rc;
+}
+
+// the new process only inherits the handoff channel and the standard handles
+static pid_t handoff_spawn(const char *executable, char **options,
+                           int option_count, int channel) {
+	char channel_string[16];
+	char *arguments[MAX_OPTIONS + 4];
+	long max_handle;
+	int handle;
+	int i;
+	pid_t pid;
+
+	if (option_count > MAX_OPTIONS) {
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	snprintf(channel_string, sizeof(channel_string), "%d", channel);
+
+	arguments[0] = (char *)executable;
+	arguments[1] = (char *)"--handoff";
+	arguments[2] = channel_string;
+
+	for (i = 0; i < option_count; ++i) {
+		arguments[3 + i] = options[i];
+	}
+
+	arguments[3 + option_count] = NULL;
+
+	pid = fork();
+
+	if (pid != 0) {
+		return pid;
+	}
+
+	// child process, only async-signal-safe functions from here on
+	max_handle = sysconf(_SC_OPEN_MAX);
+
+	if (max_handle < 0 || max_handle > MAX_INHERITED_HANDLE) {
+		max_handle = MAX_INHERITED_HANDLE;
+	}
+
+	for (handle = STDERR_FILENO + 1; handle < max_handle; ++handle) {
+		if (handle != channel) {
+			close(handle);
+		}
+	}
+
+	execv(executable, arguments);
+
+	_exit(EXIT_FAILURE);
+
+	return -1; // unreachable
+}
+
+// on success the sockets are detached, the PID of the new process is returned
+// and the caller has to exit. on error the new process is terminated and this
+// process keeps running as before
+int handoff_send(const char *executable, char **options, int option_count) {
+	int phase = 0;
+	int channel[2] = { -1, -1 };
+	pid_t pid = -1;
+	HandoffHello hello;
+	Array *server_sockets = network_get_server_sockets();
+	Array *clients = network_get_clients();
+	struct pollfd pollfd;
+	uint8_t acknowledge;
+	int rc;
+	int i;
+
+	log_info("Handing off %d server socket(s) and %d client(s) to '%s'",
+	         server_sockets->count, clients->count, executable);
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) < 0) {
+		log_error("Could not create handoff socket pair: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	// the new process only gets the other end of the socket pair
+	fcntl(channel[0], F_SETFD, FD_CLOEXEC);
+
+	phase = 1;
+
+	pid = handoff_spawn(executable, options, option_count, channel[1]);
+
+	if (pid < 0) {
+		log_error("Could not start new brickd process: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	close(channel[1]);
+	channel[1] = -1;
+
+	phase = 2;
+
+	hello.magic = HANDOFF_MAGIC;
+	hello.version = HANDOFF_VERSION;
+	hello.packet_size = sizeof(Packet);
+	hello.pending_request_size = sizeof(PendingRequest);
+
+	if (handoff_send_record(channel[0], HANDOFF_RECORD_HELLO,
+	                        INVALID_EVENT_HANDLE, &hello, sizeof(hello)) < 0) {
+		log_error("Could not send handoff hello: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	for (i = 0; i < server_sockets->count; ++i) {
+		if (handoff_send_record(channel[0], HANDOFF_RECORD_SERVER_SOCKET,
+		                        *(EventHandle *)array_get(server_sockets, i),
+		                        NULL, 0) < 0) {
+			log_error("Could not hand off server socket: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+	}
+
+	for (i = 0; i < clients->count; ++i) {
+		if (handoff_send_client(channel[0], array_get(clients, i)) < 0) {
+			log_error("Could not hand off client: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+	}
+
+	if (handoff_send_record(channel[0], HANDOFF_RECORD_END,
+	                        INVALID_EVENT_HANDLE, NULL, 0) < 0) {
+		log_error("Could not send handoff end: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	// wait for the new process to take over
+	pollfd.fd = channel[0];
+	pollfd.events = POLLIN;
+
+	do {
+		rc = poll(&pollfd, 1, ACKNOWLEDGE_TIMEOUT);
+	} while (rc < 0 && errno_interrupted());
+
+	if (rc <= 0) {
+		log_error("New brickd process did not acknowledge the handoff");
+
+		goto cleanup;
+	}
+
+	rc = handoff_read(channel[0], &acknowledge, 1);
+
+	if (rc <= 0) {
+		log_error("New brickd process exited before acknowledging the handoff");
+
+		goto cleanup;
+	}
+
+	// the new process sends the queued requests now
+	for (i = 0; i < clients->count; ++i) {
+		usb_remove_queued_requests(array_get(clients, i));
+	}
+
+	// stop serving the sockets, the new process does that now. the channel
+	// is not closed, so the new process sees end-of-file once this process
+	// has released the USB devices and the PID file on exit
+	network_detach();
+
+	log_info("Handed off to new brickd process (pid: %d)", (int)pid);
+
+	phase = 3;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 2:
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+
+	case 1:
+		close(channel[0]);
+
+		if (channel[1] >= 0) {
+			close(channel[1]);
+		}
+
+	default:
+		break;
+	}
+
+	return phase == 3 ? (int)pid : -1;
+}
+
+static int handoff_receive_client(int channel, HandoffRecord *record,
+                                  EventHandle socket) {
+	HandoffClient *client;
+	PendingRequest *pending_request;
+	Packet *queued_request;
+	uint32_t i;
+	int rc;
+
+	if (record->length < sizeof(HandoffClientState)) {
+		log_error("Handoff client record is too short");
+
+		close(socket);
+
+		return -1;
+	}
+
+	client = array_append(&_clients);
+
+	if (client == NULL) {
+		log_error("Could not append to handoff client array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		close(socket);
+
+		return -1;
+	}
+
+	client->socket = socket;
+
+	if (array_create(&client->pending_requests, 32, sizeof(PendingRequest), 1) < 0) {
+		log_error("Could not create pending request array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		close(socket);
+		array_remove(&_clients, _clients.count - 1, NULL);
+
+		return -1;
+	}
+
+	if (array_create(&client->queued_requests, 32, sizeof(Packet), 1) < 0) {
+		log_error("Could not create queued request array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		close(socket);
+		array_destroy(&client->pending_requests, NULL);
+		array_remove(&_clients, _clients.count - 1, NULL);
+
+		return -1;
+	}
+
+	rc = handoff_read(channel, &client->state, sizeof(client->state));
+
+	if (rc <= 0) {
+		goto read_error;
+	}
+
+	if (client->state.address_length > sizeof(client->state.address) ||
+	    client->state.packet_used > sizeof(Packet) ||
+	    record->length != sizeof(HandoffClientState) + client->state.packet_used +
+	                      client->state.pending_request_count * sizeof(PendingRequest) +
+	                      client->state.queued_request_count * sizeof(Packet)) {
+		log_error("Handoff client record is malformed");
+
+		return -1;
+	}
+
+	rc = handoff_read(channel, &client->packet, client->state.packet_used);
+
+	if (rc <= 0) {
+		goto read_error;
+	}
+
+	for (i = 0; i < client->state.pending_request_count; ++i) {
+		pending_request = array_append(&client->pending_requests);
+
+		if (pending_request == NULL) {
+			log_error("Could not append to pending request array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		rc = handoff_read(channel, pending_request, sizeof(PendingRequest));
+
+		if (rc <= 0) {
+			goto read_error;
+		}
+	}
+
+	for (i = 0; i < client->state.queued_request_count; ++i) {
+		queued_request = array_append(&client->queued_requests);
+
+		if (queued_request == NULL) {
+			log_error("Could not append to queued request array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		rc = handoff_read(channel, queued_request, sizeof(Packet));
+
+		if (rc <= 0) {
+			goto read_error;
+		}
+
+		if (queued_request->header.length < sizeof(PacketHeader) ||
+		    queued_request->header.length > sizeof(Packet)) {
+			log_error("Handoff client record contains a malformed queued request");
+
+			return -1;
+		}
+	}
+
+	return 0;
+
+read_error:
+	if (rc < 0) {
+		log_error("Could not read handoff client record: %s (%d)",
+		          get_errno_name(errno), errno);
+	} else {
+		log_error("Previous brickd process closed the handoff channel unexpectedly");
+	}
+
+	return -1;
+}
+
+// called by the new process before it initializes any subsystem. returns
+// after the previous process has exited
+int handoff_receive(int channel) {
+	HandoffRecord record;
+	HandoffHello hello;
+	EventHandle handle;
+	EventHandle *server_socket;
+	struct pollfd pollfd;
+	uint8_t acknowledge = 1;
+	uint8_t byte;
+	int hello_received = 0;
+	int rc;
+
+	log_info("Receiving handoff from previous brickd process");
+
+	fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+	if (array_create(&_server_sockets, 4, sizeof(EventHandle), 1) < 0) {
+		log_error("Could not create handoff server socket array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		close(channel);
+
+		return -1;
+	}
+
+	if (array_create(&_clients, 32, sizeof(HandoffClient), 1) < 0) {
+		log_error("Could not create handoff client array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		array_destroy(&_server_sockets, NULL);
+		close(channel);
+
+		return -1;
+	}
+
+	_received = 1;
+
+	for (;;) {
+		rc = handoff_receive_record(channel, &record, &handle);
+
+		if (rc < 0) {
+			log_error("Could not receive handoff record: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto error;
+		}
+
+		if (rc == 0) {
+			log_error("Previous brickd process closed the handoff channel unexpectedly");
+
+			goto error;
+		}
+
+		if (!hello_received && record.type != HANDOFF_RECORD_HELLO) {
+			log_error("Handoff did not start with a hello record");
+
+			goto error_handle;
+		}
+
+		switch (record.type) {
+		case HANDOFF_RECORD_HELLO:
+			if (record.length != sizeof(hello) ||
+			    handoff_read(channel, &hello, sizeof(hello)) <= 0) {
+				log_error("Could not read handoff hello");
+
+				goto error_handle;
+			}
+
+			if (hello.magic != HANDOFF_MAGIC || hello.version != HANDOFF_VERSION ||
+			    hello.packet_size != sizeof(Packet) ||
+			    hello.pending_request_size != sizeof(PendingRequest)) {
+				log_error("Handoff from an incompatible brickd version (version: %u)",
+				          hello.version);
+
+				goto error_handle;
+			}
+
+			hello_received = 1;
+
+			break;
+
+		case HANDOFF_RECORD_SERVER_SOCKET:
+			if (handle == INVALID_EVENT_HANDLE || record.length != 0) {
+				log_error("Handoff server socket record is malformed");
+
+				goto error_handle;
+			}
+
+			server_socket = array_append(&_server_sockets);
+
+			if (server_socket == NULL) {
+				log_error("Could not append to handoff server socket array: %s (%d)",
+				          get_errno_name(errno), errno);
+
+				goto error_handle;
+			}
+
+			*server_socket = handle;
+
+			break;
+
+		case HANDOFF_RECORD_CLIENT:
+			if (handle == INVALID_EVENT_HANDLE) {
+				log_error("Handoff client record has no socket attached");
+
+				goto error;
+			}
+
+			// the socket is owned by the client array or closed on error
+			if (handoff_receive_client(channel, &record, handle) < 0) {
+				goto error;
+			}
+
+			break;
+
+		case HANDOFF_RECORD_END:
+			if (handle != INVALID_EVENT_HANDLE) {
+				close(handle);
+			}
+
+			goto end;
+
+		default:
+			log_error("Unknown handoff record type %u", record.type);
+
+			goto error_handle;
+		}
+	}
+
+end:
+	if (handoff_write(channel, &acknowledge, 1) < 0) {
+		log_error("Could not acknowledge handoff: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto error;
+	}
+
+	log_info("Received %d server socket(s) and %d client(s), waiting for previous brickd process to exit",
+	         _server_sockets.count, _clients.count);
+
+	// the previous process keeps its end of the channel open until it exits
+	pollfd.fd = channel;
+	pollfd.events = POLLIN;
+
+	for (;;) {
+		rc = poll(&pollfd, 1, EXIT_TIMEOUT);
+
+		if (rc < 0 && errno_interrupted()) {
+			continue;
+		}
+
+		if (rc <= 0) {
+			log_warn("Previous brickd process did not exit in time, continuing anyway");
+
+			break;
+		}
+
+		rc = read(channel, &byte, 1);
+
+		if (rc < 0 && errno_interrupted()) {
+			continue;
+		}
+
+		if (rc <= 0) {
+			break;
+		}
+	}
+
+	close(channel);
+
+	return 0;
+
+error_handle:
+	if (handle != INVALID_EVENT_HANDLE) {
+		close(handle);
+	}
+
+error:
+	close(channel);
+	handoff_exit();
+
+	return -1;
+}
+
+// returns NULL if no handoff was received
+Array *handoff_get_server_sockets(void) {
+	return _received ? &_server_sockets : NULL;
+}
+
+// called by the new process after the network subsystem is initialized
+void handoff_adopt_clients(void) {
+	HandoffClient *handoff_client;
+	Client *client;
+	PendingRequest *pending_request;
+	int i;
+	int k;
+
+	for (i = 0; i < _clients.count; ++i) {
+		handoff_client = array_get(&_clients, i);
+		client = network_add_client(handoff_client->socket,
+		                            (struct sockaddr *)&handoff_client->state.address,
+		                            handoff_client->state.address_length);
+
+		if (client == NULL) {
+			continue;
+		}
+
+		handoff_client->socket = INVALID_EVENT_HANDLE;
+
+		memcpy(&client->packet, &handoff_client->packet,
+		       handoff_client->state.packet_used);
+
+		client->packet_used = handoff_client->state.packet_used;
+
+		for (k = 0; k < handoff_client->pending_requests.count; ++k) {
+			pending_request = array_append(&client->pending_requests);
+
+			if (pending_request == NULL) {
+				log_error("Could not append to pending request array: %s (%d)",
+				          get_errno_name(errno), errno);
+
+				break;
+			}
+
+			memcpy(pending_request, array_get(&handoff_client->pending_requests, k),
+			       sizeof(PendingRequest));
+		}
+
+		// queue them again before new requests are read from the client
+		for (k = 0; k < handoff_client->queued_requests.count; ++k) {
+			usb_dispatch_packet(array_get(&handoff_client->queued_requests, k), client);
+		}
+
+		log_info("Took over client (socket: %d, peer: %s, pending requests: %d, queued requests: %d)",
+		         client->socket, client_get_peer_name(client),
+		         client->pending_requests.count,
+		         handoff_client->queued_requests.count);
+	}
+
+	array_resize(&_clients, 0, (FreeFunction)handoff_destroy_client);
+}
+
+// closes all handed off sockets that were not taken over
+void handoff_exit(void) {
+	if (!_received) {
+		return;
+	}
+
+	array_destroy(&_clients, (FreeFunction)handoff_destroy_client);
+	array_destroy(&_server_sockets, (FreeFunction)handoff_close_server_socket);
+
+	_received = 0;
+}
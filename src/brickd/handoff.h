@@ -0,0 +1,35 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * handoff.h: Handoff of sockets to a new brickd process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_HANDOFF_H
+#define BRICKD_HANDOFF_H
+
+#include "utils.h"
+
+int handoff_send(const char *executable, char **options, int option_count);
+
+int handoff_receive(int channel);
+Array *handoff_get_server_sockets(void);
+void handoff_adopt_clients(void);
+
+void handoff_exit(void);
+
+#endif // BRICKD_HANDOFF_H
@@ -0,0 +1,330 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * inflight.c: In-flight request tracking and coalescing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * requests that are forwarded to a Brick are remembered until their response
+ * arrives, because the response only carries UID, function ID and sequence
+ * number, but not the request payload. this is needed by the response cache
+ * and for request coalescing: if a request for a coalescing function ID is
+ * identical (UID, function ID and payload) to a request that is still in
+ * flight, then it is not forwarded again. instead its client is added as a
+ * waiter to the in-flight request and gets a copy of the response with its
+ * own sequence number. the pending request of the waiter is kept as usual,
+ * so client_dispatch_packet can match the copied response.
+ *
+ * sequence numbers are only 4 bits and are chosen by each client on its own,
+ * so requests with different payloads from different clients can share the
+ * same UID, function ID and sequence number. their responses cannot be told
+ * apart, and because the write queue reorders requests of different clients
+ * the first response is not necessarily the one for the tracked request. in
+ * that case the tracked request is marked as ambiguous and the second request
+ * is only counted, it is kept until all responses for its key arrived. the
+ * responses of an ambiguous request are neither cached nor copied to waiters,
+ * the waiters run into a timeout instead of getting the response for another
+ * payload.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "inflight.h"
+
+#include "cache.h"
+#include "config.h"
+#include "log.h"
+#include "metrics.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_NETWORK
+
+// a request is forgotten if its response didn't arrive within this time
+#define MAX_REQUEST_AGE 2500000 // microseconds
+
+#define MAX_INFLIGHT_REQUESTS 256
+
+static Array _requests = ARRAY_INITIALIZER;
+
+static int inflight_is_tracked(uint8_t function_id) {
+	return config_get_response_cache_ttl(function_id) > 0 ||
+	       config_get_request_coalescing(function_id);
+}
+
+static void inflight_destroy_request(InflightRequest *inflight_request) {
+	array_destroy(&inflight_request->waiters, NULL);
+}
+
+static int inflight_matches_request(InflightRequest *inflight_request,
+                                    Packet *request) {
+	return inflight_request->request.header.uid == request->header.uid &&
+	       inflight_request->request.header.function_id == request->header.function_id &&
+	       inflight_request->request.header.length == request->header.length &&
+	       memcmp(inflight_request->request.payload, request->payload,
+	              request->header.length - sizeof(PacketHeader)) == 0;
+}
+
+// the response to a request only carries these three fields
+static int inflight_matches_key(InflightRequest *inflight_request,
+                                PacketHeader *header) {
+	return inflight_request->request.header.uid == header->uid &&
+	       inflight_request->request.header.function_id == header->function_id &&
+	       inflight_request->request.header.sequence_number == header->sequence_number;
+}
+
+// forget requests whose response didn't arrive in time, their waiters will
+// run into a timeout the same way as the client that sent the request
+static void inflight_expire_requests(uint64_t now) {
+	int i;
+	InflightRequest *inflight_request;
+
+	for (i = 0; i < _requests.count; ++i) {
+		inflight_request = array_get(&_requests, i);
+
+		if (inflight_request->timestamp + MAX_REQUEST_AGE < now) {
+			array_remove(&_requests, i--,
+			             (FreeFunction)inflight_destroy_request);
+		}
+	}
+}
+
+int inflight_init(void) {
+	log_debug("Initializing in-flight request tracking");
+
+	if (array_create(&_requests, 32, sizeof(InflightRequest), 1) < 0) {
+		log_error("Could not create in-flight request array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void inflight_exit(void) {
+	log_debug("Shutting down in-flight request tracking");
+
+	array_destroy(&_requests, (FreeFunction)inflight_destroy_request);
+}
+
+// returns 1 if the request was coalesced with an identical in-flight request
+// and must not be forwarded to the Brick, returns 0 otherwise
+int inflight_add_request(Client *client, Packet *request) {
+	int i;
+	InflightRequest *inflight_request;
+	InflightWaiter *waiter;
+	uint64_t now;
+
+	if (request->header.uid == 0 || !request->header.response_expected ||
+	    !inflight_is_tracked(request->header.function_id)) {
+		return 0;
+	}
+
+	now = microseconds();
+
+	inflight_expire_requests(now);
+
+	if (config_get_request_coalescing(request->header.function_id)) {
+		for (i = 0; i < _requests.count; ++i) {
+			inflight_request = array_get(&_requests, i);
+
+			if (inflight_request->ambiguous ||
+			    !inflight_matches_request(inflight_request, request)) {
+				continue;
+			}
+
+			waiter = array_append(&inflight_request->waiters);
+
+			if (waiter == NULL) {
+				log_error("Could not append to in-flight waiter array: %s (%d)",
+				          get_errno_name(errno), errno);
+
+				return 0;
+			}
+
+			waiter->client = client;
+			waiter->sequence_number = request->header.sequence_number;
+
+			metrics_increment(METRIC_COALESCED_REQUESTS);
+
+			log_debug("Coalesced request (U: %u, L: %u, F: %u, S: %u) from client (socket: %d, peer: %s) with in-flight request (S: %u)",
+			          request->header.uid, request->header.length,
+			          request->header.function_id,
+			          request->header.sequence_number,
+			          client->socket, client_get_peer_name(client),
+			          inflight_request->request.header.sequence_number);
+
+			return 1;
+		}
+	}
+
+	for (i = 0; i < _requests.count; ++i) {
+		inflight_request = array_get(&_requests, i);
+
+		if (!inflight_matches_key(inflight_request, &request->header)) {
+			continue;
+		}
+
+		++inflight_request->responses;
+
+		inflight_request->timestamp = now;
+
+		// with the same payload either response is the right one
+		if (!inflight_matches_request(inflight_request, request) &&
+		    !inflight_request->ambiguous) {
+			inflight_request->ambiguous = 1;
+
+			log_debug("Request (U: %u, L: %u, F: %u, S: %u) from client (socket: %d, peer: %s) collides with an in-flight request with a different payload, not caching or coalescing its response",
+			          request->header.uid, request->header.length,
+			          request->header.function_id,
+			          request->header.sequence_number,
+			          client->socket, client_get_peer_name(client));
+		}
+
+		return 0;
+	}
+
+	if (_requests.count >= MAX_INFLIGHT_REQUESTS) {
+		array_remove(&_requests, 0, (FreeFunction)inflight_destroy_request);
+	}
+
+	inflight_request = array_append(&_requests);
+
+	if (inflight_request == NULL) {
+		log_error("Could not append to in-flight request array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return 0;
+	}
+
+	if (array_create(&inflight_request->waiters, 8,
+	                 sizeof(InflightWaiter), 1) < 0) {
+		log_error("Could not create in-flight waiter array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		array_remove(&_requests, _requests.count - 1, NULL);
+
+		return 0;
+	}
+
+	memcpy(&inflight_request->request, request, request->header.length);
+
+	inflight_request->timestamp = now;
+	inflight_request->responses = 1;
+	inflight_request->ambiguous = 0;
+
+	return 0;
+}
+
+// passes the response to the response cache and sends a copy of it to every
+// waiter of the matching in-flight request. returns the number of waiters the
+// response was dispatched to
+int inflight_handle_response(Packet *response) {
+	int i;
+	InflightRequest *inflight_request = NULL;
+	int request_index;
+	InflightWaiter *waiter;
+	Packet copy;
+	int dispatched = 0;
+
+	if (response->header.sequence_number == 0 || _requests.count == 0) {
+		return 0;
+	}
+
+	inflight_expire_requests(microseconds());
+
+	for (i = 0; i < _requests.count; ++i) {
+		inflight_request = array_get(&_requests, i);
+
+		if (inflight_matches_key(inflight_request, &response->header)) {
+			break;
+		}
+
+		inflight_request = NULL;
+	}
+
+	if (inflight_request == NULL) {
+		return 0;
+	}
+
+	request_index = i;
+
+	if (inflight_request->ambiguous) {
+		log_debug("Response (U: %u, L: %u, F: %u, S: %u, E: %u) is ambiguous, not caching it and not dispatching it to %d coalesced waiter(s)",
+		          response->header.uid, response->header.length,
+		          response->header.function_id,
+		          response->header.sequence_number,
+		          response->header.error_code,
+		          inflight_request->waiters.count);
+	} else {
+		cache_add_response(&inflight_request->request, response);
+
+		if (inflight_request->waiters.count > 0) {
+			log_debug("Dispatching response (U: %u, L: %u, F: %u, S: %u, E: %u) to %d coalesced waiter(s)",
+			          response->header.uid, response->header.length,
+			          response->header.function_id,
+			          response->header.sequence_number,
+			          response->header.error_code,
+			          inflight_request->waiters.count);
+
+			memcpy(&copy, response, response->header.length);
+
+			for (i = 0; i < inflight_request->waiters.count; ++i) {
+				waiter = array_get(&inflight_request->waiters, i);
+
+				copy.header.sequence_number = waiter->sequence_number;
+
+				if (client_dispatch_packet(waiter->client, &copy, 0) > 0) {
+					++dispatched;
+				}
+			}
+
+			array_resize(&inflight_request->waiters, 0, NULL);
+		}
+	}
+
+	// keep the request until the responses for all forwarded requests with
+	// the same key arrived, so that a late one cannot match a newer request
+	if (--inflight_request->responses > 0) {
+		return dispatched;
+	}
+
+	array_remove(&_requests, request_index,
+	             (FreeFunction)inflight_destroy_request);
+
+	return dispatched;
+}
+
+void inflight_remove_client(Client *client) {
+	int i;
+	int k;
+	InflightRequest *inflight_request;
+	InflightWaiter *waiter;
+
+	for (i = 0; i < _requests.count; ++i) {
+		inflight_request = array_get(&_requests, i);
+
+		for (k = 0; k < inflight_request->waiters.count; ++k) {
+			waiter = array_get(&inflight_request->waiters, k);
+
+			if (waiter->client == client) {
+				array_remove(&inflight_request->waiters, k--, NULL);
+			}
+		}
+	}
+}
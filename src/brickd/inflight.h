@@ -0,0 +1,50 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * inflight.h: In-flight request tracking and coalescing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_INFLIGHT_H
+#define BRICKD_INFLIGHT_H
+
+#include "client.h"
+#include "packet.h"
+#include "utils.h"
+
+typedef struct {
+	Client *client;
+	uint8_t sequence_number;
+} InflightWaiter;
+
+typedef struct {
+	Packet request;
+	uint64_t timestamp;
+	Array waiters;
+	int responses; // number of forwarded requests with the same UID, function ID and sequence number
+	int ambiguous; // set if one of them has a different payload
+} InflightRequest;
+
+int inflight_init(void);
+void inflight_exit(void);
+
+int inflight_add_request(Client *client, Packet *request);
+int inflight_handle_response(Packet *response);
+
+void inflight_remove_client(Client *client);
+
+#endif // BRICKD_INFLIGHT_H
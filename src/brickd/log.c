@@ -19,6 +19,32 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+/*
+ * once the writer thread is started, log_message formats the message into a
+ * record of a lock-free ring and returns. the ring is a bounded multi-producer
+ * single-consumer queue, a producer claims a record by advancing the enqueue
+ * position with a compare-and-swap and publishes it by setting the sequence
+ * number of the record. the writer thread formats the prefix of each record,
+ * the wall-clock part of the prefix is only formatted once per second, and
+ * writes all pending records in one go. the writer thread is only woken up
+ * by a producer if it is waiting for new records, so the common case costs
+ * no syscall and no mutex. if the ring is full, the producer wakes up the
+ * writer and yields until a record is free again. messages are never dropped,
+ * because they are most needed when a lot of them are logged.
+ *
+ * before the writer thread is started, for example before the daemon forked,
+ * and after it is stopped, log_message writes synchronously.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <sched.h>
+#endif
 #ifndef _MSC_VER
 	#include <sys/time.h>
 #endif
@@ -27,6 +53,23 @@
 
 #include "threads.h"
 
+#define LOG_CATEGORY LOG_CATEGORY_OTHER
+
+#define RING_SIZE 512 // must be a power of two
+#define MAX_MESSAGE_LENGTH 512
+#define MAX_PREFIX_LENGTH 192
+#define WRITER_BUFFER_SIZE 65536
+
+typedef struct {
+	volatile uint32_t sequence;
+	LogLevel level;
+	const char *file;
+	int line;
+	time_t seconds;
+	int microseconds;
+	char message[MAX_MESSAGE_LENGTH];
+} LogRecord;
+
 static Mutex _mutex; // protects writing to _file
 static LogLevel _levels[5] = { LOG_LEVEL_INFO,
                                LOG_LEVEL_INFO,
@@ -35,12 +78,105 @@ static LogLevel _levels[5] = { LOG_LEVEL_INFO,
                                LOG_LEVEL_INFO };
 static FILE *_file = NULL;
 
+static LogRecord _ring[RING_SIZE];
+static volatile uint32_t _enqueue_position = 0;
+static uint32_t _dequeue_position = 0; // only used by the writer thread
+static volatile uint32_t _writer_sleeping = 0;
+static volatile int _writer_running = 0;
+static Semaphore _writer_wakeup;
+static Thread _writer_thread;
+static char _writer_buffer[WRITER_BUFFER_SIZE]; // only used by the writer thread
+static time_t _cached_seconds = 0; // only used by the writer thread
+static char _cached_time[64] = "<unknown>"; // only used by the writer thread
+
 extern void log_init_platform(void);
 extern void log_exit_platform(void);
 extern void log_handler_platform(LogLevel level, const char *file, int line,
                                  const char *function, const char *format,
                                  va_list arguments);
 
+static int log_compare_and_swap(volatile uint32_t *value, uint32_t expected,
+                                uint32_t desired) {
+#ifdef _WIN32
+	return (uint32_t)InterlockedCompareExchange((volatile LONG *)value,
+	                                            (LONG)desired,
+	                                            (LONG)expected) == expected;
+#else
+	return __sync_bool_compare_and_swap(value, expected, desired);
+#endif
+}
+
+static void log_memory_barrier(void) {
+#ifdef _WIN32
+	MemoryBarrier();
+#else
+	__sync_synchronize();
+#endif
+}
+
+static void log_yield(void) {
+#ifdef _WIN32
+	SwitchToThread();
+#else
+	sched_yield();
+#endif
+}
+
+static void log_wake_writer(void) {
+	if (_writer_sleeping && log_compare_and_swap(&_writer_sleeping, 1, 0)) {
+		semaphore_release(&_writer_wakeup);
+	}
+}
+
+static int log_format(char *buffer, int size, const char *format, ...) ATTRIBUTE_FMT_PRINTF(3, 4);
+
+// returns the length of the formatted string, it is truncated if necessary
+static int log_vformat(char *buffer, int size, const char *format,
+                       va_list arguments) {
+#ifdef _MSC_VER
+	_vsnprintf_s(buffer, size, size - 1, format, arguments);
+#else
+	vsnprintf(buffer, size, format, arguments);
+#endif
+
+	buffer[size - 1] = '\0';
+
+	return strlen(buffer);
+}
+
+static int log_format(char *buffer, int size, const char *format, ...) {
+	va_list arguments;
+	int length;
+
+	va_start(arguments, format);
+
+	length = log_vformat(buffer, size, format, arguments);
+
+	va_end(arguments);
+
+	return length;
+}
+
+static char log_get_level_char(LogLevel level) {
+	switch (level) {
+	case LOG_LEVEL_NONE:  return 'N';
+	case LOG_LEVEL_ERROR: return 'E';
+	case LOG_LEVEL_WARN:  return 'W';
+	case LOG_LEVEL_INFO:  return 'I';
+	case LOG_LEVEL_DEBUG: return 'D';
+	default:              return 'U';
+	}
+}
+
+static void log_format_time(time_t seconds, char *buffer, int size) {
+	struct tm lt;
+
+	if (localtime_r(&seconds, &lt) == NULL ||
+	    strftime(buffer, size, "%Y-%m-%d %H:%M:%S", &lt) == 0) {
+		log_format(buffer, size, "<unknown>");
+	}
+}
+
 // NOTE: assumes that _mutex is locked
 static void log_handler(LogLevel level, const char *file, int line,
                         const char *function, const char *format,
@@ -48,9 +184,7 @@ static void log_handler(LogLevel level, const char *file, int line,
 {
 	struct timeval tv;
 	time_t t;
-	struct tm lt;
 	char lt_str[64] = "<unknown>";
-	char level_c = 'U';
 
 	(void)function;
 
@@ -71,23 +205,12 @@ static void log_handler(LogLevel level, const char *file, int line,
 		// is still 4 byte in size.
 		t = tv.tv_sec;
 
-		if (localtime_r(&t, &lt) != NULL) {
-			strftime(lt_str, sizeof(lt_str), "%Y-%m-%d %H:%M:%S", &lt);
-		}
-	}
-
-	// format level
-	switch (level) {
-	case LOG_LEVEL_NONE:  level_c = 'N'; break;
-	case LOG_LEVEL_ERROR: level_c = 'E'; break;
-	case LOG_LEVEL_WARN:  level_c = 'W'; break;
-	case LOG_LEVEL_INFO:  level_c = 'I'; break;
-	case LOG_LEVEL_DEBUG: level_c = 'D'; break;
+		log_format_time(t, lt_str, sizeof(lt_str));
 	}
 
 	// print prefix
 	fprintf(_file, "%s.%06d <%c> <%s:%d> ",
-	        lt_str, (int)tv.tv_usec, level_c, file, line);
+	        lt_str, (int)tv.tv_usec, log_get_level_char(level), file, line);
 
 	// print message
 	vfprintf(_file, format, arguments);
@@ -95,6 +218,144 @@ static void log_handler(LogLevel level, const char *file, int line,
 	fflush(_file);
 }
 
+static void log_enqueue(LogLevel level, const char *file, int line,
+                        const char *format, va_list arguments) {
+	uint32_t position = _enqueue_position;
+	LogRecord *record;
+	int32_t difference;
+	struct timeval tv;
+
+	// claim a record
+	for (;;) {
+		record = &_ring[position & (RING_SIZE - 1)];
+		difference = (int32_t)(record->sequence - position);
+
+		if (difference == 0) {
+			if (log_compare_and_swap(&_enqueue_position, position, position + 1)) {
+				break;
+			}
+		} else if (difference < 0) {
+			// the ring is full, let the writer catch up
+			log_wake_writer();
+			log_yield();
+		}
+
+		position = _enqueue_position;
+	}
+
+	// fill the record
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+
+	gettimeofday(&tv, NULL);
+
+	record->level = level;
+	record->file = file;
+	record->line = line;
+	record->seconds = tv.tv_sec; // see log_handler for why this is copied
+	record->microseconds = (int)tv.tv_usec;
+
+	log_vformat(record->message, sizeof(record->message), format, arguments);
+
+	// publish the record. the barrier after the publication pairs with the
+	// barrier in the writer thread after it set _writer_sleeping, so that
+	// either the writer sees the record or the producer sees the flag
+	log_memory_barrier();
+
+	record->sequence = position + 1;
+
+	log_memory_barrier();
+
+	log_wake_writer();
+}
+
+static int log_ring_is_empty(void) {
+	return _ring[_dequeue_position & (RING_SIZE - 1)].sequence != _dequeue_position + 1;
+}
+
+// the wall-clock part of the prefix only changes once per second
+static int log_format_prefix(char *buffer, time_t seconds, int microseconds,
+                             LogLevel level, const char *file, int line) {
+	if (seconds != _cached_seconds) {
+		log_format_time(seconds, _cached_time, sizeof(_cached_time));
+
+		_cached_seconds = seconds;
+	}
+
+	return log_format(buffer, MAX_PREFIX_LENGTH, "%s.%06d <%c> <%s:%d> ",
+	                  _cached_time, microseconds, log_get_level_char(level),
+	                  file, line);
+}
+
+// formats pending records into the writer buffer and returns its used length
+static int log_dequeue(void) {
+	LogRecord *record;
+	int used = 0;
+
+	while (used + MAX_PREFIX_LENGTH + MAX_MESSAGE_LENGTH + 1 <= WRITER_BUFFER_SIZE &&
+	       !log_ring_is_empty()) {
+		record = &_ring[_dequeue_position & (RING_SIZE - 1)];
+
+		log_memory_barrier();
+
+		used += log_format_prefix(_writer_buffer + used, record->seconds,
+		                          record->microseconds, record->level,
+		                          record->file, record->line);
+		used += log_format(_writer_buffer + used, MAX_MESSAGE_LENGTH + 1,
+		                   "%s\n", record->message);
+
+		// release the record to the producers
+		log_memory_barrier();
+
+		record->sequence = _dequeue_position + RING_SIZE;
+
+		++_dequeue_position;
+	}
+
+	return used;
+}
+
+static void log_writer(void *opaque) {
+	int length;
+
+	(void)opaque;
+
+	for (;;) {
+		length = log_dequeue();
+
+		if (length > 0) {
+			mutex_lock(&_mutex);
+
+			if (_file != NULL) {
+				fwrite(_writer_buffer, 1, length, _file);
+				fflush(_file);
+			}
+
+			mutex_unlock(&_mutex);
+
+			continue;
+		}
+
+		if (!_writer_running) {
+			break;
+		}
+
+		// announce that the writer waits, then check the ring again to
+		// not miss a record that was published in the meantime
+		_writer_sleeping = 1;
+
+		log_memory_barrier();
+
+		if (log_ring_is_empty() && _writer_running) {
+			semaphore_acquire(&_writer_wakeup);
+		} else if (!log_compare_and_swap(&_writer_sleeping, 1, 0)) {
+			// a producer already cleared the flag and releases the
+			// semaphore, consume that release
+			semaphore_acquire(&_writer_wakeup);
+		}
+	}
+}
+
 void log_init(void) {
 	mutex_create(&_mutex);
 
@@ -104,11 +365,60 @@ void log_init(void) {
 }
 
 void log_exit(void) {
+	log_stop_writer();
+
 	log_exit_platform();
 
 	mutex_destroy(&_mutex);
 }
 
+// starts the writer thread. this has to be done after the daemon forked,
+// because threads don't survive a fork
+void log_start_writer(void) {
+	uint32_t i;
+
+	if (_writer_running) {
+		return;
+	}
+
+	for (i = 0; i < RING_SIZE; ++i) {
+		_ring[i].sequence = i;
+	}
+
+	_enqueue_position = 0;
+	_dequeue_position = 0;
+	_writer_sleeping = 0;
+
+	if (semaphore_create(&_writer_wakeup) < 0) {
+		log_warn("Could not create log writer semaphore, logging synchronously: %s (%d)",
+		         get_errno_name(errno), errno);
+
+		return;
+	}
+
+	_writer_running = 1;
+
+	thread_create(&_writer_thread, log_writer, NULL);
+}
+
+// stops the writer thread after it wrote all pending messages
+void log_stop_writer(void) {
+	if (!_writer_running) {
+		return;
+	}
+
+	_writer_running = 0;
+
+	log_memory_barrier();
+
+	log_wake_writer();
+
+	thread_join(&_writer_thread);
+	thread_destroy(&_writer_thread);
+
+	semaphore_destroy(&_writer_wakeup);
+}
+
 void log_set_level(LogCategory category, LogLevel level) {
 	_levels[category] = level;
 }
@@ -117,6 +427,10 @@ LogLevel log_get_level(LogCategory category) {
 	return _levels[category];
 }
 
+int log_is_included(LogCategory category, LogLevel level) {
+	return level <= _levels[category];
+}
+
 void log_set_file(FILE *file) {
 	mutex_lock(&_mutex);
 
@@ -140,11 +454,23 @@ void log_message(LogCategory category, LogLevel level,
 	}
 
 	va_start(arguments, format);
-	mutex_lock(&_mutex);
 
-	log_handler(level, file, line, function, format, arguments);
+	if (_writer_running) {
+		log_enqueue(level, file, line, format, arguments);
+	} else {
+		mutex_lock(&_mutex);
+
+		log_handler(level, file, line, function, format, arguments);
+
+		mutex_unlock(&_mutex);
+	}
+
+	va_end(arguments);
+
+	// the arguments are consumed by now, start over for the platform handler
+	va_start(arguments, format);
+
 	log_handler_platform(level, file, line, function, format, arguments);
 
-	mutex_unlock(&_mutex);
 	va_end(arguments);
 }
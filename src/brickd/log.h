@@ -48,21 +48,20 @@ typedef void (*LogHandler)(LogLevel level, const char *file, int line,
                            va_list arguments);
 
 #ifdef BRICKD_LOG_ENABLED
-	#define log_error(...) \
-		log_message(LOG_CATEGORY, LOG_LEVEL_ERROR, \
-		            __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+	// check the level before evaluating the arguments, so that disabled log
+	// messages don't pay for expensive arguments such as peer name formatting
+	#define log_message_checked(level, ...) \
+		do { \
+			if (log_is_included(LOG_CATEGORY, level)) { \
+				log_message(LOG_CATEGORY, level, \
+				            __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__); \
+			} \
+		} while (0)
 
-	#define log_warn(...) \
-		log_message(LOG_CATEGORY, LOG_LEVEL_WARN, \
-		            __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-
-	#define log_info(...) \
-		log_message(LOG_CATEGORY, LOG_LEVEL_INFO, \
-		            __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
-
-	#define log_debug(...) \
-		log_message(LOG_CATEGORY, LOG_LEVEL_DEBUG, \
-		            __FILE__, __LINE__, __FUNCTION__, __VA_ARGS__)
+	#define log_error(...) log_message_checked(LOG_LEVEL_ERROR, __VA_ARGS__)
+	#define log_warn(...) log_message_checked(LOG_LEVEL_WARN, __VA_ARGS__)
+	#define log_info(...) log_message_checked(LOG_LEVEL_INFO, __VA_ARGS__)
+	#define log_debug(...) log_message_checked(LOG_LEVEL_DEBUG, __VA_ARGS__)
 #else
 	#define log_error(...) ((void)0)
 	#define log_warn(...) ((void)0)
@@ -73,8 +72,12 @@ typedef void (*LogHandler)(LogLevel level, const char *file, int line,
 void log_init(void);
 void log_exit(void);
 
+void log_start_writer(void);
+void log_stop_writer(void);
+
 void log_set_level(LogCategory category, LogLevel level);
 LogLevel log_get_level(LogCategory category);
+int log_is_included(LogCategory category, LogLevel level);
 
 void log_set_file(FILE *file);
 FILE *log_get_file(void);
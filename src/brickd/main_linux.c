@@ -31,9 +31,12 @@
 
 #include "config.h"
 #include "event.h"
+#include "handoff.h"
 #include "log.h"
 #include "network.h"
 #include "pidfile.h"
+#include "replay.h"
+#include "systemd.h"
 #include "udev.h"
 #include "usb.h"
 #include "version.h"
@@ -43,6 +46,10 @@
 static char _config_filename[1024] = "/etc/brickd.conf";
 static char _pid_filename[1024] = "/var/run/brickd.pid";
 static char _log_filename[1024] = "/var/log/brickd.log";
+static char _executable_filename[1024] = ""; // for the handoff, empty if unknown
+static int _daemon = 0;
+static int _debug = 0;
+static int _handed_off = 0;
 
 static int prepare_paths(void) {
 	char *home;
@@ -159,11 +166,25 @@ static int daemon_parent(pid_t child, int status_read) {
 	exit(EXIT_SUCCESS);
 }
 
+static int open_log_file(void) {
+	FILE *log_file = fopen(_log_filename, "a+");
+
+	if (log_file == NULL) {
+		fprintf(stderr, "Could not open log file '%s': %s (%d)\n",
+		        _log_filename, get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	log_set_file(log_file);
+
+	return 0;
+}
+
 static int daemon_start(void) {
 	int status_pipe[2];
 	pid_t pid;
 	int8_t status = 0;
-	FILE *log_file;
 	int pid_fd = -1;
 	int stdin_fd = -1;
 	int stdout_fd = -1;
@@ -230,17 +251,10 @@ static int daemon_start(void) {
 	}
 
 	// open log file
-	log_file = fopen(_log_filename, "a+");
-
-	if (log_file == NULL) {
-		fprintf(stderr, "Could not open log file '%s': %s (%d)\n",
-		        _log_filename, get_errno_name(errno), errno);
-
+	if (open_log_file() < 0) {
 		goto cleanup;
 	}
 
-	log_set_file(log_file);
-
 	// redirect standard file descriptors
 	stdin_fd = open("/dev/null", O_RDONLY);
 
@@ -300,15 +314,94 @@ cleanup:
 	return status == 1 ? pid_fd : -1;
 }
 
+static void set_log_levels(void) {
+	if (_debug) {
+		log_set_level(LOG_CATEGORY_EVENT, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_USB, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_NETWORK, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_HOTPLUG, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_OTHER, LOG_LEVEL_DEBUG);
+	} else {
+		log_set_level(LOG_CATEGORY_EVENT, config_get_log_level(LOG_CATEGORY_EVENT));
+		log_set_level(LOG_CATEGORY_USB, config_get_log_level(LOG_CATEGORY_USB));
+		log_set_level(LOG_CATEGORY_NETWORK, config_get_log_level(LOG_CATEGORY_NETWORK));
+		log_set_level(LOG_CATEGORY_HOTPLUG, config_get_log_level(LOG_CATEGORY_HOTPLUG));
+		log_set_level(LOG_CATEGORY_OTHER, config_get_log_level(LOG_CATEGORY_OTHER));
+	}
+}
+
+// most options are read by the subsystems whenever they are used and take
+// effect immediately, the log levels have to be set again
+static void reload_config(void *opaque) {
+	(void)opaque;
+
+	systemd_notify("RELOADING=1");
+
+	if (config_reload() >= 0) {
+		set_log_levels();
+	}
+
+	systemd_notify("READY=1\nSTATUS=Running");
+}
+
+// the executable is looked up at startup, so that a handoff after an upgrade
+// starts the new executable even if the old one was replaced meanwhile
+static void prepare_executable_filename(void) {
+	ssize_t length = readlink("/proc/self/exe", _executable_filename,
+	                          sizeof(_executable_filename) - 1);
+
+	if (length < 0) {
+		length = 0;
+	}
+
+	_executable_filename[length] = '\0';
+}
+
+static void handoff(void *opaque) {
+	char *options[2];
+	int option_count = 0;
+	int pid;
+
+	(void)opaque;
+
+	if (*_executable_filename == '\0') {
+		log_error("Could not hand off, the brickd executable is unknown");
+
+		return;
+	}
+
+	if (_daemon) {
+		options[option_count++] = (char *)"--daemon";
+	}
+
+	if (_debug) {
+		options[option_count++] = (char *)"--debug";
+	}
+
+	// errors are already logged, keep running if the handoff failed
+	pid = handoff_send(_executable_filename, options, option_count);
+
+	if (pid < 0) {
+		return;
+	}
+
+	// the new process becomes the main process of the systemd service
+	systemd_notify("MAINPID=%d", pid);
+
+	_handed_off = 1;
+
+	event_stop();
+}
+
 int main(int argc, char **argv) {
 	int exit_code = EXIT_FAILURE;
 	int i;
 	int help = 0;
 	int version = 0;
 	int check_config = 0;
-	int daemon = 0;
-	int debug = 0;
+	int handoff_channel = -1;
 	int pid_fd = -1;
+	Array *server_sockets;
 
 	for (i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "--help") == 0) {
@@ -318,9 +411,12 @@ int main(int argc, char **argv) {
 		} else if (strcmp(argv[i], "--check-config") == 0) {
 			check_config = 1;
 		} else if (strcmp(argv[i], "--daemon") == 0) {
-			daemon = 1;
+			_daemon = 1;
 		} else if (strcmp(argv[i], "--debug") == 0) {
-			debug = 1;
+			_debug = 1;
+		} else if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc) {
+			// internal option, given by the brickd process that hands off
+			handoff_channel = atoi(argv[++i]);
 		} else {
 			fprintf(stderr, "Unknown option '%s'\n\n", argv[i]);
 			print_usage();
@@ -342,6 +438,7 @@ int main(int argc, char **argv) {
 	}
 
 	prepare_paths();
+	prepare_executable_filename();
 
 	if (check_config) {
 		return config_check(_config_filename) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -351,35 +448,40 @@ int main(int argc, char **argv) {
 
 	log_init();
 
-	if (daemon) {
+	if (handoff_channel >= 0) {
+		// the process that hands off is already daemonized, if requested.
+		// it releases the PID file before handoff_receive returns
+		if (_daemon && open_log_file() < 0) {
+			goto error_log;
+		}
+
+		if (handoff_receive(handoff_channel) < 0) {
+			goto error_log;
+		}
+
+		pid_fd = pidfile_acquire(_pid_filename, getpid());
+	} else if (_daemon) {
 		pid_fd = daemon_start();
 	} else {
 		pid_fd = pidfile_acquire(_pid_filename, getpid());
 	}
 
 	if (pid_fd < 0) {
-		if (!daemon && pid_fd < -1) {
+		if ((!_daemon || handoff_channel >= 0) && pid_fd < -1) {
 			fprintf(stderr, "Already running according to '%s'\n", _pid_filename);
 		}
 
 		goto error_log;
 	}
 
-	if (debug) {
-		log_set_level(LOG_CATEGORY_EVENT, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_USB, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_NETWORK, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_HOTPLUG, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_OTHER, LOG_LEVEL_DEBUG);
-	} else {
-		log_set_level(LOG_CATEGORY_EVENT, config_get_log_level(LOG_CATEGORY_EVENT));
-		log_set_level(LOG_CATEGORY_USB, config_get_log_level(LOG_CATEGORY_USB));
-		log_set_level(LOG_CATEGORY_NETWORK, config_get_log_level(LOG_CATEGORY_NETWORK));
-		log_set_level(LOG_CATEGORY_HOTPLUG, config_get_log_level(LOG_CATEGORY_HOTPLUG));
-		log_set_level(LOG_CATEGORY_OTHER, config_get_log_level(LOG_CATEGORY_OTHER));
-	}
+	set_log_levels();
+
+	// start the log writer thread after the daemon forked
+	log_start_writer();
 
-	if (daemon) {
+	if (handoff_channel >= 0) {
+		log_info("Brick Daemon %s started (handed off)", VERSION_STRING);
+	} else if (_daemon) {
 		log_info("Brick Daemon %s started (daemonized)", VERSION_STRING);
 	} else {
 		log_info("Brick Daemon %s started", VERSION_STRING);
@@ -394,7 +496,20 @@ int main(int argc, char **argv) {
 		goto error_event;
 	}
 
-	if (usb_init() < 0) {
+	event_set_reload_function(reload_config, NULL);
+	event_set_handoff_function(handoff, NULL);
+
+	if (replay_init() < 0) {
+		goto error_replay;
+	}
+
+	if (systemd_init() < 0) {
+		goto error_systemd;
+	}
+
+	systemd_notify("STATUS=Enumerating USB devices");
+
+	if (usb_init(handoff_channel >= 0) < 0) {
 		goto error_usb;
 	}
 
@@ -404,10 +519,20 @@ int main(int argc, char **argv) {
 	}
 #endif
 
-	if (network_init() < 0) {
+	server_sockets = handoff_get_server_sockets();
+
+	if (server_sockets == NULL) {
+		server_sockets = systemd_get_server_sockets();
+	}
+
+	if (network_init(server_sockets) < 0) {
 		goto error_network;
 	}
 
+	handoff_adopt_clients();
+
+	systemd_notify("READY=1\nSTATUS=Running");
+
 	if (event_run() < 0) {
 		goto error_run;
 	}
@@ -415,6 +540,13 @@ int main(int argc, char **argv) {
 	exit_code = EXIT_SUCCESS;
 
 error_run:
+	// after a handoff the service keeps running in the new process. systemd
+	// accepts notifications from any process of the service, STOPPING=1 from
+	// this one would stop the service and kill the new main process
+	if (!_handed_off) {
+		systemd_notify("STOPPING=1");
+	}
+
 	network_exit();
 
 error_network:
@@ -426,6 +558,12 @@ error_udev:
 	usb_exit();
 
 error_usb:
+	systemd_exit();
+
+error_systemd:
+	replay_exit();
+
+error_replay:
 	event_exit();
 
 error_event:
@@ -438,6 +576,7 @@ error_log:
 		pidfile_release(_pid_filename, pid_fd);
 	}
 
+	handoff_exit();
 	config_exit();
 
 	return exit_code;
@@ -33,6 +33,7 @@
 #include "log.h"
 #include "network.h"
 #include "pidfile.h"
+#include "replay.h"
 #include "iokit.h"
 #include "usb.h"
 #include "version.h"
@@ -43,6 +44,8 @@
 #define PID_FILENAME "/var/run/brickd.pid"
 #define LOG_FILENAME "/var/log/brickd.log"
 
+static int _debug = 0;
+
 static void print_usage(void) {
 	printf("Usage:\n"
 	       "  brickd [--help|--version|--check-config|--daemon] [--debug]\n"
@@ -141,6 +144,34 @@ cleanup:
 	return status == 1 ? pid_fd : -1;
 }
 
+static void set_log_levels(void) {
+	if (_debug) {
+		log_set_level(LOG_CATEGORY_EVENT, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_USB, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_NETWORK, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_HOTPLUG, LOG_LEVEL_DEBUG);
+		log_set_level(LOG_CATEGORY_OTHER, LOG_LEVEL_DEBUG);
+	} else {
+		log_set_level(LOG_CATEGORY_EVENT, config_get_log_level(LOG_CATEGORY_EVENT));
+		log_set_level(LOG_CATEGORY_USB, config_get_log_level(LOG_CATEGORY_USB));
+		log_set_level(LOG_CATEGORY_NETWORK, config_get_log_level(LOG_CATEGORY_NETWORK));
+		log_set_level(LOG_CATEGORY_HOTPLUG, config_get_log_level(LOG_CATEGORY_HOTPLUG));
+		log_set_level(LOG_CATEGORY_OTHER, config_get_log_level(LOG_CATEGORY_OTHER));
+	}
+}
+
+// most options are read by the subsystems whenever they are used and take
+// effect immediately, the log levels have to be set again
+static void reload_config(void *opaque) {
+	(void)opaque;
+
+	if (config_reload() < 0) {
+		return;
+	}
+
+	set_log_levels();
+}
+
 int main(int argc, char **argv) {
 	int exit_code = EXIT_FAILURE;
 	int i;
@@ -148,7 +179,6 @@ int main(int argc, char **argv) {
 	int version = 0;
 	int check_config = 0;
 	int daemon = 0;
-	int debug = 0;
 	int pid_fd = -1;
 
 	for (i = 1; i < argc; ++i) {
@@ -161,7 +191,7 @@ int main(int argc, char **argv) {
 		} else if (strcmp(argv[i], "--daemon") == 0) {
 			daemon = 1;
 		} else if (strcmp(argv[i], "--debug") == 0) {
-			debug = 1;
+			_debug = 1;
 		} else {
 			fprintf(stderr, "Unknown option '%s'\n\n", argv[i]);
 			print_usage();
@@ -204,19 +234,10 @@ int main(int argc, char **argv) {
 		goto error_log;
 	}
 
-	if (debug) {
-		log_set_level(LOG_CATEGORY_EVENT, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_USB, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_NETWORK, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_HOTPLUG, LOG_LEVEL_DEBUG);
-		log_set_level(LOG_CATEGORY_OTHER, LOG_LEVEL_DEBUG);
-	} else {
-		log_set_level(LOG_CATEGORY_EVENT, config_get_log_level(LOG_CATEGORY_EVENT));
-		log_set_level(LOG_CATEGORY_USB, config_get_log_level(LOG_CATEGORY_USB));
-		log_set_level(LOG_CATEGORY_NETWORK, config_get_log_level(LOG_CATEGORY_NETWORK));
-		log_set_level(LOG_CATEGORY_HOTPLUG, config_get_log_level(LOG_CATEGORY_HOTPLUG));
-		log_set_level(LOG_CATEGORY_OTHER, config_get_log_level(LOG_CATEGORY_OTHER));
-	}
+	set_log_levels();
+
+	// start the log writer thread after the daemon forked
+	log_start_writer();
 
 	if (daemon) {
 		log_info("Brick Daemon %s started (daemonized)", VERSION_STRING);
@@ -233,7 +254,13 @@ int main(int argc, char **argv) {
 		goto error_event;
 	}
 
-	if (usb_init() < 0) {
+	event_set_reload_function(reload_config, NULL);
+
+	if (replay_init() < 0) {
+		goto error_replay;
+	}
+
+	if (usb_init(0) < 0) {
 		goto error_usb;
 	}
 
@@ -241,7 +268,7 @@ int main(int argc, char **argv) {
 		goto error_iokit;
 	}
 
-	if (network_init() < 0) {
+	if (network_init(NULL) < 0) {
 		goto error_network;
 	}
 
@@ -261,6 +288,9 @@ error_iokit:
 	usb_exit();
 
 error_usb:
+	replay_exit();
+
+error_replay:
 	event_exit();
 
 error_event:
@@ -31,6 +31,7 @@
 #include "log.h"
 #include "network.h"
 #include "pipe.h"
+#include "replay.h"
 #include "threads.h"
 #include "usb.h"
 #include "utils.h"
@@ -369,6 +370,9 @@ static int generic_main(int log_to_file, int debug) {
 		log_set_level(LOG_CATEGORY_OTHER, config_get_log_level(LOG_CATEGORY_OTHER));
 	}
 
+	// from now on log messages are written by the log writer thread
+	log_start_writer();
+
 	if (_run_as_service) {
 		log_error("Brick Daemon %s started (as service)", VERSION_STRING);
 	} else {
@@ -421,7 +425,11 @@ static int generic_main(int log_to_file, int debug) {
 		goto error_event;
 	}
 
-	if (usb_init() < 0) {
+	if (replay_init() < 0) {
+		goto error_replay;
+	}
+
+	if (usb_init(0) < 0) {
 		goto error_usb;
 	}
 
@@ -468,7 +476,7 @@ static int generic_main(int log_to_file, int debug) {
 		goto error_notification;
 	}
 
-	if (network_init() < 0) {
+	if (network_init(NULL) < 0) {
 		goto error_network;
 	}
 
@@ -503,6 +511,9 @@ error_pipe:
 	usb_exit();
 
 error_usb:
+	replay_exit();
+
+error_replay:
 	event_exit();
 
 error_event:
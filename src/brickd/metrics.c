@@ -0,0 +1,799 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * metrics.c: Counters and Prometheus metrics endpoint
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * all counters are only accessed from the event loop thread, therefore they
+ * are plain integers without locks or atomic operations. the metrics endpoint
+ * is a minimal HTTP server that answers every request with all metrics in the
+ * Prometheus text format and closes the connection afterwards. the response is
+ * rendered into a buffer per connection and sent whenever the socket becomes
+ * writable, so a slow scraper cannot stall the event loop.
+ */
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+#include "brick.h"
+#include "client.h"
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "network.h"
+#include "socket.h"
+#include "usb.h"
+#include "utils.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_NETWORK
+
+#define MAX_CONNECTIONS 8
+#define MAX_REQUEST_LENGTH 2048
+
+typedef struct {
+	const char *name;
+	const char *type;
+	const char *help;
+	int offset; // into ClientMetrics or BrickMetrics, unused for Metric
+} MetricInfo;
+
+typedef struct {
+	char *data;
+	int length;
+	int allocated;
+} MetricsBuffer;
+
+typedef struct {
+	EventHandle socket;
+	char request[MAX_REQUEST_LENGTH + 1];
+	int request_used;
+	MetricsBuffer response;
+	int response_sent;
+} MetricsConnection;
+
+static const MetricInfo _metric_infos[METRIC_COUNT] = {
+	{ "brickd_clients_accepted_total", "counter",
+	  "Client connections accepted", 0 },
+	{ "brickd_clients_rejected_total", "counter",
+	  "Client connections rejected because of the client limit", 0 },
+	{ "brickd_requests_dropped_total", "counter",
+	  "Requests dropped because no Brick is connected", 0 },
+	{ "brickd_requests_broadcast_total", "counter",
+	  "Requests broadcast to all Bricks because their UID is unknown", 0 },
+	{ "brickd_pending_requests_dropped_total", "counter",
+	  "Pending requests dropped because a client had too many of them", 0 },
+	{ "brickd_responses_dropped_total", "counter",
+	  "Responses dropped because no client is connected", 0 },
+	{ "brickd_responses_broadcast_total", "counter",
+	  "Responses broadcast because no client had a matching pending request", 0 },
+	{ "brickd_callbacks_dropped_total", "counter",
+	  "Callbacks dropped because no client is connected", 0 },
+	{ "brickd_callbacks_held_back_total", "counter",
+	  "Callbacks held back by callback throttling", 0 },
+	{ "brickd_response_cache_hits_total", "counter",
+	  "Requests answered from the response cache", 0 },
+	{ "brickd_coalesced_requests_total", "counter",
+	  "Requests coalesced with an identical in-flight request", 0 },
+	{ "brickd_enumerate_cache_hits_total", "counter",
+	  "Enumerate requests answered from the enumerate cache of a Brick", 0 }
+};
+
+static const MetricInfo _client_metric_infos[] = {
+	{ "brickd_client_requests_received_total", "counter",
+	  "Requests received from a client",
+	  offsetof(ClientMetrics, requests_received) },
+	{ "brickd_client_bytes_received_total", "counter",
+	  "Request bytes received from a client",
+	  offsetof(ClientMetrics, bytes_received) },
+	{ "brickd_client_invalid_requests_total", "counter",
+	  "Invalid requests received from a client",
+	  offsetof(ClientMetrics, invalid_requests) },
+	{ "brickd_client_pending_requests_dropped_total", "counter",
+	  "Pending requests of a client dropped because too many were pending",
+	  offsetof(ClientMetrics, pending_requests_dropped) },
+	{ "brickd_client_packets_sent_total", "counter",
+	  "Responses and callbacks sent to a client",
+	  offsetof(ClientMetrics, packets_sent) },
+	{ "brickd_client_bytes_sent_total", "counter",
+	  "Response and callback bytes sent to a client",
+	  offsetof(ClientMetrics, bytes_sent) },
+	{ "brickd_client_send_errors_total", "counter",
+	  "Responses and callbacks that could not be sent to a client",
+	  offsetof(ClientMetrics, send_errors) },
+	{ "brickd_client_throttled_total", "counter",
+	  "Times a client was throttled by request rate limiting",
+	  offsetof(ClientMetrics, throttled) }
+};
+
+static const MetricInfo _brick_metric_infos[] = {
+	{ "brickd_brick_requests_sent_total", "counter",
+	  "Requests sent to a Brick",
+	  offsetof(BrickMetrics, requests_sent) },
+	{ "brickd_brick_bytes_sent_total", "counter",
+	  "Request bytes sent to a Brick",
+	  offsetof(BrickMetrics, bytes_sent) },
+	{ "brickd_brick_packets_received_total", "counter",
+	  "Responses and callbacks received from a Brick",
+	  offsetof(BrickMetrics, packets_received) },
+	{ "brickd_brick_bytes_received_total", "counter",
+	  "Response and callback bytes received from a Brick",
+	  offsetof(BrickMetrics, bytes_received) },
+	{ "brickd_brick_invalid_packets_total", "counter",
+	  "Invalid responses and callbacks received from a Brick",
+	  offsetof(BrickMetrics, invalid_packets) },
+	{ "brickd_brick_queued_requests_total", "counter",
+	  "Requests put into the write queue of a Brick",
+	  offsetof(BrickMetrics, queued_requests) },
+	{ "brickd_brick_queue_drops_total", "counter",
+	  "Requests dropped from the full write queue of a Brick",
+	  offsetof(BrickMetrics, queue_drops) },
+	{ "brickd_brick_coalesced_setters_total", "counter",
+	  "Queued setters replaced by a newer one by write coalescing",
+	  offsetof(BrickMetrics, coalesced_setters) },
+	{ "brickd_brick_read_transfer_errors_total", "counter",
+	  "Read transfers of a Brick that failed",
+	  offsetof(BrickMetrics, read_transfer_errors) },
+	{ "brickd_brick_write_transfer_errors_total", "counter",
+	  "Write transfers of a Brick that failed",
+	  offsetof(BrickMetrics, write_transfer_errors) }
+};
+
+static const MetricInfo _brick_histogram_infos[] = {
+	{ "brickd_brick_queue_wait_seconds", "histogram",
+	  "Time from receiving a request to submitting it to a Brick",
+	  offsetof(BrickMetrics, queue_wait) },
+	{ "brickd_brick_usb_round_trip_seconds", "histogram",
+	  "Time from submitting a request to a Brick to receiving its response",
+	  offsetof(BrickMetrics, usb_round_trip) },
+	{ "brickd_brick_send_seconds", "histogram",
+	  "Time from receiving a response from a Brick to sending it to the client",
+	  offsetof(BrickMetrics, send) },
+	{ "brickd_brick_request_duration_seconds", "histogram",
+	  "Time from receiving a request to sending its response to the client",
+	  offsetof(BrickMetrics, total) }
+};
+
+static uint64_t _counters[METRIC_COUNT];
+
+// the response that is currently dispatched to the clients, see
+// metrics_begin_response
+static BrickMetrics *_response_metrics = NULL;
+static uint64_t _response_submitted = 0;
+static uint64_t _response_completed = 0;
+
+static EventHandle _server_socket = INVALID_EVENT_HANDLE;
+static Array _connections = ARRAY_INITIALIZER;
+
+static void metrics_append_data(MetricsBuffer *buffer, const char *data, int length) {
+	int allocated;
+	char *resized;
+
+	if (buffer->length + length > buffer->allocated) {
+		allocated = buffer->allocated > 0 ? buffer->allocated * 2 : 4096;
+
+		while (buffer->length + length > allocated) {
+			allocated *= 2;
+		}
+
+		resized = realloc(buffer->data, allocated);
+
+		if (resized == NULL) {
+			// keep the metrics collected so far
+			return;
+		}
+
+		buffer->data = resized;
+		buffer->allocated = allocated;
+	}
+
+	memcpy(buffer->data + buffer->length, data, length);
+
+	buffer->length += length;
+}
+
+static void metrics_append(MetricsBuffer *buffer, const char *format, ...) ATTRIBUTE_FMT_PRINTF(2, 3);
+
+static void metrics_append(MetricsBuffer *buffer, const char *format, ...) {
+	va_list arguments;
+	char line[512];
+
+	va_start(arguments, format);
+
+#ifdef _MSC_VER
+	_vsnprintf_s(line, sizeof(line), sizeof(line) - 1, format, arguments);
+#else
+	vsnprintf(line, sizeof(line), format, arguments);
+#endif
+
+	va_end(arguments);
+
+	line[sizeof(line) - 1] = '\0';
+
+	metrics_append_data(buffer, line, strlen(line));
+}
+
+// escapes a string for use as a label value
+static void metrics_escape(char *escaped, int size, const char *string) {
+	int i = 0;
+
+	for (; *string != '\0' && i < size - 2; ++string) {
+		if (*string == '"' || *string == '\\') {
+			escaped[i++] = '\\';
+			escaped[i++] = *string;
+		} else if (*string == '\n') {
+			escaped[i++] = '\\';
+			escaped[i++] = 'n';
+		} else {
+			escaped[i++] = *string;
+		}
+	}
+
+	escaped[i] = '\0';
+}
+
+static void metrics_append_header(MetricsBuffer *buffer, const MetricInfo *info) {
+	metrics_append(buffer, "# HELP %s %s\n# TYPE %s %s\n",
+	               info->name, info->help, info->name, info->type);
+}
+
+// labels is a formatted label list without braces, it can be empty
+static void metrics_append_histogram(MetricsBuffer *buffer, const char *name,
+                                     const char *labels,
+                                     LatencyHistogram *histogram) {
+	int i;
+	uint64_t cumulative = 0;
+	const char *separator = *labels != '\0' ? "," : "";
+
+	for (i = 0; i < LATENCY_BUCKET_COUNT - 1; ++i) {
+		cumulative += histogram->buckets[i];
+
+		metrics_append(buffer, "%s_bucket{%s%sle=\"%.6f\"} %llu\n",
+		               name, labels, separator,
+		               (double)((uint32_t)1 << i) / 1000000.0,
+		               (unsigned long long)cumulative);
+	}
+
+	metrics_append(buffer, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+	               name, labels, separator, (unsigned long long)histogram->count);
+
+	if (*labels != '\0') {
+		metrics_append(buffer, "%s_sum{%s} %.6f\n", name, labels,
+		               (double)histogram->sum / 1000000.0);
+		metrics_append(buffer, "%s_count{%s} %llu\n", name, labels,
+		               (unsigned long long)histogram->count);
+	} else {
+		metrics_append(buffer, "%s_sum %.6f\n", name,
+		               (double)histogram->sum / 1000000.0);
+		metrics_append(buffer, "%s_count %llu\n", name,
+		               (unsigned long long)histogram->count);
+	}
+}
+
+// formats a single label, the value is escaped
+static void metrics_format_label(char *labels, int size, const char *name,
+                                 const char *value) {
+	int length = strlen(name);
+
+	if (length + 4 > size) {
+		*labels = '\0';
+
+		return;
+	}
+
+	memcpy(labels, name, length);
+
+	labels[length++] = '=';
+	labels[length++] = '"';
+
+	metrics_escape(labels + length, size - length - 1, value);
+
+	length += strlen(labels + length);
+
+	labels[length++] = '"';
+	labels[length] = '\0';
+}
+
+static void metrics_collect(MetricsBuffer *buffer) {
+	Array *clients = network_get_clients();
+	Array *bricks = usb_get_bricks();
+	int i;
+	int k;
+	Client *client;
+	Brick *brick;
+	char peer[128];
+	char serial_number[128];
+	char labels[160];
+	MetricInfo info;
+	EventMetrics *event_metrics = event_get_metrics();
+
+	for (i = 0; i < METRIC_COUNT; ++i) {
+		metrics_append_header(buffer, &_metric_infos[i]);
+		metrics_append(buffer, "%s %llu\n", _metric_infos[i].name,
+		               (unsigned long long)_counters[i]);
+	}
+
+	info.name = "brickd_clients";
+	info.type = "gauge";
+	info.help = "Connected clients";
+
+	metrics_append_header(buffer, &info);
+	metrics_append(buffer, "%s %d\n", info.name, clients->count);
+
+	info.name = "brickd_bricks";
+	info.help = "Connected Bricks";
+
+	metrics_append_header(buffer, &info);
+	metrics_append(buffer, "%s %d\n", info.name, bricks->count);
+
+	for (k = 0; k < (int)(sizeof(_client_metric_infos) / sizeof(MetricInfo)); ++k) {
+		metrics_append_header(buffer, &_client_metric_infos[k]);
+
+		for (i = 0; i < clients->count; ++i) {
+			client = array_get(clients, i);
+
+			metrics_escape(peer, sizeof(peer), client_get_peer_name(client));
+			metrics_append(buffer, "%s{socket=\"%d\",peer=\"%s\"} %llu\n",
+			               _client_metric_infos[k].name, (int)client->socket, peer,
+			               (unsigned long long)*(uint64_t *)((uint8_t *)&client->metrics +
+			                                                 _client_metric_infos[k].offset));
+		}
+	}
+
+	info.name = "brickd_client_pending_requests";
+	info.help = "Requests of a client that wait for a response";
+
+	metrics_append_header(buffer, &info);
+
+	for (i = 0; i < clients->count; ++i) {
+		client = array_get(clients, i);
+
+		metrics_escape(peer, sizeof(peer), client_get_peer_name(client));
+		metrics_append(buffer, "%s{socket=\"%d\",peer=\"%s\"} %d\n",
+		               info.name, (int)client->socket, peer,
+		               client->pending_requests.count);
+	}
+
+	for (k = 0; k < (int)(sizeof(_brick_metric_infos) / sizeof(MetricInfo)); ++k) {
+		metrics_append_header(buffer, &_brick_metric_infos[k]);
+
+		for (i = 0; i < bricks->count; ++i) {
+			brick = array_get(bricks, i);
+
+			metrics_escape(serial_number, sizeof(serial_number), brick->serial_number);
+			metrics_append(buffer, "%s{serial_number=\"%s\"} %llu\n",
+			               _brick_metric_infos[k].name, serial_number,
+			               (unsigned long long)*(uint64_t *)((uint8_t *)&brick->metrics +
+			                                                 _brick_metric_infos[k].offset));
+		}
+	}
+
+	for (k = 0; k < (int)(sizeof(_brick_histogram_infos) / sizeof(MetricInfo)); ++k) {
+		metrics_append_header(buffer, &_brick_histogram_infos[k]);
+
+		for (i = 0; i < bricks->count; ++i) {
+			brick = array_get(bricks, i);
+
+			metrics_format_label(labels, sizeof(labels), "serial_number",
+			                     brick->serial_number);
+			metrics_append_histogram(buffer, _brick_histogram_infos[k].name, labels,
+			                         (LatencyHistogram *)((uint8_t *)&brick->metrics +
+			                                              _brick_histogram_infos[k].offset));
+		}
+	}
+
+	info.name = "brickd_brick_write_queue_depth";
+	info.help = "Requests in the write queue of a Brick";
+
+	metrics_append_header(buffer, &info);
+
+	for (i = 0; i < bricks->count; ++i) {
+		brick = array_get(bricks, i);
+
+		metrics_escape(serial_number, sizeof(serial_number), brick->serial_number);
+		metrics_append(buffer, "%s{serial_number=\"%s\"} %d\n",
+		               info.name, serial_number, brick->write_queue.count);
+	}
+
+	if (event_metrics == NULL) {
+		return;
+	}
+
+	info.type = "histogram";
+	info.name = "brickd_event_loop_wait_seconds";
+	info.help = "Time the event loop waited for events per iteration";
+
+	metrics_append_header(buffer, &info);
+	metrics_append_histogram(buffer, info.name, "", &event_metrics->wait);
+
+	info.name = "brickd_event_loop_work_seconds";
+	info.help = "Time the event loop spent handling events and timers per iteration";
+
+	metrics_append_header(buffer, &info);
+	metrics_append_histogram(buffer, info.name, "", &event_metrics->work);
+
+	info.name = "brickd_event_handler_seconds";
+	info.help = "Time a single event source or timer handler ran";
+
+	metrics_append_header(buffer, &info);
+	metrics_append_histogram(buffer, info.name, "type=\"generic\"",
+	                         &event_metrics->generic_handlers);
+	metrics_append_histogram(buffer, info.name, "type=\"usb\"",
+	                         &event_metrics->usb_handlers);
+	metrics_append_histogram(buffer, info.name, "type=\"timer\"",
+	                         &event_metrics->timer_handlers);
+
+	info.type = "counter";
+	info.name = "brickd_event_slow_handlers_total";
+	info.help = "Handlers that ran longer than the slow handler threshold";
+
+	metrics_append_header(buffer, &info);
+	metrics_append(buffer, "%s %llu\n", info.name,
+	               (unsigned long long)event_metrics->slow_handlers);
+}
+
+static void metrics_close_connection(MetricsConnection *connection) {
+	int i = array_find(&_connections, connection);
+
+	event_remove_source(connection->socket, EVENT_SOURCE_TYPE_GENERIC);
+	socket_destroy(connection->socket);
+
+	free(connection->response.data);
+
+	if (i >= 0) {
+		array_remove(&_connections, i, NULL);
+	}
+}
+
+static void metrics_handle_send(void *opaque) {
+	MetricsConnection *connection = opaque;
+	int rc;
+
+	rc = socket_send(connection->socket,
+	                 connection->response.data + connection->response_sent,
+	                 connection->response.length - connection->response_sent);
+
+	if (rc < 0) {
+		if (errno_interrupted() || errno_would_block()) {
+			return;
+		}
+
+		log_debug("Could not send metrics to connection (socket: %d): %s (%d)",
+		          connection->socket, get_errno_name(errno), errno);
+
+		metrics_close_connection(connection);
+
+		return;
+	}
+
+	connection->response_sent += rc;
+
+	if (connection->response_sent >= connection->response.length) {
+		metrics_close_connection(connection);
+	}
+}
+
+// renders the complete response at once, so the metrics are a consistent
+// snapshot, and switches the connection from receiving to sending
+static void metrics_send_response(MetricsConnection *connection) {
+	MetricsBuffer body = { NULL, 0, 0 };
+
+	metrics_collect(&body);
+
+	metrics_append(&connection->response,
+	               "HTTP/1.0 200 OK\r\n"
+	               "Content-Type: text/plain; version=0.0.4\r\n"
+	               "Content-Length: %d\r\n"
+	               "Connection: close\r\n\r\n", body.length);
+
+	if (body.length > 0) {
+		metrics_append_data(&connection->response, body.data, body.length);
+	}
+
+	free(body.data);
+
+	event_remove_source(connection->socket, EVENT_SOURCE_TYPE_GENERIC);
+
+	if (event_add_source(connection->socket, EVENT_SOURCE_TYPE_GENERIC,
+	                     EVENT_WRITE, metrics_handle_send, connection) < 0) {
+		metrics_close_connection(connection);
+	}
+}
+
+static void metrics_handle_receive(void *opaque) {
+	MetricsConnection *connection = opaque;
+	int length;
+
+	length = socket_receive(connection->socket,
+	                        connection->request + connection->request_used,
+	                        MAX_REQUEST_LENGTH - connection->request_used);
+
+	if (length < 0) {
+		if (errno_interrupted() || errno_would_block()) {
+			return;
+		}
+
+		metrics_close_connection(connection);
+
+		return;
+	}
+
+	if (length == 0) {
+		metrics_close_connection(connection);
+
+		return;
+	}
+
+	connection->request_used += length;
+	connection->request[connection->request_used] = '\0';
+
+	// answer every request once its header is complete, the request line
+	// is not checked
+	if (strstr(connection->request, "\r\n\r\n") == NULL &&
+	    strstr(connection->request, "\n\n") == NULL &&
+	    connection->request_used < MAX_REQUEST_LENGTH) {
+		return;
+	}
+
+	metrics_send_response(connection);
+}
+
+static void metrics_handle_accept(void *opaque) {
+	EventHandle socket;
+	MetricsConnection *connection;
+
+	(void)opaque;
+
+	if (socket_accept(_server_socket, &socket, NULL, NULL) < 0) {
+		if (!errno_interrupted() && !errno_would_block()) {
+			log_error("Could not accept new metrics connection: %s (%d)",
+			          get_errno_name(errno), errno);
+		}
+
+		return;
+	}
+
+	if (_connections.count >= MAX_CONNECTIONS) {
+		log_warn("Rejecting new metrics connection, too many connections");
+
+		socket_destroy(socket);
+
+		return;
+	}
+
+	connection = array_append(&_connections);
+
+	if (connection == NULL) {
+		log_error("Could not append to metrics connection array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		socket_destroy(socket);
+
+		return;
+	}
+
+	connection->socket = socket;
+	connection->request_used = 0;
+	connection->response.data = NULL;
+	connection->response.length = 0;
+	connection->response.allocated = 0;
+	connection->response_sent = 0;
+
+	if (event_add_source(socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
+	                     metrics_handle_receive, connection) < 0) {
+		array_remove(&_connections, _connections.count - 1, NULL);
+		socket_destroy(socket);
+	}
+}
+
+int metrics_init(void) {
+	int phase = 0;
+	const char *address = config_get_metrics_address();
+	uint16_t port = config_get_metrics_port();
+	struct addrinfo *resolved = NULL;
+
+	if (port == 0) {
+		log_debug("Metrics endpoint is disabled");
+
+		return 0;
+	}
+
+	log_debug("Initializing metrics endpoint");
+
+	// the connection struct is not relocatable, because it is passed by
+	// reference as opaque parameter to the event subsystem
+	if (array_create(&_connections, MAX_CONNECTIONS,
+	                 sizeof(MetricsConnection), 0) < 0) {
+		log_error("Could not create metrics connection array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	resolved = resolve_listen_address(address, port);
+
+	if (resolved == NULL) {
+		log_error("Could not resolve metrics address '%s': %s (%d)",
+		          address, get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (socket_create(&_server_socket, resolved->ai_family,
+	                  resolved->ai_socktype, resolved->ai_protocol) < 0) {
+		log_error("Could not create metrics server socket: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	if (socket_set_address_reuse(_server_socket, 1) < 0) {
+		log_error("Could not enable address-reuse mode for metrics server socket: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (socket_bind(_server_socket, resolved->ai_addr, resolved->ai_addrlen) < 0) {
+		log_error("Could not bind metrics server socket to '%s' on port %u: %s (%d)",
+		          address, port, get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (socket_listen(_server_socket, 8) < 0) {
+		log_error("Could not listen to metrics server socket bound to '%s' on port %u: %s (%d)",
+		          address, port, get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (socket_set_non_blocking(_server_socket, 1) < 0) {
+		log_error("Could not enable non-blocking mode for metrics server socket: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (event_add_source(_server_socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
+	                     metrics_handle_accept, NULL) < 0) {
+		goto cleanup;
+	}
+
+	log_info("Serving metrics on '%s' port %u", address, port);
+
+	phase = 3;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 2:
+		socket_destroy(_server_socket);
+		_server_socket = INVALID_EVENT_HANDLE;
+
+	case 1:
+		array_destroy(&_connections, NULL);
+
+	default:
+		break;
+	}
+
+	if (resolved != NULL) {
+		freeaddrinfo(resolved);
+	}
+
+	return phase == 3 ? 0 : -1;
+}
+
+void metrics_exit(void) {
+	MetricsConnection *connection;
+
+	if (_server_socket == INVALID_EVENT_HANDLE) {
+		return;
+	}
+
+	log_debug("Shutting down metrics endpoint");
+
+	while (_connections.count > 0) {
+		connection = array_get(&_connections, _connections.count - 1);
+
+		metrics_close_connection(connection);
+	}
+
+	array_destroy(&_connections, NULL);
+
+	event_remove_source(_server_socket, EVENT_SOURCE_TYPE_GENERIC);
+	socket_destroy(_server_socket);
+
+	_server_socket = INVALID_EVENT_HANDLE;
+}
+
+void metrics_increment(Metric metric) {
+	++_counters[metric];
+}
+
+void metrics_record_latency(LatencyHistogram *histogram, uint64_t duration) {
+	int i = 0;
+
+	while (i < LATENCY_BUCKET_COUNT - 1 && duration > ((uint64_t)1 << i)) {
+		++i;
+	}
+
+	++histogram->buckets[i];
+	++histogram->count;
+	histogram->sum += duration;
+}
+
+// marks the response that is about to be dispatched to the clients as
+// coming from a Brick. submitted is the time the matching request was
+// submitted to the Brick and completed is the time the response arrived,
+// both in microseconds. 0 for submitted means the request is unknown
+void metrics_begin_response(BrickMetrics *metrics, uint64_t submitted,
+                            uint64_t completed) {
+	_response_metrics = metrics;
+	_response_submitted = submitted;
+	_response_completed = completed;
+
+	if (submitted > 0 && completed >= submitted) {
+		metrics_record_latency(&metrics->usb_round_trip, completed - submitted);
+	}
+}
+
+void metrics_end_response(void) {
+	_response_metrics = NULL;
+}
+
+// records the latency of a request that was received at the given time and
+// whose response was just sent. the USB round-trip is already recorded once
+// per response by metrics_begin_response, because a coalesced response can
+// be sent to multiple clients
+void metrics_record_response(uint64_t received) {
+	uint64_t now;
+
+	if (_response_metrics == NULL || received == 0) {
+		return;
+	}
+
+	now = microseconds();
+
+	// a coalesced request can be received after the forwarded request
+	// was already submitted, it did not wait in the queue then
+	if (_response_submitted > received) {
+		metrics_record_latency(&_response_metrics->queue_wait,
+		                       _response_submitted - received);
+	} else if (_response_submitted > 0) {
+		metrics_record_latency(&_response_metrics->queue_wait, 0);
+	}
+
+	if (now >= _response_completed) {
+		metrics_record_latency(&_response_metrics->send, now - _response_completed);
+	}
+
+	if (now >= received) {
+		metrics_record_latency(&_response_metrics->total, now - received);
+	}
+}
@@ -0,0 +1,94 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * metrics.h: Counters and Prometheus metrics endpoint
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_METRICS_H
+#define BRICKD_METRICS_H
+
+#include <stdint.h>
+
+typedef enum {
+	METRIC_CLIENTS_ACCEPTED = 0,
+	METRIC_CLIENTS_REJECTED,
+	METRIC_REQUESTS_DROPPED,
+	METRIC_REQUESTS_BROADCAST,
+	METRIC_PENDING_REQUESTS_DROPPED,
+	METRIC_RESPONSES_DROPPED,
+	METRIC_RESPONSES_BROADCAST,
+	METRIC_CALLBACKS_DROPPED,
+	METRIC_CALLBACKS_HELD_BACK,
+	METRIC_CACHE_HITS,
+	METRIC_COALESCED_REQUESTS,
+	METRIC_ENUMERATE_CACHE_HITS,
+	METRIC_COUNT
+} Metric;
+
+// bucket i counts durations up to 2^i microseconds, the last bucket counts
+// all longer durations. this covers 1 usec to 8.4 sec with a relative error
+// of at most a factor of two
+#define LATENCY_BUCKET_COUNT 25
+
+typedef struct {
+	uint64_t buckets[LATENCY_BUCKET_COUNT];
+	uint64_t count;
+	uint64_t sum; // in microseconds
+} LatencyHistogram;
+
+typedef struct {
+	uint64_t requests_received;
+	uint64_t bytes_received;
+	uint64_t invalid_requests;
+	uint64_t pending_requests_dropped;
+	uint64_t packets_sent;
+	uint64_t bytes_sent;
+	uint64_t send_errors;
+	uint64_t throttled;
+} ClientMetrics;
+
+typedef struct {
+	uint64_t requests_sent;
+	uint64_t bytes_sent;
+	uint64_t packets_received;
+	uint64_t bytes_received;
+	uint64_t invalid_packets;
+	uint64_t queued_requests;
+	uint64_t queue_drops;
+	uint64_t coalesced_setters;
+	uint64_t read_transfer_errors;
+	uint64_t write_transfer_errors;
+	LatencyHistogram queue_wait; // from receiving a request to submitting it
+	LatencyHistogram usb_round_trip; // from submitting a request to its response
+	LatencyHistogram send; // from the response to sending it to the client
+	LatencyHistogram total; // from receiving a request to sending its response
+} BrickMetrics;
+
+int metrics_init(void);
+void metrics_exit(void);
+
+void metrics_increment(Metric metric);
+
+void metrics_record_latency(LatencyHistogram *histogram, uint64_t duration);
+
+void metrics_begin_response(BrickMetrics *metrics, uint64_t submitted,
+                            uint64_t completed);
+void metrics_end_response(void);
+void metrics_record_response(uint64_t received);
+
+#endif // BRICKD_METRICS_H
@@ -0,0 +1,403 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * microbench.c: Microbenchmarks for core brickd functions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * times the Array functions, packet validation, UID lookup, base58 encoding
+ * and client dispatch with realistic sizes. the program is linked with the
+ * same objects as brickd, so the real functions are measured. each benchmark
+ * is repeated with doubling iteration counts until it ran for at least the
+ * minimum time (-t, in milliseconds). the results are written as JSON to
+ * stdout, one entry per benchmark and size with the time per operation.
+ *
+ * the dispatch benchmarks send to a socket pair that is drained after each
+ * round, all benchmark clients share the same socket.
+ *
+ * usage: microbench [-t <milliseconds>]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "brick.h"
+#include "client.h"
+#include "event.h"
+#include "log.h"
+#include "packet.h"
+#include "utils.h"
+
+#define MAX_CLIENTS 1000
+#define PENDING_REQUESTS 256
+
+typedef void (*BenchmarkFunction)(int size, int iterations);
+
+static uint64_t _minimum_duration = 200000; // in microseconds
+static int _first_result = 1;
+static int _sockets[2] = { -1, -1 };
+static Client _clients[MAX_CLIENTS];
+static volatile uint32_t _sink; // keeps results alive
+
+static void drain_socket(void) {
+	uint8_t buffer[65536];
+
+	while (recv(_sockets[0], buffer, sizeof(buffer), MSG_DONTWAIT) > 0) {
+	}
+}
+
+static void run_benchmark(const char *name, const char *parameter, int size,
+                          int operations_per_iteration,
+                          BenchmarkFunction function) {
+	int iterations = 1;
+	uint64_t start;
+	uint64_t duration;
+	char size_member[64] = "";
+
+	// warm up caches and allocations
+	function(size, 1);
+
+	for (;;) {
+		start = microseconds();
+
+		function(size, iterations);
+
+		duration = microseconds() - start;
+
+		if (duration >= _minimum_duration || iterations >= (1 << 30)) {
+			break;
+		}
+
+		iterations *= 2;
+	}
+
+	if (parameter != NULL) {
+		snprintf(size_member, sizeof(size_member), ", \"%s\": %d", parameter, size);
+	}
+
+	printf("%s\n    {\"name\": \"%s\"%s, \"iterations\": %d, "
+	       "\"operations\": %llu, \"total_us\": %llu, \"ns_per_op\": %.2f}",
+	       _first_result ? "" : ",", name, size_member, iterations,
+	       (unsigned long long)iterations * operations_per_iteration,
+	       (unsigned long long)duration,
+	       duration * 1000.0 / ((double)iterations * operations_per_iteration));
+
+	fflush(stdout);
+
+	_first_result = 0;
+}
+
+static void bench_array_append(int size, int iterations) {
+	Array array;
+	PendingRequest *pending_request;
+	int i;
+	int k;
+
+	array_create(&array, size, sizeof(PendingRequest), 1);
+
+	for (i = 0; i < iterations; ++i) {
+		for (k = 0; k < size; ++k) {
+			pending_request = array_append(&array);
+			pending_request->timestamp = k;
+		}
+
+		array_resize(&array, 0, NULL);
+	}
+
+	array_destroy(&array, NULL);
+}
+
+// removing the first item is how FIFOs like the pending requests are used
+static void bench_array_remove_first(int size, int iterations) {
+	Array array;
+	int i;
+	int k;
+
+	array_create(&array, size, sizeof(PendingRequest), 1);
+
+	for (i = 0; i < iterations; ++i) {
+		array_resize(&array, size, NULL);
+
+		for (k = 0; k < size; ++k) {
+			array_remove(&array, 0, NULL);
+		}
+	}
+
+	array_destroy(&array, NULL);
+}
+
+static void bench_array_find(int size, int iterations) {
+	Array array;
+	int k;
+	int i;
+	void *last = NULL;
+
+	// a non-relocatable array like the client and Brick arrays
+	array_create(&array, size, sizeof(Client), 0);
+
+	for (k = 0; k < size; ++k) {
+		last = array_append(&array);
+	}
+
+	for (i = 0; i < iterations; ++i) {
+		_sink += array_find(&array, last);
+	}
+
+	array_destroy(&array, NULL);
+}
+
+static void bench_packet_header_is_valid_request(int size, int iterations) {
+	PacketHeader header;
+	const char *message;
+	int i;
+
+	(void)size;
+
+	memset(&header, 0, sizeof(header));
+
+	header.uid = 1000;
+	header.length = sizeof(PacketHeader) + 4;
+	header.function_id = 2;
+	header.sequence_number = 1;
+	header.response_expected = 1;
+
+	for (i = 0; i < iterations; ++i) {
+		header.sequence_number = i % 15 + 1;
+		_sink += packet_header_is_valid_request(&header, &message);
+	}
+}
+
+// looks up an unknown UID, the worst case for the linear search
+static void bench_brick_knows_uid(int size, int iterations) {
+	Brick brick;
+	int i;
+
+	memset(&brick, 0, sizeof(brick));
+
+	array_create(&brick.uids, size, sizeof(uint32_t), 1);
+
+	for (i = 0; i < size; ++i) {
+		brick_add_uid(&brick, 1000 + i);
+	}
+
+	for (i = 0; i < iterations; ++i) {
+		_sink += brick_knows_uid(&brick, 1);
+	}
+
+	array_destroy(&brick.uids, NULL);
+}
+
+static void bench_base58_encode(int size, int iterations) {
+	char buffer[16];
+	int i;
+
+	(void)size;
+
+	for (i = 0; i < iterations; ++i) {
+		base58_encode(buffer, 0x10000000 + i * 7919);
+		_sink += (uint8_t)buffer[0];
+	}
+}
+
+static void setup_clients(int count) {
+	int i;
+	int k;
+	Client *client;
+	PendingRequest *pending_request;
+
+	for (i = 0; i < count; ++i) {
+		client = &_clients[i];
+
+		memset(client, 0, sizeof(Client));
+
+		client->socket = _sockets[1];
+
+		array_create(&client->pending_requests, PENDING_REQUESTS,
+		             sizeof(PendingRequest), 1);
+
+		for (k = 0; k < PENDING_REQUESTS; ++k) {
+			pending_request = array_append(&client->pending_requests);
+
+			memset(pending_request, 0, sizeof(PendingRequest));
+
+			pending_request->header.uid = 100000 + i * PENDING_REQUESTS + k;
+			pending_request->header.length = sizeof(PacketHeader);
+			pending_request->header.function_id = 1;
+			pending_request->header.sequence_number = k % 15 + 1;
+			pending_request->header.response_expected = 1;
+		}
+	}
+}
+
+static void teardown_clients(int count) {
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		array_destroy(&_clients[i].pending_requests, NULL);
+	}
+}
+
+// dispatches a response like network_dispatch_packet: every client is asked
+// until one has the matching pending request. it is the last pending request
+// of the last client, so all pending requests are compared
+static void bench_client_dispatch_response(int size, int iterations) {
+	Packet response;
+	PendingRequest *pending_request;
+	Client *last;
+	int i;
+	int k;
+
+	setup_clients(size);
+
+	last = &_clients[size - 1];
+	pending_request = array_get(&last->pending_requests, PENDING_REQUESTS - 1);
+
+	memset(&response, 0, sizeof(response));
+	memcpy(&response.header, &pending_request->header, sizeof(PacketHeader));
+
+	response.header.length = sizeof(PacketHeader) + 4;
+
+	for (i = 0; i < iterations; ++i) {
+		for (k = 0; k < size; ++k) {
+			if (client_dispatch_packet(&_clients[k], &response, 0) > 0) {
+				break;
+			}
+		}
+
+		// the matching pending request got removed, add it again
+		pending_request = array_append(&last->pending_requests);
+
+		memcpy(&pending_request->header, &response.header, sizeof(PacketHeader));
+		pending_request->header.length = sizeof(PacketHeader);
+
+		if (i % 256 == 0) {
+			drain_socket();
+		}
+	}
+
+	drain_socket();
+	teardown_clients(size);
+}
+
+// broadcasts a callback to all clients
+static void bench_client_dispatch_callback(int size, int iterations) {
+	Packet callback;
+	int i;
+	int k;
+
+	setup_clients(size);
+
+	memset(&callback, 0, sizeof(callback));
+
+	callback.header.uid = 1000;
+	callback.header.length = sizeof(PacketHeader) + 4;
+	callback.header.function_id = 64;
+	callback.header.response_expected = 1;
+
+	for (i = 0; i < iterations; ++i) {
+		for (k = 0; k < size; ++k) {
+			client_dispatch_packet(&_clients[k], &callback, 1);
+		}
+
+		drain_socket();
+	}
+
+	teardown_clients(size);
+}
+
+int main(int argc, char **argv) {
+	static const int array_sizes[] = { 1, 16, 256, 1000 };
+	static const int uid_counts[] = { 1, 10, 100, 500 };
+	static const int client_counts[] = { 1, 10, 100, 1000 };
+	int buffer_size = 1024 * 1024;
+	int i;
+
+	if (argc == 3 && strcmp(argv[1], "-t") == 0 && atoi(argv[2]) > 0) {
+		_minimum_duration = (uint64_t)atoi(argv[2]) * 1000;
+	} else if (argc != 1) {
+		fprintf(stderr, "Usage: %s [-t <milliseconds>]\n", argv[0]);
+
+		return 1;
+	}
+
+	log_init();
+
+	if (event_init() < 0) {
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, _sockets) < 0) {
+		fprintf(stderr, "Could not create socket pair: %s (%d)\n",
+		        get_errno_name(errno), errno);
+
+		return 1;
+	}
+
+	setsockopt(_sockets[1], SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+
+	printf("{\n  \"benchmarks\": [");
+
+	for (i = 0; i < (int)(sizeof(array_sizes) / sizeof(array_sizes[0])); ++i) {
+		run_benchmark("array_append", "items", array_sizes[i],
+		              array_sizes[i], bench_array_append);
+	}
+
+	for (i = 0; i < (int)(sizeof(array_sizes) / sizeof(array_sizes[0])); ++i) {
+		run_benchmark("array_remove_first", "items", array_sizes[i],
+		              array_sizes[i], bench_array_remove_first);
+	}
+
+	for (i = 0; i < (int)(sizeof(array_sizes) / sizeof(array_sizes[0])); ++i) {
+		run_benchmark("array_find", "items", array_sizes[i], 1,
+		              bench_array_find);
+	}
+
+	run_benchmark("packet_header_is_valid_request", NULL, 1, 1,
+	              bench_packet_header_is_valid_request);
+
+	for (i = 0; i < (int)(sizeof(uid_counts) / sizeof(uid_counts[0])); ++i) {
+		run_benchmark("brick_knows_uid", "uids", uid_counts[i], 1,
+		              bench_brick_knows_uid);
+	}
+
+	run_benchmark("base58_encode", NULL, 1, 1, bench_base58_encode);
+
+	for (i = 0; i < (int)(sizeof(client_counts) / sizeof(client_counts[0])); ++i) {
+		run_benchmark("client_dispatch_response", "clients", client_counts[i], 1,
+		              bench_client_dispatch_response);
+	}
+
+	for (i = 0; i < (int)(sizeof(client_counts) / sizeof(client_counts[0])); ++i) {
+		run_benchmark("client_dispatch_callback", "clients", client_counts[i], 1,
+		              bench_client_dispatch_callback);
+	}
+
+	printf("\n  ],\n  \"pending_requests\": %d\n}\n", PENDING_REQUESTS);
+
+	close(_sockets[0]);
+	close(_sockets[1]);
+
+	event_exit();
+	log_exit();
+
+	return 0;
+}
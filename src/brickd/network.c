@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #ifndef _WIN32
 	#include <netdb.h>
@@ -29,85 +30,181 @@
 
 #include "network.h"
 
+#include "cache.h"
 #include "config.h"
 #include "event.h"
+#include "inflight.h"
 #include "log.h"
+#include "metrics.h"
 #include "packet.h"
 #include "socket.h"
+#include "throttle.h"
+#include "trace.h"
+#include "usb.h"
 #include "utils.h"
 
 #define LOG_CATEGORY LOG_CATEGORY_NETWORK
 
-static uint16_t _port = 4223;
 static Array _clients = ARRAY_INITIALIZER;
-static EventHandle _server_socket = INVALID_EVENT_HANDLE;
+static Array _server_sockets = ARRAY_INITIALIZER;
+
+// returns NULL on error, the socket is not destroyed in that case
+Client *network_add_client(EventHandle socket, struct sockaddr *address,
+                           socklen_t length) {
+	Client *client;
+
+	// append to client array
+	client = array_append(&_clients);
+
+	if (client == NULL) {
+		log_error("Could not append to client array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return NULL;
+	}
+
+	if (client_create(client, socket, address, length) < 0) {
+		array_remove(&_clients, _clients.count - 1, NULL);
+
+		return NULL;
+	}
+
+	return client;
+}
 
 static void network_handle_accept(void *opaque) {
+	EventHandle server_socket = *(EventHandle *)opaque;
 	EventHandle client_socket;
-	struct sockaddr_in address;
-	socklen_t length = sizeof(address);
+	struct sockaddr_storage address;
+	socklen_t length;
 	Client *client;
+	int max_clients = config_get_listen_max_clients();
+	int rejected = 0;
+
+	// accept all pending connections at once, instead of one per event loop
+	// iteration, so that a burst of reconnecting clients is drained quickly
+	for (;;) {
+		length = sizeof(address);
+
+		// accept new client socket, it is already in non-blocking mode
+		if (socket_accept(server_socket, &client_socket,
+		                  (struct sockaddr *)&address, &length) < 0) {
+			if (errno_interrupted()) {
+				continue;
+			}
 
-	(void)opaque;
+			if (!errno_would_block()) {
+				log_error("Could not accept new socket: %s (%d)",
+				          get_errno_name(errno), errno);
+			}
 
-	// accept new client socket
-	if (socket_accept(_server_socket, &client_socket,
-	                  (struct sockaddr *)&address, &length) < 0) {
-		if (!errno_interrupted()) {
-			log_error("Could not accept new socket: %s (%d)",
-			          get_errno_name(errno), errno);
+			break;
 		}
 
-		return;
+		// reject the connection if the client limit is reached. closing
+		// the accepted socket tells the client right away, instead of
+		// leaving it in the backlog until it times out
+		if (max_clients > 0 && _clients.count >= max_clients) {
+			socket_destroy(client_socket);
+
+			metrics_increment(METRIC_CLIENTS_REJECTED);
+
+			++rejected;
+
+			continue;
+		}
+
+		client = network_add_client(client_socket,
+		                            (struct sockaddr *)&address, length);
+
+		if (client == NULL) {
+			socket_destroy(client_socket);
+
+			continue;
+		}
+
+		metrics_increment(METRIC_CLIENTS_ACCEPTED);
+
+		// the peer name is formatted lazily, only pay for it at debug level
+		log_info("Added new client (socket: %d)", client->socket);
+		log_debug("New client (socket: %d) is connected from %s",
+		          client->socket, client_get_peer_name(client));
+	}
+
+	if (rejected > 0) {
+		log_warn("Rejected %d new connection(s), because the client limit (%d) is reached",
+		         rejected, max_clients);
 	}
+}
+
+static void network_destroy_server_socket(EventHandle *server_socket) {
+	event_remove_source(*server_socket, EVENT_SOURCE_TYPE_GENERIC);
+	socket_destroy(*server_socket);
+}
 
-	// enable non-blocking
-	if (socket_set_non_blocking(client_socket, 1) < 0) {
-		log_error("Could not enable non-blocking mode for socket (handle: %d): %s (%d)",
-		          client_socket, get_errno_name(errno), errno);
+static void network_detach_server_socket(EventHandle *server_socket) {
+	event_remove_source(*server_socket, EVENT_SOURCE_TYPE_GENERIC);
+	socket_close(*server_socket);
+}
 
-		socket_destroy(client_socket);
+// takes over a server socket that is already listening, e.g. one that was
+// handed off by another brickd process
+static int network_add_server_socket(EventHandle socket) {
+	EventHandle *server_socket;
 
-		return;
+	server_socket = array_append(&_server_sockets);
+
+	if (server_socket == NULL) {
+		log_error("Could not append to server socket array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
 	}
 
-	// append to client array
-	client = array_append(&_clients);
+	*server_socket = socket;
 
-	if (client == NULL) {
-		log_error("Could not append to client array: %s (%d)",
+	if (socket_set_non_blocking(*server_socket, 1) < 0) {
+		log_error("Could not enable non-blocking mode for server socket: %s (%d)",
 		          get_errno_name(errno), errno);
 
-		socket_destroy(client_socket);
+		array_remove(&_server_sockets, _server_sockets.count - 1, NULL);
 
-		return;
+		return -1;
 	}
 
-	if (client_create(client, client_socket, &address, length) < 0) {
-		array_remove(&_clients, _clients.count - 1, NULL);
-		socket_destroy(client_socket);
+	if (event_add_source(*server_socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
+	                     network_handle_accept, server_socket) < 0) {
+		array_remove(&_server_sockets, _server_sockets.count - 1, NULL);
 
-		return;
+		return -1;
 	}
 
-	log_info("Added new client (socket: %d, peer: %s)",
-	         client->socket, client->peer);
+	log_debug("Took over server socket (handle: %d)", socket);
+
+	return 0;
 }
 
-int network_init(void) {
+static int network_open_server_socket(struct addrinfo *resolved,
+                                      const char *listen_address) {
 	int phase = 0;
-	const char *listen_address = config_get_listen_address();
-	struct hostent *entry;
-	struct sockaddr_in server_address;
+	EventHandle *server_socket;
+	char *name;
+	uint16_t port = config_get_listen_port();
+	int backlog = config_get_listen_backlog();
+	int dual_stack = config_get_listen_dual_stack();
 
-	log_debug("Initializing network subsystem");
+	name = resolve_address(resolved->ai_addr, resolved->ai_addrlen);
 
-	_port = config_get_listen_port();
+	if (name == NULL) {
+		name = (char *)listen_address;
+	}
 
-	// the Client struct is not relocatable, because it is passed by reference
+	// the server socket is not relocatable, because it is passed by reference
 	// as opaque parameter to the event subsystem
-	if (array_create(&_clients, 32, sizeof(Client), 0) < 0) {
-		log_error("Could not create client array: %s (%d)",
+	server_socket = array_append(&_server_sockets);
+
+	if (server_socket == NULL) {
+		log_error("Could not append to server socket array: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		goto cleanup;
@@ -115,9 +212,10 @@ int network_init(void) {
 
 	phase = 1;
 
-	if (socket_create(&_server_socket, AF_INET, SOCK_STREAM, 0) < 0) {
-		log_error("Could not create server socket: %s (%d)",
-		          get_errno_name(errno), errno);
+	if (socket_create(server_socket, resolved->ai_family,
+	                  resolved->ai_socktype, resolved->ai_protocol) < 0) {
+		log_error("Could not create server socket for '%s': %s (%d)",
+		          name, get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
@@ -125,63 +223,227 @@ int network_init(void) {
 	phase = 2;
 
 	// FIXME: use this for debugging purpose only
-	if (socket_set_address_reuse(_server_socket, 1) < 0) {
+	if (socket_set_address_reuse(*server_socket, 1) < 0) {
 		log_error("Could not enable address-reuse mode for server socket: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	memset(&server_address, 0, sizeof(server_address));
+	// IPv6 sockets only accept IPv4-mapped connections in dual-stack mode.
+	// otherwise an IPv4 and an IPv6 wildcard address can be bound side by side
+	if (resolved->ai_family == AF_INET6 &&
+	    socket_set_dual_stack(*server_socket, dual_stack) < 0) {
+		log_error("Could not %s dual-stack mode for server socket: %s (%d)",
+		          dual_stack ? "enable" : "disable",
+		          get_errno_name(errno), errno);
 
-	server_address.sin_family = AF_INET;
-	server_address.sin_port = htons(_port);
+		goto cleanup;
+	}
 
-	entry = gethostbyname(listen_address);
+	if (socket_bind(*server_socket, resolved->ai_addr,
+	                resolved->ai_addrlen) < 0) {
+		log_error("Could not bind server socket to '%s' on port %u: %s (%d)",
+		          name, port, get_errno_name(errno), errno);
 
-	if (entry == NULL) {
-		log_error("Could not resolve listen address '%s'", listen_address);
+		goto cleanup;
+	}
+
+	if (socket_listen(*server_socket, backlog) < 0) {
+		log_error("Could not listen to server socket bound to '%s' on port %u: %s (%d)",
+		          name, port, get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	memcpy(&server_address.sin_addr, entry->h_addr_list[0], entry->h_length);
+	log_debug("Started listening to '%s' on port %u (backlog: %d)",
+	          name, port, backlog);
 
-	if (socket_bind(_server_socket, (struct sockaddr *)&server_address,
-	                sizeof(server_address)) < 0) {
-		log_error("Could not bind server socket to '%s' on port %u: %s (%d)",
-		          listen_address, _port, get_errno_name(errno), errno);
+	if (socket_set_non_blocking(*server_socket, 1) < 0) {
+		log_error("Could not enable non-blocking mode for server socket: %s (%d)",
+		          get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	if (socket_listen(_server_socket, 10) < 0) {
-		log_error("Could not listen to server socket bound to '%s' on port %u: %s (%d)",
-		          listen_address, _port, get_errno_name(errno), errno);
+	if (event_add_source(*server_socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
+	                     network_handle_accept, server_socket) < 0) {
+		goto cleanup;
+	}
+
+	phase = 3;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 2:
+		socket_destroy(*server_socket);
+
+	case 1:
+		array_remove(&_server_sockets, _server_sockets.count - 1, NULL);
+
+	default:
+		break;
+	}
+
+	if (name != listen_address) {
+		free(name);
+	}
+
+	return phase == 3 ? 0 : -1;
+}
+
+static int network_open_server_sockets(void) {
+	Array *listen_addresses = config_get_listen_addresses();
+	const char *listen_address;
+	uint16_t port = config_get_listen_port();
+	struct addrinfo *resolved_addresses;
+	struct addrinfo *resolved;
+	int i;
+
+	// resolve each listen address once at startup and open a server socket
+	// for every resolved endpoint. an address such as localhost can resolve
+	// to an IPv4 and an IPv6 endpoint
+	for (i = 0; i < listen_addresses->count; ++i) {
+		listen_address = *(const char **)array_get(listen_addresses, i);
+		resolved_addresses = resolve_listen_address(listen_address, port);
+
+		if (resolved_addresses == NULL) {
+			log_error("Could not resolve listen address '%s': %s (%d)",
+			          listen_address, get_errno_name(errno), errno);
+
+			continue;
+		}
+
+		for (resolved = resolved_addresses; resolved != NULL;
+		     resolved = resolved->ai_next) {
+			if (resolved->ai_family != AF_INET &&
+			    resolved->ai_family != AF_INET6) {
+				continue;
+			}
+
+			// errors are already logged, keep the other endpoints usable
+			network_open_server_socket(resolved, listen_address);
+		}
+
+		freeaddrinfo(resolved_addresses);
+	}
+
+	if (_server_sockets.count == 0) {
+		log_error("Could not listen to any of the %d configured address(es) on port %u",
+		          listen_addresses->count, port);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// if server sockets are given, then they are taken over instead of opening
+// the configured listen addresses. taken over sockets are removed from the
+// given array, the network subsystem owns them afterwards
+int network_init(Array *server_sockets) {
+	int phase = 0;
+	EventHandle server_socket;
+	int server_socket_count;
+	int i;
+
+	log_debug("Initializing network subsystem");
+
+	// the Client struct is not relocatable, because it is passed by reference
+	// as opaque parameter to the event subsystem
+	if (array_create(&_clients, 32, sizeof(Client), 0) < 0) {
+		log_error("Could not create client array: %s (%d)",
+		          get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	log_debug("Started listening to '%s' on port %u", listen_address, _port);
+	phase = 1;
 
-	if (socket_set_non_blocking(_server_socket, 1) < 0) {
-		log_error("Could not enable non-blocking mode for server socket: %s (%d)",
+	if (array_create(&_server_sockets, 4, sizeof(EventHandle), 0) < 0) {
+		log_error("Could not create server socket array: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	if (event_add_source(_server_socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
-	                     network_handle_accept, NULL) < 0) {
+	phase = 2;
+
+	if (cache_init() < 0) {
 		goto cleanup;
 	}
 
 	phase = 3;
 
+	if (inflight_init() < 0) {
+		goto cleanup;
+	}
+
+	phase = 4;
+
+	if (throttle_init() < 0) {
+		goto cleanup;
+	}
+
+	phase = 5;
+
+	if (metrics_init() < 0) {
+		goto cleanup;
+	}
+
+	phase = 6;
+
+	if (trace_init() < 0) {
+		goto cleanup;
+	}
+
+	phase = 7;
+
+	if (server_sockets != NULL) {
+		server_socket_count = server_sockets->count;
+
+		// errors are already logged, keep the other server sockets usable
+		for (i = 0; i < server_socket_count; ++i) {
+			server_socket = *(EventHandle *)array_get(server_sockets, i);
+
+			if (network_add_server_socket(server_socket) < 0) {
+				socket_destroy(server_socket);
+			}
+		}
+
+		array_resize(server_sockets, 0, NULL);
+
+		if (_server_sockets.count == 0) {
+			log_error("Could not take over any of the %d server socket(s)",
+			          server_socket_count);
+
+			goto cleanup;
+		}
+	} else if (network_open_server_sockets() < 0) {
+		goto cleanup;
+	}
+
+	phase = 8;
+
 cleanup:
 	switch (phase) { // no breaks, all cases fall through intentionally
+	case 7:
+		trace_exit();
+
+	case 6:
+		metrics_exit();
+
+	case 5:
+		throttle_exit();
+
+	case 4:
+		inflight_exit();
+
+	case 3:
+		cache_exit();
+
 	case 2:
-		socket_destroy(_server_socket);
+		array_destroy(&_server_sockets, (FreeFunction)network_destroy_server_socket);
 
 	case 1:
 		array_destroy(&_clients, (FreeFunction)client_destroy);
@@ -190,7 +452,17 @@ cleanup:
 		break;
 	}
 
-	return phase == 3 ? 0 : -1;
+	return phase == 8 ? 0 : -1;
+}
+
+// releases all clients and server sockets without shutting down their
+// connections, because they were handed off to another brickd process
+void network_detach(void) {
+	log_debug("Detaching %d client(s) and %d server socket(s)",
+	          _clients.count, _server_sockets.count);
+
+	array_resize(&_clients, 0, (FreeFunction)client_detach);
+	array_resize(&_server_sockets, 0, (FreeFunction)network_detach_server_socket);
 }
 
 void network_exit(void) {
@@ -198,9 +470,21 @@ void network_exit(void) {
 
 	array_destroy(&_clients, (FreeFunction)client_destroy);
 
-	event_remove_source(_server_socket, EVENT_SOURCE_TYPE_GENERIC);
+	array_destroy(&_server_sockets, (FreeFunction)network_destroy_server_socket);
+
+	trace_exit();
+	metrics_exit();
+	throttle_exit();
+	inflight_exit();
+	cache_exit();
+}
 
-	socket_destroy(_server_socket);
+Array *network_get_clients(void) {
+	return &_clients;
+}
+
+Array *network_get_server_sockets(void) {
+	return &_server_sockets;
 }
 
 void network_client_disconnected(Client *client) {
@@ -208,8 +492,11 @@ void network_client_disconnected(Client *client) {
 
 	if (i < 0) {
 		log_error("Client (socket: %d, peer: %s) not found in client array",
-		          client->socket, client->peer);
+		          client->socket, client_get_peer_name(client));
 	} else {
+		inflight_remove_client(client);
+		usb_forget_owner(client);
+
 		array_remove(&_clients, i, (FreeFunction)client_destroy);
 	}
 }
@@ -222,12 +509,16 @@ void network_dispatch_packet(Packet *packet) {
 
 	if (_clients.count == 0) {
 		if (packet->header.sequence_number == 0) {
+			metrics_increment(METRIC_CALLBACKS_DROPPED);
+
 			log_debug("No clients connected, dropping %scallback (U: %u, L: %u, F: %u)",
 			          packet_get_callback_type(packet),
 			          packet->header.uid,
 			          packet->header.length,
 			          packet->header.function_id);
 		} else {
+			metrics_increment(METRIC_RESPONSES_DROPPED);
+
 			log_debug("No clients connected, dropping response (U: %u, L: %u, F: %u, S: %u, E: %u)",
 			          packet->header.uid,
 			          packet->header.length,
@@ -240,6 +531,18 @@ void network_dispatch_packet(Packet *packet) {
 	}
 
 	if (packet->header.sequence_number == 0) {
+		if (!throttle_allow_callback(packet)) {
+			metrics_increment(METRIC_CALLBACKS_HELD_BACK);
+
+			log_debug("Holding back %scallback (U: %u, L: %u, F: %u) due to throttling",
+			          packet_get_callback_type(packet),
+			          packet->header.uid,
+			          packet->header.length,
+			          packet->header.function_id);
+
+			return;
+		}
+
 		log_debug("Broadcasting %scallback (U: %u, L: %u, F: %u) to %d client(s)",
 		          packet_get_callback_type(packet),
 		          packet->header.uid,
@@ -253,6 +556,10 @@ void network_dispatch_packet(Packet *packet) {
 			client_dispatch_packet(client, packet, 1);
 		}
 	} else {
+		// responses for coalesced requests count as dispatched, even if the
+		// client that sent the forwarded request is already gone
+		dispatched = inflight_handle_response(packet) > 0;
+
 		log_debug("Dispatching response (U: %u, L: %u, F: %u, S: %u, E: %u) to %d client(s)",
 		          packet->header.uid,
 		          packet->header.length,
@@ -277,6 +584,8 @@ void network_dispatch_packet(Packet *packet) {
 			return;
 		}
 
+		metrics_increment(METRIC_RESPONSES_BROADCAST);
+
 		log_warn("Broadcasting response because no client has a matching pending request");
 
 		for (i = 0; i < _clients.count; ++i) {
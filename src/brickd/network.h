@@ -24,12 +24,20 @@
 
 #include "client.h"
 #include "packet.h"
+#include "utils.h"
 
-int network_init(void);
+int network_init(Array *server_sockets);
 void network_exit(void);
+void network_detach(void);
+
+Client *network_add_client(EventHandle socket, struct sockaddr *address,
+                           socklen_t length);
 
 void network_client_disconnected(Client *client);
 
 void network_dispatch_packet(Packet *packet);
 
+Array *network_get_clients(void);
+Array *network_get_server_sockets(void);
+
 #endif // BRICKD_NETWORK_H
@@ -30,6 +30,12 @@ int packet_header_is_valid_request(PacketHeader *header, const char **message) {
 		return 0;
 	}
 
+	if (header->length > (int)sizeof(Packet)) {
+		*message = "Length is too big";
+
+		return 0;
+	}
+
 	if (header->function_id == 0) {
 		*message = "Invalid function ID";
 
@@ -52,6 +58,12 @@ int packet_header_is_valid_response(PacketHeader *header, const char **message)
 		return 0;
 	}
 
+	if (header->length > (int)sizeof(Packet)) {
+		*message = "Length is too big";
+
+		return 0;
+	}
+
 	if (header->uid == 0) {
 		*message = "Invalid UID";
 
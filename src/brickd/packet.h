@@ -26,6 +26,10 @@
 
 #include "utils.h"
 
+enum {
+	FUNCTION_ENUMERATE = 254
+};
+
 enum {
 	CALLBACK_ENUMERATE = 253
 };
@@ -0,0 +1,635 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * replay.c: Deterministic replay of a packet capture
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * a packet trace with payload (see trace.c) doubles as capture file. the
+ * replay feeds its recorded client requests and Brick packets back into brickd
+ * on the original timeline, scaled by replay.speed. requests are sent over
+ * one loopback connection per captured client, so they take the same path
+ * through client_handle_receive as in production. all real and simulated
+ * Bricks are replaced by replayed Bricks that ignore requests and deliver the
+ * recorded responses and callbacks instead. packets that brickd sent itself
+ * are not replayed, brickd produces them again.
+ *
+ * if brickd doesn't keep up with the capture, the replay waits for it and the
+ * rest of the timeline is shifted. when all records are replayed brickd is
+ * stopped, so a replay can be run under a profiler.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "replay.h"
+
+#include "brick.h"
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "simulator.h"
+#include "socket.h"
+#include "trace.h"
+#include "usb.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_OTHER
+
+#define MAX_RECORDS_PER_BATCH 256 // at max speed, between event loop iterations
+#define STALL_DELAY 1000 // in microseconds
+#define DRAIN_DELAY 1000000 // in microseconds
+
+typedef struct {
+	uint64_t timestamp; // in microseconds, as captured
+	uint32_t endpoint;
+	uint8_t direction;
+	uint8_t length; // number of captured bytes
+	Packet packet;
+} ReplayRecord;
+
+typedef struct {
+	uint32_t endpoint; // captured client socket
+	int connected;
+	EventHandle socket;
+} ReplayClient;
+
+static Array _records = ARRAY_INITIALIZER;
+static Array _brick_endpoints = ARRAY_INITIALIZER;
+static Array _clients = ARRAY_INITIALIZER;
+static EventTimer _timer;
+static int _next_record = 0;
+static int _record_offset = 0; // bytes of the next record that were already sent
+static uint64_t _start = 0; // in microseconds, 0 means not started yet
+static uint64_t _finish = 0; // in microseconds, 0 means not finished yet
+static int _requests = 0;
+static int _brick_packets = 0;
+static int _skipped = 0;
+static int _stalls = 0;
+static uint64_t _bytes_received = 0;
+
+static int replay_load(const char *filename) {
+	int rc = -1;
+	FILE *file;
+	TraceFileHeader header;
+	uint8_t buffer[sizeof(TraceRecord) + TRACE_MAX_PAYLOAD_LENGTH];
+	TraceRecord *trace_record = (TraceRecord *)buffer;
+	ReplayRecord *record;
+	uint64_t count;
+	uint64_t i;
+	uint32_t index;
+	int k;
+	uint32_t *endpoint;
+
+	file = fopen(filename, "rb");
+
+	if (file == NULL) {
+		log_error("Could not open packet capture '%s': %s (%d)",
+		          filename, get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+	    memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+	    header.version < TRACE_MIN_VERSION || header.version > TRACE_VERSION ||
+	    header.record_count == 0 ||
+	    (header.record_count & (header.record_count - 1)) != 0) {
+		log_error("Packet capture '%s' is not a valid trace file", filename);
+
+		goto cleanup;
+	}
+
+	if (header.record_size != sizeof(buffer)) {
+		log_error("Packet capture '%s' contains no payload, record it with trace.payload enabled",
+		          filename);
+
+		goto cleanup;
+	}
+
+	if (header.version < 2) {
+		log_warn("Packet capture '%s' was recorded by an older brickd version that traced throttled requests repeatedly, if rate limiting was enabled then the replay sends them more than once",
+		         filename);
+	}
+
+	// the trace is a ring, if it wrapped then only the newest records are left
+	count = header.sequence;
+
+	if (count > header.record_count) {
+		count = header.record_count;
+	}
+
+	for (i = header.sequence - count; i < header.sequence; ++i) {
+		index = (uint32_t)i & (header.record_count - 1);
+
+		if (fseek(file, (long)(sizeof(TraceFileHeader) + (uint64_t)index * sizeof(buffer)), SEEK_SET) < 0 ||
+		    fread(buffer, sizeof(buffer), 1, file) != 1) {
+			log_error("Could not read record %u from packet capture '%s'",
+			          index, filename);
+
+			goto cleanup;
+		}
+
+		if (trace_record->direction != TRACE_DIRECTION_CLIENT_IN &&
+		    trace_record->direction != TRACE_DIRECTION_BRICK_IN) {
+			continue;
+		}
+
+		// a Brick packet with an invalid length was dropped by brickd,
+		// and it cannot be delivered by a replayed Brick either
+		if (trace_record->direction == TRACE_DIRECTION_BRICK_IN &&
+		    (trace_record->header.length < sizeof(PacketHeader) ||
+		     trace_record->header.length > sizeof(Packet))) {
+			++_skipped;
+
+			continue;
+		}
+
+		record = array_append(&_records);
+
+		if (record == NULL) {
+			log_error("Could not append to replay record array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+
+		if (trace_record->payload_length > TRACE_MAX_PAYLOAD_LENGTH) {
+			trace_record->payload_length = TRACE_MAX_PAYLOAD_LENGTH;
+		}
+
+		record->timestamp = trace_record->timestamp;
+		record->endpoint = trace_record->endpoint;
+		record->direction = trace_record->direction;
+		record->length = (uint8_t)(sizeof(PacketHeader) + trace_record->payload_length);
+
+		memcpy(&record->packet.header, &trace_record->header, sizeof(PacketHeader));
+		memcpy(record->packet.payload, trace_record + 1, trace_record->payload_length);
+
+		if (record->direction != TRACE_DIRECTION_BRICK_IN) {
+			continue;
+		}
+
+		for (k = 0; k < _brick_endpoints.count; ++k) {
+			if (*(uint32_t *)array_get(&_brick_endpoints, k) == record->endpoint) {
+				break;
+			}
+		}
+
+		if (k < _brick_endpoints.count) {
+			continue;
+		}
+
+		endpoint = array_append(&_brick_endpoints);
+
+		if (endpoint == NULL) {
+			log_error("Could not append to replay Brick array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+
+		*endpoint = record->endpoint;
+	}
+
+	rc = 0;
+
+cleanup:
+	fclose(file);
+
+	return rc;
+}
+
+static void replay_disconnect_client(ReplayClient *client) {
+	event_remove_source(client->socket, EVENT_SOURCE_TYPE_GENERIC);
+	socket_destroy(client->socket);
+
+	client->connected = 0;
+}
+
+// responses and callbacks for the replayed clients are counted and discarded
+static void replay_handle_receive(void *opaque) {
+	ReplayClient *client = opaque;
+	uint8_t buffer[4096];
+	int length;
+
+	length = socket_receive(client->socket, buffer, sizeof(buffer));
+
+	if (length < 0) {
+		if (errno_interrupted() || errno_would_block()) {
+			return;
+		}
+
+		log_warn("Could not receive from replayed client (endpoint: %u): %s (%d)",
+		         client->endpoint, get_errno_name(errno), errno);
+
+		replay_disconnect_client(client);
+
+		return;
+	}
+
+	if (length == 0) {
+		log_warn("Replayed client (endpoint: %u) was disconnected by brickd",
+		         client->endpoint);
+
+		replay_disconnect_client(client);
+
+		return;
+	}
+
+	_bytes_received += length;
+}
+
+static int replay_connect_client(ReplayClient *client) {
+	int phase = 0;
+	const char *address = *(const char **)array_get(config_get_listen_addresses(), 0);
+	uint16_t port = config_get_listen_port();
+	struct addrinfo *resolved;
+
+	// connect to the wildcard address via loopback
+	if (strcmp(address, "0.0.0.0") == 0) {
+		address = "127.0.0.1";
+	} else if (strcmp(address, "::") == 0) {
+		address = "::1";
+	}
+
+	resolved = resolve_listen_address(address, port);
+
+	if (resolved == NULL) {
+		log_error("Could not resolve replay address '%s' (port: %u): %s (%d)",
+		          address, port, get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	if (socket_create(&client->socket, resolved->ai_family,
+	                  resolved->ai_socktype, resolved->ai_protocol) < 0) {
+		log_error("Could not create replay socket: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	// the connect completes before brickd accepts the connection, because the
+	// listen backlog holds it. therefore a blocking connect is fine here
+	if (socket_connect(client->socket, resolved->ai_addr,
+	                   resolved->ai_addrlen) < 0) {
+		log_error("Could not connect replay socket to '%s' (port: %u): %s (%d)",
+		          address, port, get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (socket_set_non_blocking(client->socket, 1) < 0) {
+		log_error("Could not enable non-blocking mode for replay socket: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	if (event_add_source(client->socket, EVENT_SOURCE_TYPE_GENERIC, EVENT_READ,
+	                     replay_handle_receive, client) < 0) {
+		goto cleanup;
+	}
+
+	client->connected = 1;
+
+	log_debug("Connected replayed client (endpoint: %u)", client->endpoint);
+
+	phase = 3;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 2:
+		socket_destroy(client->socket);
+
+	default:
+		break;
+	}
+
+	if (phase > 0) {
+		freeaddrinfo(resolved);
+	}
+
+	return phase == 3 ? 0 : -1;
+}
+
+// returns -1 if brickd cannot take the request right now
+static int replay_send_request(ReplayRecord *record) {
+	ReplayClient *client = NULL;
+	int i;
+	int length;
+
+	for (i = 0; i < _clients.count; ++i) {
+		client = array_get(&_clients, i);
+
+		if (client->endpoint == record->endpoint) {
+			break;
+		}
+	}
+
+	if (i == _clients.count) {
+		client = array_append(&_clients);
+
+		if (client == NULL) {
+			log_error("Could not append to replay client array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			++_skipped;
+
+			return 0;
+		}
+
+		client->endpoint = record->endpoint;
+		client->connected = 0;
+	}
+
+	// a client that got disconnected by brickd reconnects, as a real one would
+	if (!client->connected && replay_connect_client(client) < 0) {
+		++_skipped;
+
+		return 0;
+	}
+
+	length = socket_send(client->socket, (uint8_t *)&record->packet + _record_offset,
+	                     record->length - _record_offset);
+
+	if (length < 0) {
+		if (errno_interrupted() || errno_would_block()) {
+			return -1;
+		}
+
+		log_warn("Could not send to replayed client (endpoint: %u): %s (%d)",
+		         client->endpoint, get_errno_name(errno), errno);
+
+		replay_disconnect_client(client);
+
+		_record_offset = 0;
+		++_skipped;
+
+		return 0;
+	}
+
+	_record_offset += length;
+
+	if (_record_offset < record->length) {
+		return -1;
+	}
+
+	_record_offset = 0;
+	++_requests;
+
+	return 0;
+}
+
+// returns -1 if the replayed Brick cannot take the packet right now
+static int replay_deliver_packet(ReplayRecord *record) {
+	Array *bricks = usb_get_bricks();
+	BrickBackend *backend = simulator_get_replay_backend();
+	Brick *brick;
+	int i;
+
+	for (i = 0; i < bricks->count; ++i) {
+		brick = array_get(bricks, i);
+
+		if (brick->backend == backend &&
+		    TRACE_BRICK_ENDPOINT(brick->bus_number, brick->device_address) == record->endpoint) {
+			if (simulator_replay_packet(brick, &record->packet) < 0) {
+				return -1;
+			}
+
+			++_brick_packets;
+
+			return 0;
+		}
+	}
+
+	// the replayed Brick could not be created
+	++_skipped;
+
+	return 0;
+}
+
+static void replay_handle_timer(void *opaque) {
+	uint64_t now = microseconds();
+	uint64_t due;
+	uint64_t first_timestamp;
+	uint64_t last_timestamp;
+	int speed = config_get_replay_speed();
+	int count = 0;
+	int requests = 0;
+	ReplayRecord *record;
+	int rc;
+
+	(void)opaque;
+
+	if (_finish != 0) {
+		log_info("Stopping after replay");
+
+		event_stop();
+
+		return;
+	}
+
+	if (_records.count == 0) {
+		_finish = now;
+
+		log_info("Packet capture contains nothing to replay");
+
+		event_start_timer(&_timer, DRAIN_DELAY, 0);
+
+		return;
+	}
+
+	first_timestamp = ((ReplayRecord *)array_get(&_records, 0))->timestamp;
+
+	if (_start == 0) {
+		_start = now;
+
+		log_info("Starting replay of %d record(s) at %d%% speed",
+		         _records.count, speed);
+	}
+
+	while (_next_record < _records.count) {
+		record = array_get(&_records, _next_record);
+
+		if (speed > 0) {
+			due = _start + (record->timestamp - first_timestamp) * 100 / speed;
+
+			if (due > now) {
+				event_start_timer(&_timer, due - now, 0);
+
+				return;
+			}
+		} else if (count >= MAX_RECORDS_PER_BATCH ||
+		           (requests > 0 && record->direction == TRACE_DIRECTION_BRICK_IN)) {
+			// let the event loop handle clients and Bricks in between. this
+			// also lets brickd receive the requests sent so far, before the
+			// Brick packets that answer them are delivered
+			event_start_timer(&_timer, 0, 0);
+
+			return;
+		}
+
+		if (record->direction == TRACE_DIRECTION_CLIENT_IN) {
+			rc = replay_send_request(record);
+			++requests;
+		} else {
+			rc = replay_deliver_packet(record);
+		}
+
+		if (rc < 0) {
+			// brickd doesn't keep up, wait for it
+			++_stalls;
+
+			event_start_timer(&_timer, STALL_DELAY, 0);
+
+			return;
+		}
+
+		++_next_record;
+		++count;
+	}
+
+	_finish = microseconds();
+	last_timestamp = ((ReplayRecord *)array_get(&_records, _records.count - 1))->timestamp;
+
+	log_info("Replayed %d request(s) and %d Brick packet(s) in %u msec (captured: %u msec, stalls: %d, skipped: %d, received: %u bytes)",
+	         _requests, _brick_packets, (uint32_t)((_finish - _start) / 1000),
+	         (uint32_t)((last_timestamp - first_timestamp) / 1000), _stalls,
+	         _skipped, (uint32_t)_bytes_received);
+
+	// give brickd some time to send the last responses
+	event_start_timer(&_timer, DRAIN_DELAY, 0);
+}
+
+int replay_init(void) {
+	int phase = 0;
+	const char *filename = config_get_replay_file();
+
+	if (*filename == '\0') {
+		log_debug("Packet replay is disabled");
+
+		return 0;
+	}
+
+	log_debug("Initializing packet replay");
+
+	if (strcmp(filename, config_get_trace_file()) == 0) {
+		log_error("Cannot replay packet capture '%s' while tracing to it",
+		          filename);
+
+		goto cleanup;
+	}
+
+	if (array_create(&_records, 1024, sizeof(ReplayRecord), 1) < 0) {
+		log_error("Could not create replay record array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	if (array_create(&_brick_endpoints, 8, sizeof(uint32_t), 1) < 0) {
+		log_error("Could not create replay Brick array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	// the ReplayClient struct is not relocatable, because it is passed by
+	// reference as opaque parameter to the event subsystem
+	if (array_create(&_clients, 32, sizeof(ReplayClient), 0) < 0) {
+		log_error("Could not create replay client array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 3;
+
+	if (replay_load(filename) < 0) {
+		goto cleanup;
+	}
+
+	if (event_add_timer(&_timer, replay_handle_timer, NULL) < 0) {
+		goto cleanup;
+	}
+
+	// the timer first fires in the event loop, after the network is ready
+	event_start_timer(&_timer, 0, 0);
+
+	log_info("Replaying packet capture '%s' (records: %d, Bricks: %d, speed: %d%%)",
+	         filename, _records.count, _brick_endpoints.count,
+	         config_get_replay_speed());
+
+	phase = 4;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 3:
+		array_destroy(&_clients, NULL);
+
+	case 2:
+		array_destroy(&_brick_endpoints, NULL);
+
+	case 1:
+		array_destroy(&_records, NULL);
+
+	default:
+		break;
+	}
+
+	return phase == 4 ? 0 : -1;
+}
+
+static void replay_destroy_client(ReplayClient *client) {
+	if (client->connected) {
+		replay_disconnect_client(client);
+	}
+}
+
+void replay_exit(void) {
+	if (*config_get_replay_file() == '\0') {
+		return;
+	}
+
+	log_debug("Shutting down packet replay");
+
+	event_remove_timer(&_timer);
+
+	array_destroy(&_clients, (FreeFunction)replay_destroy_client);
+	array_destroy(&_brick_endpoints, NULL);
+	array_destroy(&_records, NULL);
+}
+
+// returns NULL if the replay is disabled
+Array *replay_get_brick_endpoints(void) {
+	if (*config_get_replay_file() == '\0') {
+		return NULL;
+	}
+
+	return &_brick_endpoints;
+}
@@ -0,0 +1,571 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * simulator.c: Simulated Bricks for hardware-free load testing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * the simulator backend emulates a stack of a Brick and its Bricklets behind
+ * a virtual USB device. it works on the transfer level: submitted write
+ * transfers are parsed as requests, responses and callbacks are queued with
+ * the configured latency and handed to submitted read transfers. transfers
+ * are completed from an event timer, never from within the submit call, just
+ * like libusb completes them from the event loop. like a real Brick the
+ * simulated stack can only buffer a limited number of packets, if brickd
+ * doesn't read them fast enough then callbacks get lost.
+ *
+ * stack N (starting at 0) has simulator.devices devices. device K has UID
+ * simulator.first_uid + N * simulator.devices + K. device 0 is the Brick, all
+ * other devices are Bricklets connected to it. requests that expect a response
+ * are answered with a 4 byte counter value if they have no payload (getters)
+ * or with an empty response otherwise (setters).
+ *
+ * the replay backend uses the same stacks in a passive mode: they have no
+ * devices of their own, ignore all requests and only deliver the packets
+ * that the replay hands to them.
+ */
+
+#include <errno.h>
+#include <libusb.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simulator.h"
+
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "transfer.h"
+#include "utils.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_USB
+
+#define MAX_QUEUED_PACKETS 256
+#define CALLBACK_FUNCTION_ID 64
+#define DEVICE_IDENTIFIER_BRICK 13 // Master Brick
+#define DEVICE_IDENTIFIER_BRICKLET 216 // Temperature Bricklet
+#define ERROR_CODE_FUNCTION_NOT_SUPPORTED 2
+
+typedef struct {
+	uint64_t due; // in microseconds
+	Packet packet;
+} SimulatedPacket;
+
+typedef struct {
+	Brick *brick;
+	int replayed; // packets come from simulator_replay_packet only
+	uint32_t first_uid;
+	int device_count;
+	uint32_t random_state;
+	uint32_t counter;
+	int next_callback_device;
+	uint64_t next_callback; // in microseconds, 0 means disabled
+	uint64_t callback_interval; // in microseconds
+	Array read_transfers; // submitted read transfers, stores Transfer pointers
+	Array write_transfers; // submitted write transfers, stores Transfer pointers
+	Array packets; // responses and callbacks waiting for a read transfer
+	EventTimer timer;
+} SimulatedStack;
+
+// xorshift, seeded per stack to make error injection reproducible
+static uint32_t simulator_random(SimulatedStack *stack) {
+	stack->random_state ^= stack->random_state << 13;
+	stack->random_state ^= stack->random_state >> 17;
+	stack->random_state ^= stack->random_state << 5;
+
+	return stack->random_state;
+}
+
+static int simulator_inject(SimulatedStack *stack, int percent) {
+	return percent > 0 && (int)(simulator_random(stack) % 100) < percent;
+}
+
+static int simulator_queue_packet(SimulatedStack *stack, Packet *packet,
+                                  uint64_t due) {
+	SimulatedPacket *simulated_packet;
+
+	if (stack->packets.count >= MAX_QUEUED_PACKETS) {
+		log_debug("%s [%s] is full, dropping packet (U: %u, L: %u, F: %u, S: %u)",
+		          stack->brick->product, stack->brick->serial_number,
+		          packet->header.uid, packet->header.length,
+		          packet->header.function_id, packet->header.sequence_number);
+
+		return -1;
+	}
+
+	simulated_packet = array_append(&stack->packets);
+
+	if (simulated_packet == NULL) {
+		log_error("Could not append to simulated packet array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	simulated_packet->due = due;
+
+	memcpy(&simulated_packet->packet, packet, packet->header.length);
+
+	return 0;
+}
+
+static void simulator_queue_enumerate_callback(SimulatedStack *stack, int device,
+                                               uint8_t enumeration_type,
+                                               uint64_t due) {
+	EnumerateCallback enumerate_callback;
+
+	memset(&enumerate_callback, 0, sizeof(enumerate_callback));
+
+	enumerate_callback.header.uid = stack->first_uid + device;
+	enumerate_callback.header.length = sizeof(enumerate_callback);
+	enumerate_callback.header.function_id = CALLBACK_ENUMERATE;
+	enumerate_callback.header.sequence_number = 0;
+	enumerate_callback.header.response_expected = 1;
+
+	base58_encode(enumerate_callback.uid, stack->first_uid + device);
+
+	if (device == 0) {
+		enumerate_callback.connected_uid[0] = '0';
+		enumerate_callback.position = '0';
+		enumerate_callback.device_identifier = DEVICE_IDENTIFIER_BRICK;
+	} else {
+		base58_encode(enumerate_callback.connected_uid, stack->first_uid);
+		enumerate_callback.position = 'a' + (device - 1) % 4;
+		enumerate_callback.device_identifier = DEVICE_IDENTIFIER_BRICKLET;
+	}
+
+	enumerate_callback.hardware_version[0] = 1;
+	enumerate_callback.firmware_version[0] = 2;
+	enumerate_callback.enumeration_type = enumeration_type;
+
+	simulator_queue_packet(stack, (Packet *)&enumerate_callback, due);
+}
+
+static void simulator_handle_request(SimulatedStack *stack, Packet *request) {
+	uint64_t due = microseconds() + config_get_simulator_response_latency();
+	Packet response;
+	int i;
+
+	if (stack->replayed) {
+		return;
+	}
+
+	if (request->header.uid == 0) {
+		if (request->header.function_id == FUNCTION_ENUMERATE) {
+			for (i = 0; i < stack->device_count; ++i) {
+				simulator_queue_enumerate_callback(stack, i,
+				                                   ENUMERATION_TYPE_AVAILABLE,
+				                                   due);
+			}
+		}
+
+		return;
+	}
+
+	// a real stack ignores requests for unknown UIDs
+	if (request->header.uid < stack->first_uid ||
+	    request->header.uid >= stack->first_uid + stack->device_count ||
+	    !request->header.response_expected) {
+		return;
+	}
+
+	if (simulator_inject(stack, config_get_simulator_drop_rate())) {
+		log_debug("%s [%s] drops response (U: %u, F: %u, S: %u)",
+		          stack->brick->product, stack->brick->serial_number,
+		          request->header.uid, request->header.function_id,
+		          request->header.sequence_number);
+
+		return;
+	}
+
+	memcpy(&response.header, &request->header, sizeof(PacketHeader));
+
+	response.header.length = sizeof(PacketHeader);
+
+	if (simulator_inject(stack, config_get_simulator_error_rate())) {
+		response.header.error_code = ERROR_CODE_FUNCTION_NOT_SUPPORTED;
+	} else if (request->header.length == sizeof(PacketHeader)) {
+		++stack->counter;
+
+		memcpy(response.payload, &stack->counter, sizeof(stack->counter));
+
+		response.header.length += sizeof(stack->counter);
+	}
+
+	simulator_queue_packet(stack, &response, due);
+}
+
+static void simulator_generate_callbacks(SimulatedStack *stack, uint64_t now) {
+	Packet callback;
+	int count = 0;
+
+	while (stack->next_callback <= now) {
+		if (count++ >= MAX_QUEUED_PACKETS) {
+			// the event loop was blocked for a long time, skip missed callbacks
+			stack->next_callback = now + stack->callback_interval;
+
+			break;
+		}
+
+		memset(&callback.header, 0, sizeof(callback.header));
+
+		callback.header.uid = stack->first_uid + stack->next_callback_device;
+		callback.header.length = sizeof(PacketHeader) + sizeof(stack->counter);
+		callback.header.function_id = CALLBACK_FUNCTION_ID;
+		callback.header.sequence_number = 0;
+		callback.header.response_expected = 1;
+
+		++stack->counter;
+
+		memcpy(callback.payload, &stack->counter, sizeof(stack->counter));
+
+		simulator_queue_packet(stack, &callback, now);
+
+		stack->next_callback_device = (stack->next_callback_device + 1) % stack->device_count;
+		stack->next_callback += stack->callback_interval;
+	}
+}
+
+static void simulator_complete_transfer(Transfer *transfer,
+                                        enum libusb_transfer_status status,
+                                        int length) {
+	transfer->handle->status = status;
+	transfer->handle->actual_length = length;
+
+	transfer->handle->callback(transfer->handle);
+}
+
+static Transfer *simulator_pop_transfer(Array *transfers) {
+	Transfer *transfer = *(Transfer **)array_get(transfers, 0);
+
+	array_remove(transfers, 0, NULL);
+
+	return transfer;
+}
+
+static void simulator_schedule(SimulatedStack *stack) {
+	uint64_t deadline = 0;
+	uint64_t now = microseconds();
+	SimulatedPacket *simulated_packet;
+
+	if (stack->write_transfers.count > 0) {
+		deadline = now;
+	} else {
+		if (stack->packets.count > 0 && stack->read_transfers.count > 0) {
+			simulated_packet = array_get(&stack->packets, 0);
+			deadline = simulated_packet->due;
+		}
+
+		if (stack->next_callback != 0 &&
+		    (deadline == 0 || stack->next_callback < deadline)) {
+			deadline = stack->next_callback;
+		}
+	}
+
+	if (deadline == 0) {
+		event_stop_timer(&stack->timer);
+	} else {
+		event_start_timer(&stack->timer, deadline > now ? deadline - now : 0, 0);
+	}
+}
+
+static void simulator_handle_timer(void *opaque) {
+	SimulatedStack *stack = opaque;
+	uint64_t now = microseconds();
+	int count;
+	Transfer *transfer;
+	SimulatedPacket *simulated_packet;
+	int transfer_error_rate = 0;
+
+	// replayed stacks don't inject errors, to keep the replay deterministic
+	if (!stack->replayed) {
+		transfer_error_rate = config_get_simulator_transfer_error_rate();
+	}
+
+	// completing a write transfer can submit the next queued request, only
+	// complete the write transfers that were already submitted
+	for (count = stack->write_transfers.count; count > 0; --count) {
+		transfer = simulator_pop_transfer(&stack->write_transfers);
+
+		if (simulator_inject(stack, transfer_error_rate)) {
+			simulator_complete_transfer(transfer, LIBUSB_TRANSFER_ERROR, 0);
+		} else {
+			simulator_complete_transfer(transfer, LIBUSB_TRANSFER_COMPLETED,
+			                            transfer->handle->length);
+		}
+	}
+
+	if (stack->next_callback != 0) {
+		simulator_generate_callbacks(stack, now);
+	}
+
+	while (stack->packets.count > 0 && stack->read_transfers.count > 0) {
+		simulated_packet = array_get(&stack->packets, 0);
+
+		if (simulated_packet->due > now) {
+			break;
+		}
+
+		transfer = simulator_pop_transfer(&stack->read_transfers);
+
+		memcpy(&transfer->packet, &simulated_packet->packet,
+		       simulated_packet->packet.header.length);
+
+		array_remove(&stack->packets, 0, NULL);
+
+		if (simulator_inject(stack, transfer_error_rate)) {
+			simulator_complete_transfer(transfer, LIBUSB_TRANSFER_ERROR, 0);
+		} else {
+			simulator_complete_transfer(transfer, LIBUSB_TRANSFER_COMPLETED,
+			                            transfer->packet.header.length);
+		}
+	}
+
+	simulator_schedule(stack);
+}
+
+static int simulator_open_stack(Brick *brick, int replayed) {
+	int phase = 0;
+	SimulatedStack *stack;
+	int index = brick->device_address - 1;
+	int callback_rate = replayed ? 0 : config_get_simulator_callback_rate();
+	uint64_t now = microseconds();
+	int i;
+
+	stack = calloc(1, sizeof(SimulatedStack));
+
+	if (stack == NULL) {
+		log_error("Could not allocate simulated stack: %s (%d)",
+		          get_errno_name(ENOMEM), ENOMEM);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	stack->brick = brick;
+	stack->replayed = replayed;
+	stack->device_count = replayed ? 0 : config_get_simulator_devices();
+	stack->first_uid = (uint32_t)config_get_simulator_first_uid() +
+	                   (uint32_t)index * stack->device_count;
+	stack->random_state = 2463534242U + index;
+
+	if (callback_rate > 0) {
+		stack->callback_interval = 1000000 / ((uint64_t)callback_rate * stack->device_count);
+
+		if (stack->callback_interval == 0) {
+			stack->callback_interval = 1;
+		}
+
+		stack->next_callback = now + stack->callback_interval;
+	}
+
+	if (array_create(&stack->read_transfers, 8, sizeof(Transfer *), 1) < 0) {
+		log_error("Could not create simulated read transfer array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	if (array_create(&stack->write_transfers, 8, sizeof(Transfer *), 1) < 0) {
+		log_error("Could not create simulated write transfer array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 3;
+
+	if (array_create(&stack->packets, 32, sizeof(SimulatedPacket), 1) < 0) {
+		log_error("Could not create simulated packet array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 4;
+
+	if (event_add_timer(&stack->timer, simulator_handle_timer, stack) < 0) {
+		goto cleanup;
+	}
+
+	phase = 5;
+
+	if (replayed) {
+		strcpy(brick->product, "Replayed Brick");
+		base58_encode(brick->serial_number,
+		              ((uint32_t)brick->bus_number << 8) | brick->device_address);
+	} else {
+		strcpy(brick->product, "Simulated Brick");
+		base58_encode(brick->serial_number, stack->first_uid);
+	}
+
+	// a stack that just got powered up announces all its devices
+	for (i = 0; i < stack->device_count; ++i) {
+		simulator_queue_enumerate_callback(stack, i, ENUMERATION_TYPE_CONNECTED,
+		                                   now);
+	}
+
+	brick->opaque = stack;
+
+	simulator_schedule(stack);
+
+	if (!replayed) {
+		log_info("Simulating stack with %d device(s) (UIDs: %u to %u, latency: %d usec, callback rate: %d Hz)",
+		         stack->device_count, stack->first_uid,
+		         stack->first_uid + stack->device_count - 1,
+		         config_get_simulator_response_latency(), callback_rate);
+	}
+
+	phase = 6;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 5:
+		event_remove_timer(&stack->timer);
+
+	case 4:
+		array_destroy(&stack->packets, NULL);
+
+	case 3:
+		array_destroy(&stack->write_transfers, NULL);
+
+	case 2:
+		array_destroy(&stack->read_transfers, NULL);
+
+	case 1:
+		free(stack);
+
+	default:
+		break;
+	}
+
+	return phase == 6 ? 0 : -1;
+}
+
+static int simulator_open_brick(Brick *brick) {
+	return simulator_open_stack(brick, 0);
+}
+
+static int simulator_open_replayed_brick(Brick *brick) {
+	return simulator_open_stack(brick, 1);
+}
+
+static void simulator_close_brick(Brick *brick) {
+	SimulatedStack *stack = brick->opaque;
+
+	event_remove_timer(&stack->timer);
+
+	array_destroy(&stack->packets, NULL);
+	array_destroy(&stack->write_transfers, NULL);
+	array_destroy(&stack->read_transfers, NULL);
+
+	free(stack);
+
+	brick->opaque = NULL;
+}
+
+static int simulator_submit_transfer(Transfer *transfer) {
+	SimulatedStack *stack = transfer->brick->opaque;
+	Transfer **transfer_pointer;
+
+	if (transfer->type == TRANSFER_TYPE_WRITE) {
+		simulator_handle_request(stack, &transfer->packet);
+
+		transfer_pointer = array_append(&stack->write_transfers);
+	} else {
+		transfer_pointer = array_append(&stack->read_transfers);
+	}
+
+	if (transfer_pointer == NULL) {
+		log_error("Could not append to simulated transfer array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	*transfer_pointer = transfer;
+
+	simulator_schedule(stack);
+
+	return 0;
+}
+
+static int simulator_cancel_transfer(Transfer *transfer) {
+	SimulatedStack *stack = transfer->brick->opaque;
+	Array *transfers;
+	int i;
+
+	if (transfer->type == TRANSFER_TYPE_WRITE) {
+		transfers = &stack->write_transfers;
+	} else {
+		transfers = &stack->read_transfers;
+	}
+
+	for (i = 0; i < transfers->count; ++i) {
+		if (*(Transfer **)array_get(transfers, i) == transfer) {
+			array_remove(transfers, i, NULL);
+
+			simulator_complete_transfer(transfer, LIBUSB_TRANSFER_CANCELLED, 0);
+
+			return 0;
+		}
+	}
+
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+static BrickBackend _simulator_backend = {
+	"simulated",
+	simulator_open_brick,
+	simulator_close_brick,
+	simulator_submit_transfer,
+	simulator_cancel_transfer
+};
+
+static BrickBackend _replay_backend = {
+	"replayed",
+	simulator_open_replayed_brick,
+	simulator_close_brick,
+	simulator_submit_transfer,
+	simulator_cancel_transfer
+};
+
+BrickBackend *simulator_get_backend(void) {
+	return &_simulator_backend;
+}
+
+BrickBackend *simulator_get_replay_backend(void) {
+	return &_replay_backend;
+}
+
+// hands a packet to a replayed Brick for immediate delivery. returns -1 if the
+// stack is full, the packet should be retried later then
+int simulator_replay_packet(Brick *brick, Packet *packet) {
+	SimulatedStack *stack = brick->opaque;
+
+	if (simulator_queue_packet(stack, packet, microseconds()) < 0) {
+		return -1;
+	}
+
+	simulator_schedule(stack);
+
+	return 0;
+}
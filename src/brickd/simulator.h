@@ -0,0 +1,35 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * simulator.h: Simulated Bricks for hardware-free load testing
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_SIMULATOR_H
+#define BRICKD_SIMULATOR_H
+
+#include "brick.h"
+
+// real USB bus numbers start at 1, simulated stack N is device N on bus 0
+#define SIMULATOR_BUS_NUMBER 0
+
+BrickBackend *simulator_get_backend(void);
+BrickBackend *simulator_get_replay_backend(void);
+
+int simulator_replay_packet(Brick *brick, Packet *packet);
+
+#endif // BRICKD_SIMULATOR_H
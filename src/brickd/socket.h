@@ -22,9 +22,11 @@
 #ifndef BRICKD_SOCKET_H
 #define BRICKD_SOCKET_H
 
+#include <stdint.h>
 #ifdef _WIN32
-	#include <ws2tcpip.h> // for socklen_t
+	#include <ws2tcpip.h> // for socklen_t and struct addrinfo
 #else
+	#include <netdb.h>
 	#include <netinet/in.h>
 #endif
 
@@ -32,19 +34,24 @@
 
 int socket_create(EventHandle *handle, int domain, int type, int protocol);
 void socket_destroy(EventHandle handle);
+void socket_close(EventHandle handle);
 
 int socket_bind(EventHandle handle, const struct sockaddr *address,
                 socklen_t length);
 int socket_listen(EventHandle handle, int backlog);
 int socket_accept(EventHandle handle, EventHandle *accepted_handle,
                   struct sockaddr *address, socklen_t *length);
+int socket_connect(EventHandle handle, struct sockaddr *address,
+                   socklen_t length);
 
 int socket_receive(EventHandle handle, void *buffer, int length);
 int socket_send(EventHandle handle, void *buffer, int length);
 
 int socket_set_non_blocking(EventHandle handle, int non_blocking);
 int socket_set_address_reuse(EventHandle handle, int address_reuse);
+int socket_set_dual_stack(EventHandle handle, int dual_stack);
 
-char *resolve_address(struct sockaddr_in *address, socklen_t length);
+char *resolve_address(struct sockaddr *address, socklen_t length);
+struct addrinfo *resolve_listen_address(const char *address, uint16_t port);
 
 #endif // BRICKD_SOCKET_H
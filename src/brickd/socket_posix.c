@@ -19,10 +19,15 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#ifdef __linux__
+	#define _GNU_SOURCE // for accept4
+#endif
+
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -61,6 +66,12 @@ void socket_destroy(EventHandle handle) {
 	close(handle);
 }
 
+// closes the handle without shutting down the connection, another process
+// might still use the socket
+void socket_close(EventHandle handle) {
+	close(handle);
+}
+
 // sets errno on error
 int socket_bind(EventHandle handle, const struct sockaddr *address,
                 socklen_t length) {
@@ -72,12 +83,50 @@ int socket_listen(EventHandle handle, int backlog) {
 	return listen(handle, backlog);
 }
 
-// sets errno on error
+// sets errno on error. the accepted socket is in non-blocking mode
 int socket_accept(EventHandle handle, EventHandle *accepted_handle,
                   struct sockaddr *address, socklen_t *length) {
+	int saved_errno;
+
+#if defined __linux__ && defined SOCK_NONBLOCK && defined SOCK_CLOEXEC
+	// set both flags as part of the accept call to save two fcntl calls
+	*accepted_handle = accept4(handle, address, length,
+	                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+	if (*accepted_handle >= 0) {
+		return 0;
+	}
+
+	if (errno != ENOSYS) {
+		return -1;
+	}
+#endif
+
 	*accepted_handle = accept(handle, address, length);
 
-	return *accepted_handle < 0 ? -1 : 0;
+	if (*accepted_handle < 0) {
+		return -1;
+	}
+
+	if (socket_set_non_blocking(*accepted_handle, 1) < 0) {
+		saved_errno = errno;
+
+		close(*accepted_handle);
+
+		errno = saved_errno;
+
+		return -1;
+	}
+
+	fcntl(*accepted_handle, F_SETFD, FD_CLOEXEC);
+
+	return 0;
+}
+
+// sets errno on error
+int socket_connect(EventHandle handle, struct sockaddr *address,
+                   socklen_t length) {
+	return connect(handle, address, length);
 }
 
 // sets errno on error
@@ -114,12 +163,20 @@ int socket_set_address_reuse(EventHandle handle, int address_reuse) {
 }
 
 // sets errno on error
-char *resolve_address(struct sockaddr_in *address, socklen_t length) {
+int socket_set_dual_stack(EventHandle handle, int dual_stack) {
+	int v6only = dual_stack ? 0 : 1;
+
+	return setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY,
+	                  &v6only, sizeof(v6only));
+}
+
+// sets errno on error
+char *resolve_address(struct sockaddr *address, socklen_t length) {
 	int rc;
 	char buffer[NI_MAXHOST];
 	char *name;
 
-	rc = getnameinfo((struct sockaddr *)address, length, buffer, NI_MAXHOST,
+	rc = getnameinfo(address, length, buffer, NI_MAXHOST,
 	                 NULL, 0, NI_NUMERICHOST);
 
 	if (rc != 0) {
@@ -142,3 +199,35 @@ char *resolve_address(struct sockaddr_in *address, socklen_t length) {
 
 	return name;
 }
+
+// sets errno on error
+struct addrinfo *resolve_listen_address(const char *address, uint16_t port) {
+	char port_str[16];
+	struct addrinfo hints;
+	struct addrinfo *resolved = NULL;
+	int rc;
+
+	snprintf(port_str, sizeof(port_str), "%u", port);
+
+	memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+	rc = getaddrinfo(address, port_str, &hints, &resolved);
+
+	if (rc != 0) {
+		if (rc != EAI_SYSTEM) {
+#if EAI_AGAIN < 0
+			errno = ERRNO_ADDRINFO_OFFSET - rc;
+#else
+			errno = ERRNO_ADDRINFO_OFFSET + rc;
+#endif
+		}
+
+		return NULL;
+	}
+
+	return resolved;
+}
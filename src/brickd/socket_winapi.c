@@ -20,7 +20,10 @@
  */
 
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
 #include <winsock2.h>
+#include <ws2tcpip.h>
 
 #include "socket.h"
 
@@ -55,6 +58,12 @@ void socket_destroy(EventHandle handle) {
 	closesocket(handle);
 }
 
+// closes the handle without shutting down the connection, another process
+// might still use the socket
+void socket_close(EventHandle handle) {
+	closesocket(handle);
+}
+
 // sets errno on error
 int socket_bind(EventHandle handle, const struct sockaddr *address,
                 socklen_t length) {
@@ -80,9 +89,11 @@ int socket_listen(EventHandle handle, int backlog) {
 	return rc;
 }
 
-// sets errno on error
+// sets errno on error. the accepted socket is in non-blocking mode
 int socket_accept(EventHandle handle, EventHandle *accepted_handle,
                   struct sockaddr *address, socklen_t *length) {
+	int saved_errno;
+
 	*accepted_handle = accept(handle, address, length);
 
 	if (*accepted_handle == INVALID_SOCKET) {
@@ -91,9 +102,32 @@ int socket_accept(EventHandle handle, EventHandle *accepted_handle,
 		return -1;
 	}
 
+	if (socket_set_non_blocking(*accepted_handle, 1) < 0) {
+		saved_errno = errno;
+
+		closesocket(*accepted_handle);
+
+		errno = saved_errno;
+
+		return -1;
+	}
+
 	return 0;
 }
 
+// sets errno on error
+int socket_connect(EventHandle handle, struct sockaddr *address,
+                   socklen_t length) {
+	int rc = connect(handle, address, length);
+
+	if (rc == SOCKET_ERROR) {
+		rc = -1;
+		errno = ERRNO_WINAPI_OFFSET + WSAGetLastError();
+	}
+
+	return rc;
+}
+
 // sets errno on error
 int socket_receive(EventHandle handle, void *buffer, int length) {
 	length = recv(handle, (char *)buffer, length, 0);
@@ -146,11 +180,25 @@ int socket_set_address_reuse(EventHandle handle, int address_reuse) {
 }
 
 // sets errno on error
-char *resolve_address(struct sockaddr_in *address, socklen_t length) {
+int socket_set_dual_stack(EventHandle handle, int dual_stack) {
+	DWORD argument = dual_stack ? 0 : 1;
+	int rc = setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, (const char *)&argument,
+	                    sizeof(argument));
+
+	if (rc == SOCKET_ERROR) {
+		rc = -1;
+		errno = ERRNO_WINAPI_OFFSET + WSAGetLastError();
+	}
+
+	return rc;
+}
+
+// sets errno on error
+char *resolve_address(struct sockaddr *address, socklen_t length) {
 	char buffer[NI_MAXHOST];
 	char *name;
 
-	if (getnameinfo((struct sockaddr *)address, length, buffer, NI_MAXHOST,
+	if (getnameinfo(address, length, buffer, NI_MAXHOST,
 	                NULL, 0, NI_NUMERICHOST) != 0) {
 		errno = ERRNO_WINAPI_OFFSET + WSAGetLastError();
 
@@ -167,3 +215,29 @@ char *resolve_address(struct sockaddr_in *address, socklen_t length) {
 
 	return name;
 }
+
+// sets errno on error
+struct addrinfo *resolve_listen_address(const char *address, uint16_t port) {
+	char port_str[16];
+	struct addrinfo hints;
+	struct addrinfo *resolved = NULL;
+	int rc;
+
+	_snprintf(port_str, sizeof(port_str), "%u", port);
+
+	memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	rc = getaddrinfo(address, port_str, &hints, &resolved);
+
+	if (rc != 0) {
+		errno = ERRNO_WINAPI_OFFSET + rc;
+
+		return NULL;
+	}
+
+	return resolved;
+}
@@ -0,0 +1,205 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * systemd.c: systemd socket activation and readiness notification
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * implements the two parts of the systemd protocol that brickd needs, without
+ * depending on libsystemd. with socket activation systemd binds the listening
+ * sockets and passes them via the LISTEN_PID and LISTEN_FDS environment
+ * variables, starting at handle 3. clients can connect before brickd is
+ * started and their connections queue in the backlog until the network
+ * subsystem takes over the sockets.
+ *
+ * state changes such as READY=1 are sent as datagrams to the Unix socket given
+ * by the NOTIFY_SOCKET environment variable. it is kept in the environment, so
+ * that a brickd process started by a handoff can notify systemd as well.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "systemd.h"
+
+#include "event.h"
+#include "log.h"
+#include "socket.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_OTHER
+
+#define LISTEN_FDS_START 3
+
+static int _activated = 0;
+static Array _server_sockets = ARRAY_INITIALIZER;
+
+static void systemd_close_server_socket(EventHandle *server_socket) {
+	socket_close(*server_socket);
+}
+
+// takes the listening sockets passed by socket activation, if any. the
+// environment variables are removed, so they don't leak into child processes
+int systemd_init(void) {
+	const char *listen_pid = getenv("LISTEN_PID");
+	const char *listen_fds = getenv("LISTEN_FDS");
+	int pid;
+	int count;
+	int handle;
+	int accepting;
+	socklen_t length;
+	EventHandle *server_socket;
+
+	if (listen_pid == NULL || listen_fds == NULL) {
+		return 0;
+	}
+
+	pid = atoi(listen_pid);
+	count = atoi(listen_fds);
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	if (pid != (int)getpid()) {
+		log_debug("Ignoring socket activation for another process (pid: %d)", pid);
+
+		return 0;
+	}
+
+	if (count <= 0) {
+		return 0;
+	}
+
+	if (array_create(&_server_sockets, count, sizeof(EventHandle), 1) < 0) {
+		log_error("Could not create socket activation array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	_activated = 1;
+
+	for (handle = LISTEN_FDS_START; handle < LISTEN_FDS_START + count; ++handle) {
+		fcntl(handle, F_SETFD, FD_CLOEXEC);
+
+		length = sizeof(accepting);
+
+		if (getsockopt(handle, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &length) < 0 ||
+		    !accepting) {
+			log_warn("Ignoring socket activation handle %d, it is not a listening socket",
+			         handle);
+
+			close(handle);
+
+			continue;
+		}
+
+		server_socket = array_append(&_server_sockets);
+
+		if (server_socket == NULL) {
+			log_error("Could not append to socket activation array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			close(handle);
+
+			continue;
+		}
+
+		*server_socket = handle;
+	}
+
+	log_info("Received %d listening socket(s) by socket activation",
+	         _server_sockets.count);
+
+	return 0;
+}
+
+// closes all sockets that were not taken over by the network subsystem
+void systemd_exit(void) {
+	if (!_activated) {
+		return;
+	}
+
+	array_destroy(&_server_sockets, (FreeFunction)systemd_close_server_socket);
+
+	_activated = 0;
+}
+
+// returns NULL if brickd was not started by socket activation
+Array *systemd_get_server_sockets(void) {
+	return _activated ? &_server_sockets : NULL;
+}
+
+// does nothing if brickd was not started by systemd with notification support
+void systemd_notify(const char *format, ...) {
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un address;
+	socklen_t length;
+	char state[256];
+	va_list arguments;
+	int handle;
+
+	if (path == NULL || (*path != '/' && *path != '@') ||
+	    strlen(path) >= sizeof(address.sun_path)) {
+		return;
+	}
+
+	va_start(arguments, format);
+	vsnprintf(state, sizeof(state), format, arguments);
+	va_end(arguments);
+
+	memset(&address, 0, sizeof(address));
+
+	address.sun_family = AF_UNIX;
+
+	strcpy(address.sun_path, path);
+
+	// a leading @ stands for the abstract namespace
+	if (*path == '@') {
+		address.sun_path[0] = '\0';
+	}
+
+	length = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+
+	handle = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	if (handle < 0) {
+		log_warn("Could not create systemd notification socket: %s (%d)",
+		         get_errno_name(errno), errno);
+
+		return;
+	}
+
+	if (sendto(handle, state, strlen(state), MSG_NOSIGNAL,
+	           (struct sockaddr *)&address, length) < 0) {
+		log_warn("Could not send '%s' to systemd: %s (%d)",
+		         state, get_errno_name(errno), errno);
+	} else {
+		log_debug("Sent '%s' to systemd", state);
+	}
+
+	close(handle);
+}
@@ -0,0 +1,34 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * systemd.h: systemd socket activation and readiness notification
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_SYSTEMD_H
+#define BRICKD_SYSTEMD_H
+
+#include "utils.h"
+
+int systemd_init(void);
+void systemd_exit(void);
+
+Array *systemd_get_server_sockets(void);
+
+void systemd_notify(const char *format, ...) ATTRIBUTE_FMT_PRINTF(1, 2);
+
+#endif // BRICKD_SYSTEMD_H
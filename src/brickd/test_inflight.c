@@ -0,0 +1,286 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * test_inflight.c: Tests for in-flight request tracking and the response cache
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * sends requests from several clients through socket pairs into
+ * client_handle_receive and answers the forwarded requests the same way
+ * network_dispatch_packet does. the USB and network side are replaced by
+ * stubs, like in the fuzz harness. the main case are two clients that use
+ * the same UID, function ID and sequence number with different payloads for
+ * a cached and coalesced function ID, the Brick answers them in the opposite
+ * order. neither response may end up in the cache or at a coalesced waiter
+ * under the payload of the other request.
+ *
+ * usage: test-inflight, the exit code is 0 if all checks passed
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "client.h"
+#include "config.h"
+#include "event.h"
+#include "inflight.h"
+#include "log.h"
+#include "network.h"
+#include "packet.h"
+#include "socket.h"
+#include "usb.h"
+#include "utils.h"
+
+#define TEST_UID 1234
+#define TEST_FUNCTION_ID 5
+
+enum {
+	CLIENT_A = 0,
+	CLIENT_B,
+	CLIENT_WAITER,
+	CLIENT_C,
+	CLIENT_COUNT
+};
+
+static Client _clients[CLIENT_COUNT];
+static int _peers[CLIENT_COUNT];
+static int _forwarded = 0;
+static int _failures = 0;
+static Array _no_items = ARRAY_INITIALIZER;
+
+// stubs for the network and USB subsystems
+
+void network_client_disconnected(Client *client) {
+	(void)client;
+}
+
+Array *network_get_clients(void) {
+	return &_no_items;
+}
+
+void usb_dispatch_packet(Packet *packet, void *owner) {
+	(void)packet;
+	(void)owner;
+
+	++_forwarded;
+}
+
+void usb_dispatch_enumerate_request(Packet *request, void *owner,
+                                    Array *callbacks) {
+	(void)request;
+	(void)owner;
+	(void)callbacks;
+}
+
+Array *usb_get_bricks(void) {
+	return &_no_items;
+}
+
+static void check(int condition, const char *description) {
+	printf("%s: %s\n", condition ? "ok  " : "FAIL", description);
+
+	if (!condition) {
+		++_failures;
+	}
+}
+
+static void fill_packet(Packet *packet, uint8_t sequence_number, uint8_t payload) {
+	memset(packet, 0, sizeof(Packet));
+
+	packet->header.uid = TEST_UID;
+	packet->header.length = sizeof(PacketHeader) + 1;
+	packet->header.function_id = TEST_FUNCTION_ID;
+	packet->header.response_expected = 1;
+	packet->header.sequence_number = sequence_number;
+	packet->payload[0] = payload;
+}
+
+static void send_request(int index, uint8_t sequence_number, uint8_t payload) {
+	Packet request;
+
+	fill_packet(&request, sequence_number, payload);
+
+	if (send(_peers[index], &request, request.header.length, 0) != request.header.length) {
+		fprintf(stderr, "could not send request: %s (%d)\n", get_errno_name(errno), errno);
+		exit(EXIT_FAILURE);
+	}
+
+	client_handle_receive(&_clients[index]);
+}
+
+// same order as network_dispatch_packet
+static void dispatch_response(uint8_t sequence_number, uint8_t payload) {
+	Packet response;
+	int i;
+
+	fill_packet(&response, sequence_number, payload);
+
+	inflight_handle_response(&response);
+
+	for (i = 0; i < CLIENT_COUNT; ++i) {
+		client_dispatch_packet(&_clients[i], &response, 0);
+	}
+}
+
+// returns the payload of the next response the client got, or -1 if none
+static int receive_response(int index) {
+	Packet response;
+
+	if (recv(_peers[index], &response, sizeof(response), MSG_DONTWAIT) <
+	    (ssize_t)sizeof(PacketHeader) + 1) {
+		return -1;
+	}
+
+	return response.payload[0];
+}
+
+static void drain_responses(void) {
+	int i;
+
+	for (i = 0; i < CLIENT_COUNT; ++i) {
+		while (receive_response(i) >= 0) {
+		}
+	}
+}
+
+static void test_colliding_requests(void) {
+	int forwarded;
+
+	// the waiter coalesces with the request of client A, then client B
+	// reuses the sequence number of client A with another payload
+	send_request(CLIENT_A, 3, 'X');
+	send_request(CLIENT_WAITER, 7, 'X');
+	check(_forwarded == 1, "identical request is coalesced");
+
+	send_request(CLIENT_B, 3, 'Y');
+	check(_forwarded == 2, "colliding request with another payload is forwarded");
+
+	// the write queue sent the request of client B first
+	dispatch_response(3, 'Y');
+	check(receive_response(CLIENT_WAITER) < 0,
+	      "waiter doesn't get the response for the other payload");
+
+	dispatch_response(3, 'X');
+	check(receive_response(CLIENT_WAITER) < 0,
+	      "waiter doesn't get an ambiguous response");
+
+	drain_responses();
+
+	// neither response may be cached, under any of the two payloads
+	forwarded = _forwarded;
+
+	send_request(CLIENT_C, 9, 'X');
+	check(_forwarded == forwarded + 1, "payload X is not answered from the cache");
+	check(receive_response(CLIENT_C) < 0, "no cached response for payload X");
+
+	send_request(CLIENT_B, 4, 'Y');
+	check(_forwarded == forwarded + 2, "payload Y is not answered from the cache");
+	check(receive_response(CLIENT_B) < 0, "no cached response for payload Y");
+
+	// once the collision is resolved the cache works again
+	dispatch_response(9, 'X');
+	check(receive_response(CLIENT_C) == 'X', "client C gets the response for payload X");
+
+	dispatch_response(4, 'Y');
+	check(receive_response(CLIENT_B) == 'Y', "client B gets the response for payload Y");
+
+	drain_responses();
+
+	forwarded = _forwarded;
+
+	send_request(CLIENT_A, 5, 'X');
+	check(_forwarded == forwarded && receive_response(CLIENT_A) == 'X',
+	      "payload X is answered from the cache with its own response");
+
+	send_request(CLIENT_WAITER, 6, 'Y');
+	check(_forwarded == forwarded && receive_response(CLIENT_WAITER) == 'Y',
+	      "payload Y is answered from the cache with its own response");
+}
+
+int main(void) {
+	char config_filename[] = "/tmp/test-inflight-XXXXXX";
+	const char *config = "response_cache.ttl = 5:60000\n"
+	                     "request_coalescing.functions = 5\n";
+	struct sockaddr_in address;
+	int sockets[2];
+	int handle;
+	int i;
+
+	handle = mkstemp(config_filename);
+
+	if (handle < 0 || write(handle, config, strlen(config)) != (ssize_t)strlen(config)) {
+		fprintf(stderr, "could not write config file: %s (%d)\n", get_errno_name(errno), errno);
+
+		return EXIT_FAILURE;
+	}
+
+	close(handle);
+
+	config_init(config_filename);
+	unlink(config_filename);
+
+	log_init();
+
+	if (config_has_error() || event_init() < 0 || cache_init() < 0 || inflight_init() < 0) {
+		fprintf(stderr, "could not initialize subsystems\n");
+
+		return EXIT_FAILURE;
+	}
+
+	memset(&address, 0, sizeof(address));
+
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (i = 0; i < CLIENT_COUNT; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) < 0 ||
+		    socket_set_non_blocking(sockets[1], 1) < 0 ||
+		    client_create(&_clients[i], sockets[1], (struct sockaddr *)&address,
+		                  sizeof(address)) < 0) {
+			fprintf(stderr, "could not create client: %s (%d)\n", get_errno_name(errno), errno);
+
+			return EXIT_FAILURE;
+		}
+
+		_peers[i] = sockets[0];
+	}
+
+	test_colliding_requests();
+
+	for (i = 0; i < CLIENT_COUNT; ++i) {
+		inflight_remove_client(&_clients[i]);
+		client_destroy(&_clients[i]);
+		close(_peers[i]);
+	}
+
+	inflight_exit();
+	cache_exit();
+	event_exit();
+	log_exit();
+	config_exit();
+
+	printf("%d check(s) failed\n", _failures);
+
+	return _failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
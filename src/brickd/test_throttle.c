@@ -0,0 +1,188 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * test_throttle.c: Tests for callback throttling
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * passes callbacks through throttle_allow_callback and runs the flush timer
+ * by hand, the broadcasts of the flush timer are recorded by a stub of
+ * network_dispatch_packet. the main case is a callback that arrives after
+ * the interval passed but before the flush timer ran. it has to be broadcast
+ * and the older held back callback must not be broadcast after it.
+ *
+ * usage: test-throttle, the exit code is 0 if all checks passed
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "network.h"
+#include "packet.h"
+#include "throttle.h"
+#include "usb.h"
+#include "utils.h"
+
+#define TEST_UID 1234
+#define TEST_FUNCTION_ID 40
+#define TEST_INTERVAL 50 // in milliseconds
+
+static int _flushed = 0;
+static int _flushed_payload = -1;
+static int _failures = 0;
+static Array _no_items = ARRAY_INITIALIZER;
+
+// stubs for the network and USB subsystems
+
+void network_dispatch_packet(Packet *packet) {
+	++_flushed;
+	_flushed_payload = packet->payload[0];
+}
+
+void network_client_disconnected(Client *client) {
+	(void)client;
+}
+
+Array *network_get_clients(void) {
+	return &_no_items;
+}
+
+void usb_dispatch_packet(Packet *packet, void *owner) {
+	(void)packet;
+	(void)owner;
+}
+
+void usb_dispatch_enumerate_request(Packet *request, void *owner,
+                                    Array *callbacks) {
+	(void)request;
+	(void)owner;
+	(void)callbacks;
+}
+
+Array *usb_get_bricks(void) {
+	return &_no_items;
+}
+
+static void check(int condition, const char *description) {
+	printf("%s: %s\n", condition ? "ok  " : "FAIL", description);
+
+	if (!condition) {
+		++_failures;
+	}
+}
+
+static int send_callback(uint8_t payload) {
+	Packet callback;
+
+	memset(&callback, 0, sizeof(Packet));
+
+	callback.header.uid = TEST_UID;
+	callback.header.length = sizeof(PacketHeader) + 1;
+	callback.header.function_id = TEST_FUNCTION_ID;
+	callback.payload[0] = payload;
+
+	return throttle_allow_callback(&callback);
+}
+
+static void wait_for_interval(void) {
+	usleep((TEST_INTERVAL + 10) * 1000);
+}
+
+static void test_held_back_callback(void) {
+	check(send_callback('A'), "first callback is broadcast");
+	check(!send_callback('B'), "early callback is held back");
+	check(!send_callback('C'), "later early callback is held back");
+
+	wait_for_interval();
+	event_handle_timers();
+
+	check(_flushed == 1 && _flushed_payload == 'C',
+	      "flush timer broadcasts the latest held back callback");
+
+	check(send_callback('D'), "callback after the flush is broadcast");
+	check(_flushed == 1, "flush timer isn't triggered again");
+}
+
+static void test_superseded_callback(void) {
+	_flushed = 0;
+
+	wait_for_interval();
+
+	check(send_callback('E'), "callback after the interval is broadcast");
+	check(!send_callback('F'), "early callback is held back");
+
+	// the interval passes, but the flush timer didn't run yet
+	wait_for_interval();
+
+	check(send_callback('G'), "callback before the flush is broadcast");
+
+	event_handle_timers();
+	wait_for_interval();
+	event_handle_timers();
+
+	check(_flushed == 0, "superseded held back callback isn't broadcast after it");
+}
+
+int main(void) {
+	char config_filename[] = "/tmp/test-throttle-XXXXXX";
+	char config[64];
+	int handle;
+
+	snprintf(config, sizeof(config), "callback_throttle.interval = %d:%d\n",
+	         TEST_FUNCTION_ID, TEST_INTERVAL);
+
+	handle = mkstemp(config_filename);
+
+	if (handle < 0 || write(handle, config, strlen(config)) != (ssize_t)strlen(config)) {
+		fprintf(stderr, "could not write config file: %s (%d)\n", get_errno_name(errno), errno);
+
+		return EXIT_FAILURE;
+	}
+
+	close(handle);
+
+	config_init(config_filename);
+	unlink(config_filename);
+
+	log_init();
+
+	if (config_has_error() || event_init() < 0 || throttle_init() < 0) {
+		fprintf(stderr, "could not initialize subsystems\n");
+
+		return EXIT_FAILURE;
+	}
+
+	test_held_back_callback();
+	test_superseded_callback();
+
+	throttle_exit();
+	event_exit();
+	log_exit();
+	config_exit();
+
+	printf("%d check(s) failed\n", _failures);
+
+	return _failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,208 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * throttle.c: Callback rate limiting
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * callbacks with a configured minimum interval are broadcast at most once per
+ * interval for each UID and function ID. a callback that arrives too early is
+ * held back. only the latest held back callback is kept, so clients get the
+ * most recent value once the interval has passed, instead of a backlog of
+ * outdated values.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "throttle.h"
+
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "network.h"
+#include "utils.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_NETWORK
+
+typedef struct {
+	uint32_t uid;
+	uint8_t function_id;
+	uint64_t next_allowed; // in microseconds
+	int held_back;
+	Packet callback;
+} ThrottleEntry;
+
+static Array _entries = ARRAY_INITIALIZER;
+static EventTimer _flush_timer;
+
+static void throttle_update_flush_timer(void) {
+	int i;
+	ThrottleEntry *entry;
+	uint64_t deadline = 0;
+	uint64_t now;
+
+	for (i = 0; i < _entries.count; ++i) {
+		entry = array_get(&_entries, i);
+
+		if (entry->held_back &&
+		    (deadline == 0 || entry->next_allowed < deadline)) {
+			deadline = entry->next_allowed;
+		}
+	}
+
+	if (deadline == 0) {
+		event_stop_timer(&_flush_timer);
+
+		return;
+	}
+
+	now = microseconds();
+
+	event_start_timer(&_flush_timer, deadline > now ? deadline - now : 0, 0);
+}
+
+static void throttle_flush(void *opaque) {
+	int i;
+	ThrottleEntry *entry;
+	uint64_t now = microseconds();
+
+	(void)opaque;
+
+	for (i = 0; i < _entries.count; ++i) {
+		entry = array_get(&_entries, i);
+
+		if (!entry->held_back || entry->next_allowed > now) {
+			continue;
+		}
+
+		log_debug("Flushing held back callback (U: %u, L: %u, F: %u)",
+		          entry->callback.header.uid, entry->callback.header.length,
+		          entry->callback.header.function_id);
+
+		// let the held back callback pass throttle_allow_callback
+		entry->held_back = 0;
+		entry->next_allowed = 0;
+
+		network_dispatch_packet(&entry->callback);
+	}
+
+	throttle_update_flush_timer();
+}
+
+int throttle_init(void) {
+	log_debug("Initializing callback throttling");
+
+	if (array_create(&_entries, 32, sizeof(ThrottleEntry), 1) < 0) {
+		log_error("Could not create throttle entry array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	if (event_add_timer(&_flush_timer, throttle_flush, NULL) < 0) {
+		array_destroy(&_entries, NULL);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void throttle_exit(void) {
+	log_debug("Shutting down callback throttling");
+
+	event_remove_timer(&_flush_timer);
+
+	array_destroy(&_entries, NULL);
+}
+
+// returns 1 if the callback can be broadcast now, returns 0 if it was held
+// back and will be broadcast later by the flush timer
+int throttle_allow_callback(Packet *callback) {
+	int i;
+	ThrottleEntry *entry;
+	uint32_t interval = config_get_callback_throttle_interval(callback->header.function_id);
+	uint64_t now;
+
+	if (interval == 0 || callback->header.function_id == CALLBACK_ENUMERATE) {
+		return 1;
+	}
+
+	now = microseconds();
+
+	for (i = 0; i < _entries.count; ++i) {
+		entry = array_get(&_entries, i);
+
+		if (entry->uid == callback->header.uid &&
+		    entry->function_id == callback->header.function_id) {
+			break;
+		}
+	}
+
+	if (i >= _entries.count) {
+		entry = array_append(&_entries);
+
+		if (entry == NULL) {
+			log_error("Could not append to throttle entry array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return 1;
+		}
+
+		entry->uid = callback->header.uid;
+		entry->function_id = callback->header.function_id;
+		entry->next_allowed = 0;
+		entry->held_back = 0;
+	}
+
+	if (entry->next_allowed <= now) {
+		entry->next_allowed = now + (uint64_t)interval * 1000;
+
+		// a held back callback that the flush timer didn't broadcast yet is
+		// older than this one, broadcasting it afterwards would leave the
+		// clients with an outdated value
+		if (entry->held_back) {
+			log_debug("Dropping superseded held back callback (U: %u, L: %u, F: %u)",
+			          entry->callback.header.uid, entry->callback.header.length,
+			          entry->callback.header.function_id);
+
+			entry->held_back = 0;
+
+			throttle_update_flush_timer();
+		}
+
+		return 1;
+	}
+
+	if (entry->held_back) {
+		log_debug("Replacing held back callback (U: %u, L: %u, F: %u)",
+		          callback->header.uid, callback->header.length,
+		          callback->header.function_id);
+	}
+
+	memcpy(&entry->callback, callback, callback->header.length);
+
+	if (!entry->held_back) {
+		entry->held_back = 1;
+
+		throttle_update_flush_timer();
+	}
+
+	return 0;
+}
@@ -0,0 +1,269 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * trace.c: Binary packet trace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * every packet that passes brickd is copied as a fixed-size record into a ring
+ * that is memory-mapped from the trace file. tracing a packet is a memcpy and
+ * a counter increment, there is no formatting and no syscall involved. the
+ * operating system writes the file in the background and the records survive
+ * a crash of brickd. the trace_decode tool renders the file as text.
+ */
+
+#include <errno.h>
+#include <string.h>
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
+#ifndef _MSC_VER
+	#include <sys/time.h>
+#endif
+
+#include "trace.h"
+
+#include "config.h"
+#include "log.h"
+#include "utils.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_OTHER
+
+static TraceFileHeader *_header = NULL;
+static uint8_t *_records = NULL;
+static uint32_t _record_mask = 0;
+static uint32_t _record_size = 0;
+static int _payload = 0;
+static size_t _mapping_size = 0;
+#ifdef _WIN32
+static HANDLE _file = INVALID_HANDLE_VALUE;
+static HANDLE _mapping = NULL;
+#endif
+
+#ifdef _WIN32
+
+static void *trace_map_file(const char *filename, size_t size) {
+	void *address;
+
+	_file = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ,
+	                   NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (_file == INVALID_HANDLE_VALUE) {
+		errno = ERRNO_WINAPI_OFFSET + GetLastError();
+
+		return NULL;
+	}
+
+	_mapping = CreateFileMapping(_file, NULL, PAGE_READWRITE,
+	                             (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+
+	if (_mapping == NULL) {
+		errno = ERRNO_WINAPI_OFFSET + GetLastError();
+
+		CloseHandle(_file);
+		_file = INVALID_HANDLE_VALUE;
+
+		return NULL;
+	}
+
+	address = MapViewOfFile(_mapping, FILE_MAP_WRITE, 0, 0, size);
+
+	if (address == NULL) {
+		errno = ERRNO_WINAPI_OFFSET + GetLastError();
+
+		CloseHandle(_mapping);
+		CloseHandle(_file);
+		_mapping = NULL;
+		_file = INVALID_HANDLE_VALUE;
+
+		return NULL;
+	}
+
+	return address;
+}
+
+static void trace_unmap_file(void *address) {
+	UnmapViewOfFile(address);
+	CloseHandle(_mapping);
+	CloseHandle(_file);
+
+	_mapping = NULL;
+	_file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+static void *trace_map_file(const char *filename, size_t size) {
+	int fd;
+	void *address;
+	int saved_errno;
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) {
+		return NULL;
+	}
+
+	if (ftruncate(fd, size) < 0) {
+		saved_errno = errno;
+
+		close(fd);
+
+		errno = saved_errno;
+
+		return NULL;
+	}
+
+	address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	saved_errno = errno;
+
+	// the mapping stays valid after the file descriptor is closed
+	close(fd);
+
+	if (address == MAP_FAILED) {
+		errno = saved_errno;
+
+		return NULL;
+	}
+
+	return address;
+}
+
+static void trace_unmap_file(void *address) {
+	munmap(address, _mapping_size);
+}
+
+#endif
+
+int trace_init(void) {
+	const char *filename = config_get_trace_file();
+	uint32_t record_count = 1;
+	struct timeval tv;
+
+	if (*filename == '\0') {
+		log_debug("Packet trace is disabled");
+
+		return 0;
+	}
+
+	log_debug("Initializing packet trace");
+
+	// round up to a power of two, so that the ring index is a simple mask
+	while (record_count < (uint32_t)config_get_trace_records()) {
+		record_count <<= 1;
+	}
+
+	_payload = config_get_trace_payload();
+	_record_size = sizeof(TraceRecord) + (_payload ? TRACE_MAX_PAYLOAD_LENGTH : 0);
+	_record_mask = record_count - 1;
+	_mapping_size = sizeof(TraceFileHeader) + (size_t)record_count * _record_size;
+
+	_header = trace_map_file(filename, _mapping_size);
+
+	if (_header == NULL) {
+		log_error("Could not map packet trace file '%s': %s (%d)",
+		          filename, get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	_records = (uint8_t *)_header + sizeof(TraceFileHeader);
+
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+
+	gettimeofday(&tv, NULL);
+
+	memset(_header, 0, sizeof(TraceFileHeader));
+	memcpy(_header->magic, TRACE_MAGIC, sizeof(_header->magic));
+
+	_header->version = TRACE_VERSION;
+	_header->record_size = _record_size;
+	_header->record_count = record_count;
+	_header->sequence = 0;
+	_header->wall_clock = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	_header->monotonic = microseconds();
+
+	log_info("Tracing packets to '%s' (records: %u, payload: %s)",
+	         filename, record_count, _payload ? "yes" : "no");
+
+	return 0;
+}
+
+void trace_exit(void) {
+	if (_header == NULL) {
+		return;
+	}
+
+	log_debug("Shutting down packet trace");
+
+	trace_unmap_file(_header);
+
+	_header = NULL;
+	_records = NULL;
+}
+
+// endpoint identifies the client or Brick, see TraceRecord. available is the
+// number of valid bytes at packet, the payload is never copied beyond it, even
+// if the length in the header is bigger
+void trace_packet(TraceDirection direction, uint32_t endpoint, Packet *packet,
+                  int available) {
+	TraceRecord *record;
+	int payload_length;
+
+	if (_header == NULL) {
+		return;
+	}
+
+	record = (TraceRecord *)(_records + (size_t)((uint32_t)_header->sequence & _record_mask) * _record_size);
+
+	record->timestamp = microseconds();
+	record->endpoint = endpoint;
+	record->direction = (uint8_t)direction;
+	record->reserved = 0;
+
+	memcpy(&record->header, &packet->header, sizeof(PacketHeader));
+
+	if (_payload) {
+		payload_length = packet->header.length;
+
+		if (payload_length > available) {
+			payload_length = available;
+		}
+
+		payload_length -= (int)sizeof(PacketHeader);
+
+		if (payload_length < 0) {
+			payload_length = 0;
+		} else if (payload_length > (int)TRACE_MAX_PAYLOAD_LENGTH) {
+			payload_length = TRACE_MAX_PAYLOAD_LENGTH;
+		}
+
+		memcpy(record + 1, (uint8_t *)packet + sizeof(PacketHeader), payload_length);
+
+		record->payload_length = (uint8_t)payload_length;
+	} else {
+		record->payload_length = 0;
+	}
+
+	++_header->sequence;
+}
@@ -0,0 +1,82 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * trace.h: Binary packet trace
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_TRACE_H
+#define BRICKD_TRACE_H
+
+#include <stdint.h>
+
+#include "packet.h"
+#include "utils.h"
+
+#define TRACE_MAGIC "BRICKDTR"
+// version 2 has the same layout as version 1, but traces a client request
+// once. version 1 traced a throttled request each time it was handled again
+#define TRACE_VERSION 2
+#define TRACE_MIN_VERSION 1
+
+typedef enum {
+	TRACE_DIRECTION_CLIENT_IN = 0, // request received from a client
+	TRACE_DIRECTION_CLIENT_OUT, // response or callback sent to a client
+	TRACE_DIRECTION_BRICK_OUT, // request sent to a Brick
+	TRACE_DIRECTION_BRICK_IN // response or callback received from a Brick
+} TraceDirection;
+
+// the trace file starts with this header, followed by record_count records
+// of record_size bytes each. all values are in host byte order
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t record_count; // a power of two
+	uint32_t reserved;
+	uint64_t sequence; // number of records written so far
+	uint64_t wall_clock; // at start, in microseconds since the epoch
+	uint64_t monotonic; // at start, in microseconds, see microseconds()
+	uint8_t padding[16];
+} TraceFileHeader;
+
+// if the payload is traced, then each record is followed by the packet
+// payload and record_size is sizeof(TraceRecord) + 72
+typedef struct {
+	uint64_t timestamp; // in microseconds, see microseconds()
+	uint32_t endpoint; // client socket or Brick bus number and device address
+	uint8_t direction;
+	uint8_t payload_length;
+	uint16_t reserved;
+	PacketHeader header;
+} TraceRecord;
+
+#define TRACE_BRICK_ENDPOINT(bus_number, device_address) \
+	(((uint32_t)(bus_number) << 8) | (uint32_t)(device_address))
+
+#define TRACE_MAX_PAYLOAD_LENGTH (sizeof(Packet) - sizeof(PacketHeader))
+
+STATIC_ASSERT(sizeof(TraceFileHeader) == 64, "TraceFileHeader has invalid size");
+STATIC_ASSERT(sizeof(TraceRecord) == 24, "TraceRecord has invalid size");
+
+int trace_init(void);
+void trace_exit(void);
+
+void trace_packet(TraceDirection direction, uint32_t endpoint, Packet *packet,
+                  int available);
+
+#endif // BRICKD_TRACE_H
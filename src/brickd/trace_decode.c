@@ -0,0 +1,176 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * trace_decode.c: Renders a binary packet trace file as text
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * standalone tool that reads a trace file written by brickd (see trace.c) and
+ * prints one line per record, oldest first. the file is read with plain stdio,
+ * so it can be decoded while brickd is still running or after it crashed.
+ *
+ * usage: trace_decode <trace-file>
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+static const char *get_direction_name(uint8_t direction) {
+	switch (direction) {
+	case TRACE_DIRECTION_CLIENT_IN:  return "client-in ";
+	case TRACE_DIRECTION_CLIENT_OUT: return "client-out";
+	case TRACE_DIRECTION_BRICK_OUT:  return "brick-out ";
+	case TRACE_DIRECTION_BRICK_IN:   return "brick-in  ";
+	default:                         return "<unknown> ";
+	}
+}
+
+static void print_record(TraceFileHeader *header, TraceRecord *record,
+                         uint8_t *payload) {
+	uint64_t wall_clock;
+	time_t seconds;
+	struct tm *tm;
+	char timestamp[64] = "<unknown>";
+	char endpoint[32];
+	int i;
+
+	// records carry monotonic timestamps, map them to wall clock time
+	wall_clock = header->wall_clock + (record->timestamp - header->monotonic);
+	seconds = (time_t)(wall_clock / 1000000);
+	tm = localtime(&seconds);
+
+	if (tm != NULL) {
+		strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", tm);
+	}
+
+	if (record->direction == TRACE_DIRECTION_BRICK_OUT ||
+	    record->direction == TRACE_DIRECTION_BRICK_IN) {
+		snprintf(endpoint, sizeof(endpoint), "usb %u-%u",
+		         record->endpoint >> 8, record->endpoint & 0xFF);
+	} else {
+		snprintf(endpoint, sizeof(endpoint), "socket %u", record->endpoint);
+	}
+
+	printf("%s.%06u %s %-12s U: %u, L: %u, F: %u, S: %u, R: %u, E: %u",
+	       timestamp, (unsigned int)(wall_clock % 1000000),
+	       get_direction_name(record->direction), endpoint,
+	       record->header.uid, record->header.length,
+	       record->header.function_id, record->header.sequence_number,
+	       record->header.response_expected, record->header.error_code);
+
+	if (record->payload_length > 0) {
+		printf(", P:");
+
+		for (i = 0; i < record->payload_length; ++i) {
+			printf(" %02X", payload[i]);
+		}
+	}
+
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	FILE *fp;
+	TraceFileHeader header;
+	uint8_t buffer[sizeof(TraceRecord) + TRACE_MAX_PAYLOAD_LENGTH];
+	TraceRecord *record = (TraceRecord *)buffer;
+	uint64_t first;
+	uint64_t sequence;
+	int exit_code = 1;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace-file>\n", argv[0]);
+
+		return 1;
+	}
+
+	fp = fopen(argv[1], "rb");
+
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open '%s': %s (%d)\n",
+		        argv[1], strerror(errno), errno);
+
+		return 1;
+	}
+
+	if (fread(&header, sizeof(header), 1, fp) != 1) {
+		fprintf(stderr, "Could not read header of '%s'\n", argv[1]);
+
+		goto cleanup;
+	}
+
+	if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+		fprintf(stderr, "'%s' is not a brickd trace file\n", argv[1]);
+
+		goto cleanup;
+	}
+
+	if (header.version < TRACE_MIN_VERSION || header.version > TRACE_VERSION) {
+		fprintf(stderr, "Trace file '%s' has unsupported version %u\n",
+		        argv[1], header.version);
+
+		goto cleanup;
+	}
+
+	if (header.record_size < sizeof(TraceRecord) ||
+	    header.record_size > sizeof(buffer) || header.record_count == 0 ||
+	    (header.record_count & (header.record_count - 1)) != 0) {
+		fprintf(stderr, "Trace file '%s' has invalid record layout (size: %u, count: %u)\n",
+		        argv[1], header.record_size, header.record_count);
+
+		goto cleanup;
+	}
+
+	// once the ring wrapped around the oldest records are overwritten
+	first = header.sequence > header.record_count
+	      ? header.sequence - header.record_count : 0;
+
+	if (first > 0) {
+		printf("# %llu older records were overwritten\n",
+		       (unsigned long long)first);
+	}
+
+	for (sequence = first; sequence < header.sequence; ++sequence) {
+		if (fseek(fp, (long)(sizeof(header) +
+		                     (sequence & (header.record_count - 1)) * header.record_size),
+		          SEEK_SET) < 0 ||
+		    fread(buffer, header.record_size, 1, fp) != 1) {
+			fprintf(stderr, "Could not read record %llu of '%s'\n",
+			        (unsigned long long)sequence, argv[1]);
+
+			goto cleanup;
+		}
+
+		if (record->payload_length > header.record_size - sizeof(TraceRecord)) {
+			record->payload_length = header.record_size - sizeof(TraceRecord);
+		}
+
+		print_record(&header, record, buffer + sizeof(TraceRecord));
+	}
+
+	exit_code = 0;
+
+cleanup:
+	fclose(fp);
+
+	return exit_code;
+}
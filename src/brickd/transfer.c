@@ -24,10 +24,19 @@
 #include "transfer.h"
 
 #include "log.h"
+#include "trace.h"
 #include "usb.h"
 
 #define LOG_CATEGORY LOG_CATEGORY_USB
 
+static void transfer_count_error(Transfer *transfer) {
+	if (transfer->type == TRANSFER_TYPE_READ) {
+		++transfer->brick->metrics.read_transfer_errors;
+	} else {
+		++transfer->brick->metrics.write_transfer_errors;
+	}
+}
+
 static void LIBUSB_CALL transfer_wrapper(struct libusb_transfer *handle) {
 	Transfer *transfer = handle->user_data;
 
@@ -55,12 +64,16 @@ static void LIBUSB_CALL transfer_wrapper(struct libusb_transfer *handle) {
 
 		return;
 	} else if (handle->status == LIBUSB_TRANSFER_STALL) {
+		transfer_count_error(transfer);
+
 		log_debug("%s transfer %p for %s [%s] got stalled",
 		          transfer_get_type_name(transfer->type, 1), transfer,
 		          transfer->brick->product, transfer->brick->serial_number);
 
 		return;
 	} else if (handle->status != LIBUSB_TRANSFER_COMPLETED) {
+		transfer_count_error(transfer);
+
 		log_warn("%s transfer %p returned with an error from %s [%s]: %s (%d)",
 		         transfer_get_type_name(transfer->type, 1), transfer,
 		         transfer->brick->product, transfer->brick->serial_number,
@@ -127,7 +140,7 @@ void transfer_destroy(Transfer *transfer) {
 	if (transfer->submitted) {
 		transfer->completed = 0;
 
-		rc = libusb_cancel_transfer(transfer->handle);
+		rc = transfer->brick->backend->cancel_transfer(transfer);
 
 		if (rc < 0) {
 			log_warn("Could not cancel pending %s transfer %p for %s [%s]: %s (%d)",
@@ -214,7 +227,7 @@ int transfer_submit(Transfer *transfer) {
 	                          transfer,
 	                          0);
 
-	rc = libusb_submit_transfer(transfer->handle);
+	rc = transfer->brick->backend->submit_transfer(transfer);
 
 	if (rc < 0) {
 		log_error("Could not submit %s transfer %p to %s [%s]: %s (%d)",
@@ -224,9 +237,21 @@ int transfer_submit(Transfer *transfer) {
 
 		transfer->submitted = 0;
 
+		transfer_count_error(transfer);
+
 		return -1;
 	}
 
+	if (transfer->type == TRANSFER_TYPE_WRITE) {
+		++transfer->brick->metrics.requests_sent;
+		transfer->brick->metrics.bytes_sent += length;
+
+		trace_packet(TRACE_DIRECTION_BRICK_OUT,
+		             TRACE_BRICK_ENDPOINT(transfer->brick->bus_number,
+		                                  transfer->brick->device_address),
+		             &transfer->packet, length);
+	}
+
 	log_debug("Submitted %s transfer %p for %u bytes to %s [%s]",
 	          transfer_get_type_name(transfer->type, 0), transfer, length,
 	          transfer->brick->product, transfer->brick->serial_number);
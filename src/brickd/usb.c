@@ -26,9 +26,13 @@
 #include "usb.h"
 
 #include "brick.h"
+#include "config.h"
 #include "event.h"
 #include "log.h"
+#include "metrics.h"
 #include "network.h"
+#include "replay.h"
+#include "simulator.h"
 #include "transfer.h"
 #include "utils.h"
 
@@ -36,6 +40,7 @@
 
 static libusb_context *_context = NULL;
 static Array _bricks = ARRAY_INITIALIZER;
+static int _handed_off = 0; // the Bricks found during init were handed off
 
 typedef int (*USBEnumerateFunction)(libusb_device *device);
 
@@ -100,17 +105,236 @@ cleanup:
 	return rc;
 }
 
-static int usb_handle_device(libusb_device *device) {
+// sets the configuration, claims the interface and reads the string
+// descriptors. the string descriptor requests double as probe transfers that
+// show whether the Brick responds. on error the step that failed is returned
+static int usb_claim_brick(Brick *brick, const char **step) {
+	int configuration;
+	int rc;
+
+	// setting the configuration that is already active would reset the
+	// state of the device in a lightweight way, avoid this
+	rc = libusb_get_configuration(brick->device_handle, &configuration);
+
+	if (rc < 0) {
+		*step = "get USB device configuration";
+
+		return rc;
+	}
+
+	if (configuration != USB_CONFIGURATION) {
+		rc = libusb_set_configuration(brick->device_handle, USB_CONFIGURATION);
+
+		if (rc < 0) {
+			*step = "set USB device configuration";
+
+			return rc;
+		}
+	}
+
+	// claim device interface
+	rc = libusb_claim_interface(brick->device_handle, USB_INTERFACE);
+
+	if (rc < 0) {
+		*step = "claim USB device interface";
+
+		return rc;
+	}
+
+	// get product string descriptor
+	rc = libusb_get_string_descriptor_ascii(brick->device_handle,
+	                                        brick->device_descriptor.iProduct,
+	                                        (unsigned char *)brick->product,
+	                                        sizeof(brick->product));
+
+	if (rc < 0) {
+		*step = "get product string descriptor for USB device";
+
+		libusb_release_interface(brick->device_handle, USB_INTERFACE);
+
+		return rc;
+	}
+
+	// get serial number string descriptor
+	rc = libusb_get_string_descriptor_ascii(brick->device_handle,
+	                                        brick->device_descriptor.iSerialNumber,
+	                                        (unsigned char *)brick->serial_number,
+	                                        sizeof(brick->serial_number));
+
+	if (rc < 0) {
+		*step = "get serial number string descriptor for USB device";
+
+		libusb_release_interface(brick->device_handle, USB_INTERFACE);
+
+		return rc;
+	}
+
+	return 0;
+}
+
+static int usb_open_brick(Brick *brick) {
+	int phase = 0;
+	int rc;
+	const char *step;
+	libusb_device **devices;
+	libusb_device *device;
+	int i = 0;
+
+	// initialize per-device libusb context
+	if (usb_create_context(&brick->context) < 0) {
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	// find device
+	rc = libusb_get_device_list(brick->context, &devices);
+
+	if (rc < 0) {
+		log_error("Could not get USB device list: %s (%d)",
+		          get_libusb_error_name(rc), rc);
+
+		goto cleanup;
+	}
+
+	for (device = devices[0]; device != NULL; device = devices[i++]) {
+		if (brick->bus_number == libusb_get_bus_number(device) &&
+			brick->device_address == libusb_get_device_address(device)) {
+			brick->device = libusb_ref_device(device);
+			break;
+		}
+	}
+
+	libusb_free_device_list(devices, 1);
+
+	if (brick->device == NULL) {
+		log_error("Could not find USB device (bus: %u, device: %u)",
+		          brick->bus_number, brick->device_address);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	// get device descriptor
+	rc = libusb_get_device_descriptor(brick->device, &brick->device_descriptor);
+
+	if (rc < 0) {
+		log_error("Could not get device descriptor for USB device (bus: %u, device: %u): %s (%d)",
+		          brick->bus_number, brick->device_address,
+		          get_libusb_error_name(rc), rc);
+
+		goto cleanup;
+	}
+
+	// open device
+	rc = libusb_open(brick->device, &brick->device_handle);
+
+	if (rc < 0) {
+		log_error("Could not open USB device (bus: %u, device: %u): %s (%d)",
+		          brick->bus_number, brick->device_address,
+		          get_libusb_error_name(rc), rc);
+
+		goto cleanup;
+	}
+
+	phase = 3;
+
+	// a reset makes the kernel enumerate the device again, which takes
+	// hundreds of milliseconds per Brick. try without a reset first and only
+	// fall back to it if the Brick doesn't respond as expected
+	if (_handed_off || !config_get_usb_always_reset()) {
+		rc = usb_claim_brick(brick, &step);
+
+		if (rc < 0) {
+			log_debug("Could not %s (bus: %u, device: %u) without reset, resetting it: %s (%d)",
+			          step, brick->bus_number, brick->device_address,
+			          get_libusb_error_name(rc), rc);
+		}
+	} else {
+		rc = -1;
+	}
+
+	if (rc < 0) {
+		// reset device
+		rc = libusb_reset_device(brick->device_handle);
+
+		if (rc < 0) {
+			log_error("Could not reset USB device (bus: %u, device: %u): %s (%d)",
+			          brick->bus_number, brick->device_address,
+			          get_libusb_error_name(rc), rc);
+
+			goto cleanup;
+		}
+
+		rc = usb_claim_brick(brick, &step);
+
+		if (rc < 0) {
+			log_error("Could not %s (bus: %u, device: %u): %s (%d)",
+			          step, brick->bus_number, brick->device_address,
+			          get_libusb_error_name(rc), rc);
+
+			goto cleanup;
+		}
+	}
+
+	phase = 4;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 3:
+		libusb_close(brick->device_handle);
+
+	case 2:
+		libusb_unref_device(brick->device);
+
+	case 1:
+		usb_destroy_context(brick->context);
+
+	default:
+		break;
+	}
+
+	return phase == 4 ? 0 : -1;
+}
+
+static void usb_close_brick(Brick *brick) {
+	libusb_release_interface(brick->device_handle, USB_INTERFACE);
+
+	libusb_close(brick->device_handle);
+
+	libusb_unref_device(brick->device);
+
+	usb_destroy_context(brick->context);
+}
+
+static int usb_submit_transfer(Transfer *transfer) {
+	return libusb_submit_transfer(transfer->handle);
+}
+
+static int usb_cancel_transfer(Transfer *transfer) {
+	return libusb_cancel_transfer(transfer->handle);
+}
+
+static BrickBackend _usb_backend = {
+	"USB",
+	usb_open_brick,
+	usb_close_brick,
+	usb_submit_transfer,
+	usb_cancel_transfer
+};
+
+static int usb_handle_brick(BrickBackend *backend, uint8_t bus_number,
+                            uint8_t device_address) {
 	int i;
 	Brick *brick;
-	uint8_t bus_number = libusb_get_bus_number(device);
-	uint8_t device_address = libusb_get_device_address(device);
 
 	// check all known Bricks
 	for (i = 0; i < _bricks.count; ++i) {
 		brick = array_get(&_bricks, i);
 
-		if (brick->bus_number == bus_number &&
+		if (brick->backend == backend &&
+		    brick->bus_number == bus_number &&
 		    brick->device_address == device_address) {
 			// mark known Brick as connected
 			brick->connected = 1;
@@ -120,8 +344,8 @@ static int usb_handle_device(libusb_device *device) {
 	}
 
 	// create new Brick object
-	log_debug("Found new USB device (bus: %u, device: %u)",
-	          bus_number, device_address);
+	log_debug("Found new %s device (bus: %u, device: %u)",
+	          backend->name, bus_number, device_address);
 
 	brick = array_append(&_bricks);
 
@@ -132,11 +356,11 @@ static int usb_handle_device(libusb_device *device) {
 		return -1;
 	}
 
-	if (brick_create(brick, bus_number, device_address) < 0) {
+	if (brick_create(brick, backend, bus_number, device_address) < 0) {
 		array_remove(&_bricks, _bricks.count - 1, NULL);
 
-		log_info("Ignoring USB device (bus: %u, device: %u) due to an error",
-		         bus_number, device_address);
+		log_info("Ignoring %s device (bus: %u, device: %u) due to an error",
+		         backend->name, bus_number, device_address);
 
 		return 0;
 	}
@@ -144,13 +368,18 @@ static int usb_handle_device(libusb_device *device) {
 	// mark new Brick as connected
 	brick->connected = 1;
 
-	log_info("Added USB device (bus: %d, device: %d) at index %d: %s [%s]",
-	         brick->bus_number, brick->device_address, _bricks.count - 1,
-	         brick->product, brick->serial_number);
+	log_info("Added %s device (bus: %d, device: %d) at index %d: %s [%s]",
+	         backend->name, brick->bus_number, brick->device_address,
+	         _bricks.count - 1, brick->product, brick->serial_number);
 
 	return 0;
 }
 
+static int usb_handle_device(libusb_device *device) {
+	return usb_handle_brick(&_usb_backend, libusb_get_bus_number(device),
+	                        libusb_get_device_address(device));
+}
+
 static void usb_handle_events(void *opaque) {
 	int rc;
 	libusb_context *context = opaque;
@@ -184,7 +413,10 @@ static void LIBUSB_CALL usb_remove_pollfd(int fd, void *opaque) {
 	event_remove_source(fd, EVENT_SOURCE_TYPE_USB); // FIXME: handle error?
 }
 
-int usb_init(void) {
+// if handed_off is 1, then the Bricks found during initialization were handed
+// off by another brickd process. they are in a known state and are opened
+// without a reset, regardless of the usb.always_reset option
+int usb_init(int handed_off) {
 	int phase = 0;
 
 	log_debug("Initializing USB subsystem");
@@ -214,10 +446,16 @@ int usb_init(void) {
 	phase = 2;
 
 	// find all Bricks
+	_handed_off = handed_off;
+
 	if (usb_update() < 0) {
+		_handed_off = 0;
+
 		goto cleanup;
 	}
 
+	_handed_off = 0;
+
 	phase = 3;
 
 cleanup:
@@ -249,6 +487,8 @@ int usb_update(void) {
 	int k;
 	uint32_t uid;
 	EnumerateCallback enumerate_callback;
+	Array *replayed_endpoints = replay_get_brick_endpoints();
+	uint32_t endpoint;
 
 	// mark all known Bricks as potentially removed
 	for (i = 0; i < _bricks.count; ++i) {
@@ -257,9 +497,30 @@ int usb_update(void) {
 		brick->connected = 0;
 	}
 
-	// enumerate all USB devices and mark all Bricks that are still connected
-	if (usb_enumerate(usb_handle_device) < 0) {
-		return -1;
+	if (replayed_endpoints != NULL) {
+		// replayed Bricks replace all real and simulated Bricks
+		for (i = 0; i < replayed_endpoints->count; ++i) {
+			endpoint = *(uint32_t *)array_get(replayed_endpoints, i);
+
+			if (usb_handle_brick(simulator_get_replay_backend(),
+			                     (uint8_t)(endpoint >> 8),
+			                     (uint8_t)endpoint) < 0) {
+				return -1;
+			}
+		}
+	} else {
+		// enumerate all USB devices and mark all Bricks that are still connected
+		if (usb_enumerate(usb_handle_device) < 0) {
+			return -1;
+		}
+
+		// simulated Bricks are always connected
+		for (i = 0; i < config_get_simulator_stacks(); ++i) {
+			if (usb_handle_brick(simulator_get_backend(), SIMULATOR_BUS_NUMBER,
+			                     (uint8_t)(i + 1)) < 0) {
+				return -1;
+			}
+		}
 	}
 
 	// remove all Bricks that are not marked as connected
@@ -270,9 +531,9 @@ int usb_update(void) {
 			continue;
 		}
 
-		log_info("Removing USB device (bus: %d, device: %d) at index %d: %s [%s]",
-		         brick->bus_number, brick->device_address, i,
-		         brick->product, brick->serial_number);
+		log_info("Removing %s device (bus: %d, device: %d) at index %d: %s [%s]",
+		         brick->backend->name, brick->bus_number, brick->device_address,
+		         i, brick->product, brick->serial_number);
 
 		for (k = 0; k < brick->uids.count; ++k) {
 			uid = *(uint32_t *)array_get(&brick->uids, k);
@@ -296,16 +557,26 @@ int usb_update(void) {
 		array_remove(&_bricks, i, (FreeFunction)brick_destroy);
 	}
 
+	// the device change might also affect the stacks behind the remaining
+	// Bricks, refresh their enumerate caches on the next enumerate request
+	for (i = 0; i < _bricks.count; ++i) {
+		brick = array_get(&_bricks, i);
+
+		brick_invalidate_enumerate_cache(brick);
+	}
+
 	return 0;
 }
 
-void usb_dispatch_packet(Packet *packet) {
+void usb_dispatch_packet(Packet *packet, void *owner) {
 	int i;
 	Brick *brick;
 	int rc;
 	int dispatched = 0;
 
 	if (_bricks.count == 0) {
+		metrics_increment(METRIC_REQUESTS_DROPPED);
+
 		log_debug("No Bricks connected, dropping request (U: %u, L: %u, F: %u, S: %u, R: %u)",
 		          packet->header.uid, packet->header.length,
 		          packet->header.function_id, packet->header.sequence_number,
@@ -323,7 +594,7 @@ void usb_dispatch_packet(Packet *packet) {
 		for (i = 0; i < _bricks.count; ++i) {
 			brick = array_get(&_bricks, i);
 
-			brick_dispatch_packet(brick, packet, 1);
+			brick_dispatch_packet(brick, packet, owner, 1);
 		}
 	} else {
 		log_debug("Dispatching request (U: %u, L: %u, F: %u, S: %u, R: %u) to %d Brick(s)",
@@ -334,7 +605,7 @@ void usb_dispatch_packet(Packet *packet) {
 		for (i = 0; i < _bricks.count; ++i) {
 			brick = array_get(&_bricks, i);
 
-			rc = brick_dispatch_packet(brick, packet, 0);
+			rc = brick_dispatch_packet(brick, packet, owner, 0);
 
 			if (rc < 0) {
 				continue;
@@ -347,16 +618,149 @@ void usb_dispatch_packet(Packet *packet) {
 			return;
 		}
 
+		metrics_increment(METRIC_REQUESTS_BROADCAST);
+
 		log_debug("Broadcasting request because UID is currently unknown");
 
 		for (i = 0; i < _bricks.count; ++i) {
 			brick = array_get(&_bricks, i);
 
-			brick_dispatch_packet(brick, packet, 1);
+			brick_dispatch_packet(brick, packet, owner, 1);
 		}
 	}
 }
 
+// answers an enumerate request from the enumerate caches of the Bricks. the
+// request is only forwarded to Bricks whose cache is invalid or too old, their
+// enumerate callbacks reach the client as broadcast callbacks. the cached
+// callbacks of all other Bricks are appended to the given array as available
+// callbacks. if the enumerate cache is disabled the request is forwarded to
+// all Bricks
+void usb_dispatch_enumerate_request(Packet *request, void *owner,
+                                    Array *callbacks) {
+	int i;
+	int k;
+	Brick *brick;
+	uint64_t max_age = (uint64_t)config_get_enumerate_cache_max_age() * 1000;
+	uint64_t now;
+	EnumerateCallback *cached_callback;
+	EnumerateCallback *enumerate_callback;
+
+	if (max_age == 0) {
+		usb_dispatch_packet(request, owner);
+
+		return;
+	}
+
+	now = microseconds();
+
+	for (i = 0; i < _bricks.count; ++i) {
+		brick = array_get(&_bricks, i);
+
+		if (brick->enumerate_requested == 0 ||
+		    brick->enumerate_requested + max_age < now) {
+			log_debug("Refreshing enumerate cache of %s [%s]",
+			          brick->product, brick->serial_number);
+
+			brick_invalidate_enumerate_cache(brick);
+
+			if (brick_dispatch_packet(brick, request, owner, 1) > 0) {
+				brick->enumerate_requested = now;
+			}
+
+			continue;
+		}
+
+		metrics_increment(METRIC_ENUMERATE_CACHE_HITS);
+
+		log_debug("Answering enumerate request from enumerate cache of %s [%s] (count: %d)",
+		          brick->product, brick->serial_number,
+		          brick->enumerate_callbacks.count);
+
+		for (k = 0; k < brick->enumerate_callbacks.count; ++k) {
+			cached_callback = array_get(&brick->enumerate_callbacks, k);
+			enumerate_callback = array_append(callbacks);
+
+			if (enumerate_callback == NULL) {
+				log_error("Could not append to enumerate callback array: %s (%d)",
+				          get_errno_name(errno), errno);
+
+				return;
+			}
+
+			memcpy(enumerate_callback, cached_callback, sizeof(EnumerateCallback));
+
+			enumerate_callback->enumeration_type = ENUMERATION_TYPE_AVAILABLE;
+		}
+	}
+}
+
+// the queued requests of a disconnected client are still sent, but they are
+// not associated with the client anymore
+void usb_forget_owner(void *owner) {
+	int i;
+	Brick *brick;
+
+	for (i = 0; i < _bricks.count; ++i) {
+		brick = array_get(&_bricks, i);
+
+		write_queue_forget_owner(&brick->write_queue, owner);
+	}
+}
+
+// appends copies of the requests of the owner that are still queued for any
+// Brick. a broadcast request is queued for every Brick, but copied only once
+int usb_copy_queued_requests(void *owner, Array *packets) {
+	int i;
+	int k;
+	int m;
+	int first;
+	Brick *brick;
+	Packet *packet;
+
+	for (i = 0; i < _bricks.count; ++i) {
+		brick = array_get(&_bricks, i);
+		first = packets->count;
+
+		if (write_queue_copy_owner(&brick->write_queue, owner, packets) < 0) {
+			return -1;
+		}
+
+		for (k = first; k < packets->count; ++k) {
+			packet = array_get(packets, k);
+
+			if (packet->header.uid != 0) {
+				continue;
+			}
+
+			for (m = 0; m < first; ++m) {
+				if (memcmp(array_get(packets, m), packet, packet->header.length) == 0) {
+					array_remove(packets, k--, NULL);
+
+					break;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+void usb_remove_queued_requests(void *owner) {
+	int i;
+	Brick *brick;
+
+	for (i = 0; i < _bricks.count; ++i) {
+		brick = array_get(&_bricks, i);
+
+		write_queue_remove_owner(&brick->write_queue, owner);
+	}
+}
+
+Array *usb_get_bricks(void) {
+	return &_bricks;
+}
+
 int usb_create_context(libusb_context **context) {
 	int phase = 0;
 	int rc;
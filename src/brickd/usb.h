@@ -25,18 +25,26 @@
 #include <libusb.h>
 
 #include "packet.h"
+#include "utils.h"
 
 // libusbx defines LIBUSB_CALL but libusb doesn't
 #ifndef LIBUSB_CALL
 	#define LIBUSB_CALL
 #endif
 
-int usb_init(void);
+int usb_init(int handed_off);
 void usb_exit(void);
 
 int usb_update(void);
 
-void usb_dispatch_packet(Packet *packet);
+void usb_dispatch_packet(Packet *packet, void *owner);
+void usb_dispatch_enumerate_request(Packet *request, void *owner,
+                                    Array *callbacks);
+void usb_forget_owner(void *owner);
+int usb_copy_queued_requests(void *owner, Array *packets);
+void usb_remove_queued_requests(void *owner);
+
+Array *usb_get_bricks(void);
 
 int usb_create_context(libusb_context **context);
 void usb_destroy_context(libusb_context *context);
@@ -21,8 +21,15 @@
 
 #include <errno.h>
 #include <libusb.h>
-#ifndef _WIN32
+#ifdef _WIN32
+	#include <windows.h>
+#else
 	#include <netdb.h>
+	#ifdef __APPLE__
+		#include <mach/mach_time.h>
+	#else
+		#include <time.h>
+	#endif
 #endif
 #include <stdlib.h>
 #include <string.h>
@@ -41,6 +48,14 @@ int errno_interrupted(void) {
 #endif
 }
 
+int errno_would_block(void) {
+#ifdef _WIN32
+	return errno == ERRNO_WINAPI_OFFSET + WSAEWOULDBLOCK ? 1 : 0;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : 0;
+#endif
+}
+
 const char *get_errno_name(int error_code) {
 	#define ERRNO_NAME(code) case code: return #code
 	#define WINAPI_ERROR_NAME(code) case ERRNO_WINAPI_OFFSET + code: return #code
@@ -547,3 +562,36 @@ void base58_encode(char *str, uint32_t value) {
 		str[k] = '\0';
 	}
 }
+
+// monotonic clock, not affected by changes to the system time
+uint64_t microseconds(void) {
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER counter;
+
+	if (frequency.QuadPart == 0) {
+		QueryPerformanceFrequency(&frequency);
+	}
+
+	QueryPerformanceCounter(&counter);
+
+	return (uint64_t)(counter.QuadPart / frequency.QuadPart) * 1000000 +
+	       (uint64_t)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#elif defined __APPLE__
+	static mach_timebase_info_data_t timebase = { 0, 0 };
+
+	if (timebase.denom == 0) {
+		mach_timebase_info(&timebase);
+	}
+
+	return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0) {
+		return 0;
+	}
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
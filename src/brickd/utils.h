@@ -28,6 +28,7 @@
 #define ERRNO_ADDRINFO_OFFSET 72000000
 
 int errno_interrupted(void);
+int errno_would_block(void);
 
 const char *get_errno_name(int error_code);
 const char *get_libusb_error_name(int error_code);
@@ -61,6 +62,8 @@ int array_find(Array *array, void *item);
 
 void base58_encode(char *str, uint32_t value);
 
+uint64_t microseconds(void);
+
 #ifdef __GNUC__
 	#ifndef __GNUC_PREREQ
 		#define __GNUC_PREREQ(major, minor) \
@@ -0,0 +1,523 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * writequeue.c: Prioritized queue for requests waiting for a write transfer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * requests are sorted into priority classes. the classes are served by smooth
+ * weighted round robin: each non-empty class earns its weight in credits per
+ * selection, the class with the most credits is selected and pays the sum of
+ * the weights of all non-empty classes. this way a getter never waits behind
+ * more than a few bulk setters, but bulk setters are not starved either.
+ *
+ * within a class each client has its own FIFO sub-queue. the sub-queues are
+ * served by deficit round robin, so each client gets the same share of the
+ * USB bandwidth of a class, regardless of how many requests it sends. if the
+ * queue is full, then requests are dropped from the longest sub-queue, this
+ * charges the drop to the client that floods the queue.
+ *
+ * the order of requests for the same UID from the same client is preserved:
+ * a request is never put into a higher priority class than an earlier queued
+ * request of the same client for the same UID.
+ *
+ * for function IDs configured for write coalescing, a setter replaces an
+ * unsent setter of the same client with the same UID and function ID in
+ * place (latest wins), instead of being queued behind it. this is only done
+ * if that setter is the last queued request of the client for the UID, so a
+ * request queued in between never observes the state of the later setter.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "writequeue.h"
+
+#include "config.h"
+#include "log.h"
+
+#define LOG_CATEGORY LOG_CATEGORY_USB
+
+// the quantum is the size of the largest packet, this way a sub-queue can
+// always send its head request after getting one quantum
+#define DEFICIT_QUANTUM ((int)sizeof(Packet))
+
+static const int _weights[WRITE_QUEUE_CLASS_COUNT] = { 8, 4, 1 };
+
+static void write_queue_destroy_sub_queue(WriteSubQueue *sub_queue) {
+	array_destroy(&sub_queue->packets, NULL);
+}
+
+static WriteSubQueue *write_queue_find_sub_queue(WriteClassQueue *class_queue,
+                                                 void *owner) {
+	int i;
+	WriteSubQueue *sub_queue;
+
+	for (i = 0; i < class_queue->sub_queues.count; ++i) {
+		sub_queue = array_get(&class_queue->sub_queues, i);
+
+		if (sub_queue->owner == owner) {
+			return sub_queue;
+		}
+	}
+
+	return NULL;
+}
+
+static int write_queue_knows_uid(WriteSubQueue *sub_queue, uint32_t uid) {
+	int i;
+	Packet *queued_packet;
+
+	for (i = 0; i < sub_queue->packets.count; ++i) {
+		queued_packet = array_get(&sub_queue->packets, i);
+
+		if (queued_packet->header.uid == uid) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static WriteQueueClass write_queue_classify(WriteQueue *queue, Packet *packet,
+                                            void *owner) {
+	WriteQueueClass klass;
+	WriteQueueClass lower;
+	WriteSubQueue *sub_queue;
+
+	if (packet->header.uid == 0) {
+		klass = WRITE_QUEUE_CLASS_CONTROL;
+	} else if (packet->header.response_expected) {
+		klass = WRITE_QUEUE_CLASS_INTERACTIVE;
+	} else {
+		klass = WRITE_QUEUE_CLASS_BULK;
+	}
+
+	// keep the order of requests of the same client for the same UID
+	for (lower = WRITE_QUEUE_CLASS_COUNT - 1; lower > klass; --lower) {
+		sub_queue = write_queue_find_sub_queue(&queue->classes[lower], owner);
+
+		if (sub_queue != NULL &&
+		    write_queue_knows_uid(sub_queue, packet->header.uid)) {
+			return lower;
+		}
+	}
+
+	return klass;
+}
+
+// returns the class that write_queue_pop will take the next request from, or
+// -1 if the queue is empty
+static int write_queue_select_class(WriteQueue *queue) {
+	int klass;
+	int selected = -1;
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		if (queue->classes[klass].sub_queues.count == 0) {
+			continue;
+		}
+
+		if (selected < 0 ||
+		    queue->classes[klass].credits + _weights[klass] >
+		    queue->classes[selected].credits + _weights[selected]) {
+			selected = klass;
+		}
+	}
+
+	return selected;
+}
+
+// returns the sub-queue that write_queue_pop will take the next request from.
+// the class must not be empty. calling this function again without a
+// write_queue_pop call in between returns the same sub-queue
+static WriteSubQueue *write_queue_select_sub_queue(WriteClassQueue *class_queue) {
+	WriteSubQueue *sub_queue = array_get(&class_queue->sub_queues,
+	                                     class_queue->current);
+	Packet *packet = array_get(&sub_queue->packets, 0);
+
+	if (sub_queue->deficit < packet->header.length) {
+		sub_queue->deficit += DEFICIT_QUANTUM;
+	}
+
+	return sub_queue;
+}
+
+const char *write_queue_get_class_name(WriteQueueClass klass) {
+	switch (klass) {
+	case WRITE_QUEUE_CLASS_CONTROL:
+		return "control";
+
+	case WRITE_QUEUE_CLASS_INTERACTIVE:
+		return "interactive";
+
+	case WRITE_QUEUE_CLASS_BULK:
+		return "bulk";
+
+	default:
+		return "<unknown>";
+	}
+}
+
+int write_queue_create(WriteQueue *queue) {
+	int klass;
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		if (array_create(&queue->classes[klass].sub_queues, 8,
+		                 sizeof(WriteSubQueue), 1) < 0) {
+			log_error("Could not create %s write sub-queue array: %s (%d)",
+			          write_queue_get_class_name(klass),
+			          get_errno_name(errno), errno);
+
+			while (--klass >= 0) {
+				array_destroy(&queue->classes[klass].sub_queues, NULL);
+			}
+
+			return -1;
+		}
+
+		queue->classes[klass].current = 0;
+		queue->classes[klass].credits = 0;
+	}
+
+	queue->count = 0;
+
+	return 0;
+}
+
+void write_queue_destroy(WriteQueue *queue) {
+	int klass;
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		array_destroy(&queue->classes[klass].sub_queues,
+		              (FreeFunction)write_queue_destroy_sub_queue);
+	}
+}
+
+// returns the last queued setter that the request can replace, or NULL
+static Packet *write_queue_find_coalescable(WriteQueue *queue,
+                                            WriteQueueClass klass,
+                                            WriteSubQueue *sub_queue,
+                                            Packet *packet, void *owner) {
+	WriteQueueClass lower;
+	WriteSubQueue *lower_sub_queue;
+	Packet *queued_packet;
+	int i;
+
+	// later requests for the same UID can only be in lower priority classes
+	for (lower = klass + 1; lower < WRITE_QUEUE_CLASS_COUNT; ++lower) {
+		lower_sub_queue = write_queue_find_sub_queue(&queue->classes[lower], owner);
+
+		if (lower_sub_queue != NULL &&
+		    write_queue_knows_uid(lower_sub_queue, packet->header.uid)) {
+			return NULL;
+		}
+	}
+
+	for (i = sub_queue->packets.count - 1; i >= 0; --i) {
+		queued_packet = array_get(&sub_queue->packets, i);
+
+		if (queued_packet->header.uid != packet->header.uid) {
+			continue;
+		}
+
+		if (queued_packet->header.function_id == packet->header.function_id &&
+		    !queued_packet->header.response_expected) {
+			return queued_packet;
+		}
+
+		return NULL;
+	}
+
+	return NULL;
+}
+
+// returns 1 if the request replaced an older queued request, returns 0 if it
+// was added to the queue and returns -1 on error
+int write_queue_push(WriteQueue *queue, Packet *packet, void *owner) {
+	WriteQueueClass klass = write_queue_classify(queue, packet, owner);
+	WriteClassQueue *class_queue = &queue->classes[klass];
+	WriteSubQueue *sub_queue = write_queue_find_sub_queue(class_queue, owner);
+	Packet *queued_packet;
+
+	if (sub_queue != NULL && !packet->header.response_expected &&
+	    config_get_write_coalescing(packet->header.function_id)) {
+		queued_packet = write_queue_find_coalescable(queue, klass, sub_queue,
+		                                             packet, owner);
+
+		if (queued_packet != NULL) {
+			memcpy(queued_packet, packet, packet->header.length);
+
+			return 1;
+		}
+	}
+
+	if (sub_queue == NULL) {
+		sub_queue = array_append(&class_queue->sub_queues);
+
+		if (sub_queue == NULL) {
+			log_error("Could not append to %s write sub-queue array: %s (%d)",
+			          write_queue_get_class_name(klass),
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		if (array_create(&sub_queue->packets, 32, sizeof(Packet), 1) < 0) {
+			log_error("Could not create %s write sub-queue: %s (%d)",
+			          write_queue_get_class_name(klass),
+			          get_errno_name(errno), errno);
+
+			array_remove(&class_queue->sub_queues,
+			             class_queue->sub_queues.count - 1, NULL);
+
+			return -1;
+		}
+
+		sub_queue->owner = owner;
+		sub_queue->deficit = 0;
+	}
+
+	queued_packet = array_append(&sub_queue->packets);
+
+	if (queued_packet == NULL) {
+		log_error("Could not append to %s write sub-queue: %s (%d)",
+		          write_queue_get_class_name(klass),
+		          get_errno_name(errno), errno);
+
+		if (sub_queue->packets.count == 0) {
+			array_remove(&class_queue->sub_queues,
+			             class_queue->sub_queues.count - 1,
+			             (FreeFunction)write_queue_destroy_sub_queue);
+		}
+
+		return -1;
+	}
+
+	memcpy(queued_packet, packet, packet->header.length);
+
+	++queue->count;
+
+	return 0;
+}
+
+// returns the request that will be removed by the next write_queue_pop call,
+// or NULL if the queue is empty
+Packet *write_queue_peek(WriteQueue *queue) {
+	int klass = write_queue_select_class(queue);
+	WriteSubQueue *sub_queue;
+
+	if (klass < 0) {
+		return NULL;
+	}
+
+	sub_queue = write_queue_select_sub_queue(&queue->classes[klass]);
+
+	return array_get(&sub_queue->packets, 0);
+}
+
+void write_queue_pop(WriteQueue *queue) {
+	int klass;
+	int selected = write_queue_select_class(queue);
+	int total_weight = 0;
+	WriteClassQueue *class_queue;
+	WriteSubQueue *sub_queue;
+	Packet *packet;
+
+	if (selected < 0) {
+		return;
+	}
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		if (queue->classes[klass].sub_queues.count == 0) {
+			// an idle class doesn't save up credits
+			queue->classes[klass].credits = 0;
+
+			continue;
+		}
+
+		queue->classes[klass].credits += _weights[klass];
+		total_weight += _weights[klass];
+	}
+
+	class_queue = &queue->classes[selected];
+	class_queue->credits -= total_weight;
+
+	sub_queue = write_queue_select_sub_queue(class_queue);
+	packet = array_get(&sub_queue->packets, 0);
+
+	sub_queue->deficit -= packet->header.length;
+
+	array_remove(&sub_queue->packets, 0, NULL);
+
+	--queue->count;
+
+	if (sub_queue->packets.count == 0) {
+		// an empty sub-queue doesn't keep its deficit, the next sub-queue
+		// moves to the current index
+		array_remove(&class_queue->sub_queues, class_queue->current,
+		             (FreeFunction)write_queue_destroy_sub_queue);
+	} else {
+		packet = array_get(&sub_queue->packets, 0);
+
+		if (sub_queue->deficit >= packet->header.length) {
+			return;
+		}
+
+		++class_queue->current;
+	}
+
+	if (class_queue->current >= class_queue->sub_queues.count) {
+		class_queue->current = 0;
+	}
+}
+
+// drops the oldest requests of the longest sub-queues, for equally long
+// sub-queues the lowest priority class is dropped from first
+void write_queue_drop(WriteQueue *queue, int count) {
+	int klass;
+	int i;
+	WriteClassQueue *class_queue;
+	WriteSubQueue *sub_queue;
+	int longest_class;
+	int longest_index;
+	int longest_count;
+
+	while (count > 0 && queue->count > 0) {
+		longest_class = -1;
+		longest_index = -1;
+		longest_count = 0;
+
+		for (klass = WRITE_QUEUE_CLASS_COUNT - 1; klass >= 0; --klass) {
+			class_queue = &queue->classes[klass];
+
+			for (i = 0; i < class_queue->sub_queues.count; ++i) {
+				sub_queue = array_get(&class_queue->sub_queues, i);
+
+				if (sub_queue->packets.count > longest_count) {
+					longest_class = klass;
+					longest_index = i;
+					longest_count = sub_queue->packets.count;
+				}
+			}
+		}
+
+		class_queue = &queue->classes[longest_class];
+		sub_queue = array_get(&class_queue->sub_queues, longest_index);
+
+		array_remove(&sub_queue->packets, 0, NULL);
+
+		--queue->count;
+		--count;
+
+		if (sub_queue->packets.count == 0) {
+			array_remove(&class_queue->sub_queues, longest_index,
+			             (FreeFunction)write_queue_destroy_sub_queue);
+
+			if (class_queue->current > longest_index) {
+				--class_queue->current;
+			}
+
+			if (class_queue->current >= class_queue->sub_queues.count) {
+				class_queue->current = 0;
+			}
+		}
+	}
+}
+
+// the requests of a disconnected client are still sent, but they are not
+// associated with the client anymore
+void write_queue_forget_owner(WriteQueue *queue, void *owner) {
+	int klass;
+	int i;
+	WriteSubQueue *sub_queue;
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		for (i = 0; i < queue->classes[klass].sub_queues.count; ++i) {
+			sub_queue = array_get(&queue->classes[klass].sub_queues, i);
+
+			if (sub_queue->owner == owner) {
+				sub_queue->owner = NULL;
+			}
+		}
+	}
+}
+
+// appends copies of the queued requests of the owner to the packets array.
+// the classes are copied from the highest priority on, because a later
+// request for the same UID is never in a higher class than an earlier one
+int write_queue_copy_owner(WriteQueue *queue, void *owner, Array *packets) {
+	WriteSubQueue *sub_queue;
+	Packet *packet;
+	int klass;
+	int i;
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		sub_queue = write_queue_find_sub_queue(&queue->classes[klass], owner);
+
+		if (sub_queue == NULL) {
+			continue;
+		}
+
+		for (i = 0; i < sub_queue->packets.count; ++i) {
+			packet = array_append(packets);
+
+			if (packet == NULL) {
+				return -1;
+			}
+
+			memcpy(packet, array_get(&sub_queue->packets, i), sizeof(Packet));
+		}
+	}
+
+	return 0;
+}
+
+// removes the queued requests of the owner without sending them
+void write_queue_remove_owner(WriteQueue *queue, void *owner) {
+	int klass;
+	int i;
+	WriteClassQueue *class_queue;
+	WriteSubQueue *sub_queue;
+
+	for (klass = 0; klass < WRITE_QUEUE_CLASS_COUNT; ++klass) {
+		class_queue = &queue->classes[klass];
+
+		for (i = 0; i < class_queue->sub_queues.count; ++i) {
+			sub_queue = array_get(&class_queue->sub_queues, i);
+
+			if (sub_queue->owner != owner) {
+				continue;
+			}
+
+			queue->count -= sub_queue->packets.count;
+
+			array_remove(&class_queue->sub_queues, i,
+			             (FreeFunction)write_queue_destroy_sub_queue);
+
+			if (class_queue->current > i) {
+				--class_queue->current;
+			}
+
+			if (class_queue->current >= class_queue->sub_queues.count) {
+				class_queue->current = 0;
+			}
+
+			break;
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/*
+ * brickd
+ * Copyright (C) 2013 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * writequeue.h: Prioritized queue for requests waiting for a write transfer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef BRICKD_WRITEQUEUE_H
+#define BRICKD_WRITEQUEUE_H
+
+#include "packet.h"
+#include "utils.h"
+
+typedef enum {
+	WRITE_QUEUE_CLASS_CONTROL = 0, // broadcast requests such as enumerate
+	WRITE_QUEUE_CLASS_INTERACTIVE, // requests that expect a response
+	WRITE_QUEUE_CLASS_BULK, // requests that don't expect a response
+	WRITE_QUEUE_CLASS_COUNT
+} WriteQueueClass;
+
+typedef struct {
+	void *owner; // the client that sent the requests, NULL if it's gone
+	Array packets;
+	int deficit; // in bytes
+} WriteSubQueue;
+
+typedef struct {
+	Array sub_queues;
+	int current; // index of the sub-queue served by deficit round robin
+	int credits;
+} WriteClassQueue;
+
+typedef struct {
+	WriteClassQueue classes[WRITE_QUEUE_CLASS_COUNT];
+	int count;
+} WriteQueue;
+
+const char *write_queue_get_class_name(WriteQueueClass klass);
+
+int write_queue_create(WriteQueue *queue);
+void write_queue_destroy(WriteQueue *queue);
+
+int write_queue_push(WriteQueue *queue, Packet *packet, void *owner);
+Packet *write_queue_peek(WriteQueue *queue);
+void write_queue_pop(WriteQueue *queue);
+void write_queue_drop(WriteQueue *queue, int count);
+void write_queue_forget_owner(WriteQueue *queue, void *owner);
+int write_queue_copy_owner(WriteQueue *queue, void *owner, Array *packets);
+void write_queue_remove_owner(WriteQueue *queue, void *owner);
+
+#endif // BRICKD_WRITEQUEUE_H